@@ -3,14 +3,19 @@
 import os
 import io
 import re
+import sys
 import json
 import glob
 import gzip
 import time
+import hashlib
 import pathlib
-import subprocess
+import argparse
+import threading
 import lxml.html
+import urllib.error
 import urllib.request
+import concurrent.futures
 import robust_layer
 
 
@@ -38,7 +43,7 @@ def update_linux_vanilla():
         # try mirror file structure 1: all files placed under / (a simple structure suitable for local mirrors)
         good = True
         for fn in [kernelFile, signFile]:
-            if not util.cmdCallTestSuccess("wget", "--spider", "%s/%s" % (kernelUrl, fn)):
+            if not util.urlExists(myName, "%s/%s" % (kernelUrl, fn)):
                 good = False
                 break
         if good:
@@ -54,7 +59,7 @@ def update_linux_vanilla():
 
         good = True
         for fn in [kernelFile, signFile]:
-            if not util.cmdCallTestSuccess("wget", "--spider", "%s/%s/%s" % (kernelUrl, subdir, fn)):
+            if not util.urlExists(myName, "%s/%s/%s" % (kernelUrl, subdir, fn)):
                 good = False
                 break
         if good:
@@ -229,6 +234,13 @@ def update_linux_addon_alsa_firmware():
 
 class util:
 
+    # set by the command line
+    urlRewrites = []
+    cacheDir = None
+
+    # statistics of the checker running in the current thread
+    tls = threading.local()
+
     @staticmethod
     def countChar(s, c):
         ret = 0
@@ -255,41 +267,95 @@ class util:
 
     @staticmethod
     def fetchJsonData(myName, url):
-        while True:
-            try:
-                with urllib.request.urlopen(url, timeout=robust_layer.TIMEOUT) as resp:
-                    return json.loads(resp.read().decode("utf-8"))
-            except OSError as e:
-                print("%s: Failed to acces %s, %s" % (myName, url, e))
-                time.sleep(robust_layer.RETRY_WAIT)
+        return json.loads(util.fetchUrl(myName, url).decode("utf-8"))
 
     @staticmethod
     def fetchHtmlBinaryData(myName, url):
+        return util.fetchUrl(myName, url)
+
+    @staticmethod
+    def fetchAndParseHtmlPage(myName, url):
+        return lxml.html.parse(io.BytesIO(util.fetchUrl(myName, url)))
+
+    @staticmethod
+    def fetchUrl(myName, url):
+        """GET url, revalidating the copy in the cache directory with ETag / Last-Modified if there is one"""
+
+        url = util._rewriteUrl(myName, url)
+
+        cacheFile = None
+        meta = {}
+        if util.cacheDir is not None:
+            cacheFile = os.path.join(util.cacheDir, hashlib.sha256(url.encode("utf-8")).hexdigest())
+            try:
+                with open(cacheFile + ".json") as f:
+                    meta = json.load(f)
+            except (OSError, ValueError):
+                meta = {}
+
         while True:
+            req = urllib.request.Request(url)
+            if meta.get("etag") is not None:
+                req.add_header("If-None-Match", meta["etag"])
+            if meta.get("last-modified") is not None:
+                req.add_header("If-Modified-Since", meta["last-modified"])
             try:
-                with urllib.request.urlopen(url, timeout=robust_layer.TIMEOUT) as resp:
-                    return resp.read()
+                util._countRequest()
+                with urllib.request.urlopen(req, timeout=robust_layer.TIMEOUT) as resp:
+                    data = resp.read()
+                    if resp.info().get('Content-Encoding') == 'gzip':
+                        data = gzip.decompress(data)
+                    else:
+                        assert resp.info().get('Content-Encoding') is None
+                    if cacheFile is not None and (resp.info().get("ETag") is not None or resp.info().get("Last-Modified") is not None):
+                        # the body first, a new validator must never go with an old body
+                        tmpFile = "%s.%d" % (cacheFile, threading.get_ident())
+                        with open(tmpFile, "wb") as f:
+                            f.write(data)
+                        os.replace(tmpFile, cacheFile)
+                        with open(tmpFile, "w") as f:
+                            json.dump({"etag": resp.info().get("ETag"), "last-modified": resp.info().get("Last-Modified")}, f)
+                        os.replace(tmpFile, cacheFile + ".json")
+                    return data
+            except urllib.error.HTTPError as e:
+                if e.code == 304:
+                    try:
+                        return pathlib.Path(cacheFile).read_bytes()
+                    except OSError:
+                        meta = {}
+                        continue
+                print("%s: Failed to acces %s, %s" % (myName, url, e))
+                time.sleep(robust_layer.RETRY_WAIT)
             except OSError as e:
                 print("%s: Failed to acces %s, %s" % (myName, url, e))
                 time.sleep(robust_layer.RETRY_WAIT)
 
     @staticmethod
-    def fetchAndParseHtmlPage(myName, url):
+    def urlExists(myName, url):
+        url = util._rewriteUrl(myName, url)
         while True:
             try:
-                with urllib.request.urlopen(url, timeout=robust_layer.TIMEOUT) as resp:
-                    if resp.info().get('Content-Encoding') is None:
-                        fakef = resp
-                    elif resp.info().get('Content-Encoding') == 'gzip':
-                        fakef = io.BytesIO(resp.read())
-                        fakef = gzip.GzipFile(fileobj=fakef)
-                    else:
-                        assert False
-                    return lxml.html.parse(fakef)
+                util._countRequest()
+                with urllib.request.urlopen(urllib.request.Request(url, method="HEAD"), timeout=robust_layer.TIMEOUT):
+                    return True
+            except urllib.error.HTTPError:
+                return False
             except OSError as e:
                 print("%s: Failed to acces %s, %s" % (myName, url, e))
                 time.sleep(robust_layer.RETRY_WAIT)
 
+    @staticmethod
+    def _rewriteUrl(myName, url):
+        util.tls.stat["name"] = myName
+        for prefix, repl in util.urlRewrites:
+            if url.startswith(prefix):
+                return repl + url[len(prefix):]
+        return url
+
+    @staticmethod
+    def _countRequest():
+        util.tls.stat["requests"] += 1
+
     @staticmethod
     def renameTo(targetFile):
         bFound = False
@@ -301,15 +367,6 @@ class util:
         assert bFound
         return False
 
-    @staticmethod
-    def cmdCallTestSuccess(cmd, *kargs):
-        ret = subprocess.run([cmd] + list(kargs),
-                             stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
-                             universal_newlines=True)
-        if ret.returncode > 128:
-            time.sleep(1.0)
-        return (ret.returncode == 0)
-
     @staticmethod
     def sed(fn, pattern, repl):
         buf = pathlib.Path(fn).read_text()
@@ -369,13 +426,52 @@ class util:
         return 0
 
 
+def runChecker(func):
+    util.tls.stat = {"name": func.__name__, "requests": 0}
+    startTime = time.monotonic()
+    try:
+        func()
+        err = None
+    except Exception as e:
+        err = e
+    return (util.tls.stat["name"], time.monotonic() - startTime, util.tls.stat["requests"], err)
+
+
 if __name__ == "__main__":
-    update_linux_vanilla()
-    update_linux_addon_linux_firmware()
-    update_linux_addon_virtualbox_modules()
-    update_linux_addon_wireless_regdb()
-    update_linux_addon_broadcom_bt_firmware()
-    update_linux_addon_bluez_firmware()
-    update_linux_addon_ipw2100_firmware()
-    update_linux_addon_ipw2200_firmware()
-    update_linux_addon_alsa_firmware()
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--jobs", type=int, default=4, help="number of packages checked at the same time")
+    parser.add_argument("--no-cache", action="store_true", help="neither use nor update the page cache")
+    parser.add_argument("--url-rewrite", action="append", default=[], metavar="FROM=TO",
+                        help="replace the url prefix FROM with TO, e.g. to check against a local server")
+    args = parser.parse_args()
+
+    for rw in args.url_rewrite:
+        util.urlRewrites.append(tuple(rw.split("=", 1)))
+    if not args.no_cache:
+        util.cacheDir = os.path.join(os.environ.get("XDG_CACHE_HOME", os.path.expanduser("~/.cache")), "bbki-repo-auto-update")
+        os.makedirs(util.cacheDir, exist_ok=True)
+
+    checkers = [
+        update_linux_vanilla,
+        update_linux_addon_linux_firmware,
+        update_linux_addon_virtualbox_modules,
+        update_linux_addon_wireless_regdb,
+        update_linux_addon_broadcom_bt_firmware,
+        update_linux_addon_bluez_firmware,
+        update_linux_addon_ipw2100_firmware,
+        update_linux_addon_ipw2200_firmware,
+        update_linux_addon_alsa_firmware,
+    ]
+
+    failed = False
+    with concurrent.futures.ThreadPoolExecutor(max_workers=args.jobs) as executor:
+        results = list(executor.map(runChecker, checkers))
+
+    print("")
+    for name, elapsed, requests, err in results:
+        if err is not None:
+            print("%s: Failed, %r." % (name, err))
+            failed = True
+        print("%s: %.2fs, %d requests." % (name, elapsed, requests))
+
+    sys.exit(1 if failed else 0)
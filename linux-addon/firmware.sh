@@ -0,0 +1,48 @@
+# Copyright 1999-2021 Bbki Authors
+# Distributed under the terms of the GNU General Public License v3
+
+# Shared by the firmware addons, sourced from their kernel_addon_install():
+#
+#	source "${FILESDIR%/*/*}/firmware.sh"
+#	ins_firmwares_compressed <dir> [<list>]
+#
+# Installs the files below <dir> like ins_firmwares does, or only the paths
+# in the file <list> (one per line, relative to <dir>, globs and directories
+# allowed). Symlinks are resolved, every file is compressed and identical
+# blobs become links to the first of them. The addon has to contribute
+# FW_LOADER_COMPRESS=y, or the kernel does not look for the .xz names.
+
+ins_firmwares_compressed() {
+	local srcdir="$1"
+	local list="$2"
+	local stagedir="$(pwd)/.firmware"
+	local pat f last hash lasthash
+
+	rm -rf "${stagedir}"
+	mkdir "${stagedir}"
+
+	if [ -z "${list}" ] ; then
+		(cd "${srcdir}" && find . -mindepth 1 -maxdepth 1 ! -name ".firmware*" -exec cp -rL {} "${stagedir}" \;) || return 1
+	else
+		while read pat ; do
+			(cd "${srcdir}" && for f in ${pat} ; do
+				[ -e "${f}" ] && cp -rL --parents "${f}" "${stagedir}"
+			done)
+		done < "${list}"
+	fi
+
+	# the kernel only accepts xz with crc32 checks
+	find "${stagedir}" -type f -print0 | xargs -0 -r xz -C crc32
+
+	# identical blobs become links to the first of them
+	find "${stagedir}" -type f -print0 | xargs -0 -r sha256sum | sort | while read hash f ; do
+		if [ "${hash}" = "${lasthash}" ] ; then
+			ln -sfr "${last}" "${f}"
+		else
+			last="${f}"
+			lasthash="${hash}"
+		fi
+	done
+
+	ins_firmwares "${stagedir}"
+}
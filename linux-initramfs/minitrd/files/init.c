@@ -28,6 +28,24 @@
  * are run from the filesystem via execve(). If commands names are given without
  * a path, init will search it's builtin PATH, which is /usr/bin, /usr/sbin.
  * 
+ * A line may start with @opt[,opt...] to set its failure policy: retry=n
+ * retries after the first attempt, backoff=ms is the longest first wait
+ * between attempts (100 by default, doubled each time up to 5 seconds),
+ * deadline=seconds limits all attempts together (alone it means retrying
+ * until then) and onfail=continue|abort|shell says whether the script goes
+ * on, stops, or gets an interactive shell first. A retry happens as soon as
+ * the kernel sends a uevent or the backoff passes.
+ *
+ * Run from a shell, init only prints what the commands would do. With
+ * --sandbox it runs startup.rc for real in private mount and pid namespaces
+ * (as root, on loop devices for instance), prints how long each line took
+ * and, at the end, the mounts it left behind in /proc/self/mountinfo
+ * format. They are gone once the sandbox exits, attached loop devices stay.
+ * switchroot needs the sandbox to be started from a tmpfs root, e.g. in a
+ * chroot; there it moves into the new root and stops, the old root is kept
+ * and neither init nor the deferred lines are run. ../test/sandbox-test.sh
+ * builds such roots and checks the mount trees they end up with.
+ *
  * Currently, init supports the following built in commands.
  *
  * access -[r][w][x][f] path
@@ -35,6 +53,10 @@
  * execture path, or if the file exists (see access(2) for more
  * information).
  * 
+ * policy opt...
+ * Sets the failure policy of the following lines, with the options
+ * described above. Lines without a policy continue after a failure.
+ *
  * echo [item]* [> filename]
  * Echos the text strings given to a file, with a space in between each
  * item. The output may be optionally redirected to a file.
@@ -55,20 +77,76 @@
  * insmod file
  * Insert a module into the kernel.
  *
+ * coldplug
+ * Load the modules needed by the devices currently present. The modalias of
+ * every device in /sys/devices is looked up in modules.alias.bin, the alias
+ * index depmod precompiled when the image was built, and the resulting
+ * modules are inserted by several workers in parallel.
+ *
  * mount -o opts -t type device mntpoint
  * Mounts a filesystem. It does not support NFS, and it must be used in
  * the form given above (arguments must go first).  If "device" is of the
  * form dev-tag (LABEL=xxx or UUID=xxx or UUID_SUB=xxx), it will be
- * searched through libblkid. Normal mount(2) options are supported.
+ * searched by the built-in superblock prober (ext4, btrfs, bcachefs, vfat,
+ * xfs, LUKS, LVM2 PV, bcache and md), then through libblkid unless it is
+ * compiled out. Normal mount(2) options are supported.
  * The defaults mount option is silently ignored.
  * 
+ * devmap-load file
+ * Loads the dev-tag to device map saved by a previous boot. Remembered
+ * devices are confirmed with a single superblock read when a dev-tag is
+ * resolved, the full device scan is only done when that does not match. A
+ * missing file is not an error.
+ *
+ * devmap-save file
+ * Writes the dev-tag to device map back to file if any resolution differed
+ * from the loaded one, file must be on a writable persistent filesystem.
+ *
+ * mount-table fstab [prefix [timeout]]
+ * Mounts the block device entries of an fstab format file below prefix. The
+ * root entry, swap, noauto and _netdev entries are skipped. The superblocks of
+ * all entries are created concurrently, each waiting at most timeout seconds
+ * (30 by default, x-systemd.device-timeout= per entry, a systemd time span
+ * where 0 means forever) for its device, and are attached parent mount point
+ * first. bind and rbind entries take their source below prefix too and are
+ * mounted after all the others. Devices given as
+ * anything but a path, LABEL=, UUID= or UUID_SUB= (PARTUUID=, PARTLABEL=...)
+ * are reported as failures. Failures of nofail entries are ignored.
+ *
+ * fsck-all type device [type device...]
+ * Runs /sbin/fsck.<type> -a on each device. Checks of filesystems sharing a
+ * physical disk (through partitions or the slaves of stacked devices) run one
+ * after another, different disks are checked in parallel. Types without a
+ * checker are skipped. Exit code 1 (errors corrected) is fine, any other
+ * non-zero one is a failure, including 2 (the system should be rebooted).
+ *
+ * blk-tune device attribute=value [...]
+ * Writes block queue attributes (scheduler, read_ahead_kb, nr_requests,
+ * rq_affinity, wbt_lat_usec...) of device, which may be a dev-tag, and of
+ * every device below it: the disk of a partition and the slaves of stacked
+ * devices, recursively. Attributes a stacked device does not have or refuses
+ * are skipped there.
+ *
  * mount-btrfs mntpoint opts device1 [device2...]
  * Mounts a btrfs filesystem. User can specify multiple devices. Devices
- * can be specified in the dev-tag form.
+ * can be specified in the dev-tag form. Members are registered with the
+ * btrfs module as they appear, together with any other device carrying the
+ * same filesystem uuid, and the filesystem is mounted as soon as it is
+ * complete. It fails after 30 seconds, unless x-degraded-timeout=seconds is
+ * in opts, then it is mounted degraded after that time.
  *
  * mount-bcachefs mntpoint opts device1 [device2...]
  * Mounts a bcachefs filesystem. User can specify multiple devices. Devices
- * can be specified in the dev-tag form.
+ * can be specified in the dev-tag form. An encrypted filesystem needs
+ * bcachefs-unlock first.
+ *
+ * bcachefs-unlock opts device
+ * Derive the key of the encrypted bcachefs on device (any member, dev-tag
+ * form allowed) from a passphrase and add it to the keyring, where the
+ * kernel looks for it when the filesystem is mounted. opts is "-" or a
+ * comma separated list of keyfile=path (a file holding the passphrase,
+ * else it is asked for on the console) and keyring=user|session|user_session
+ * (user by default).
  *
  * readlink path
  * Displays the value of the symbolic link "path".
@@ -79,11 +157,30 @@
  * switchroot newrootpath [init command]
  * Makes the filesystem mounted at newrootpath the new root
  * filesystem by moving the mountpoint.  This will only work in 2.6 or
- * later kernels.
+ * later kernels. The time since the kernel started, the time spent in init,
+ * the peak memory use and the number of lines run and failed are logged. If
+ * there are deferred lines, a background worker runs them in the old root,
+ * with /dev, /proc and /sys of the new root bound into it, after init has
+ * been started, then frees the old root. It reports to
+ * /run/minitrd/deferred.log, on a tmpfs mounted on the new /run unless one
+ * is there, and exits.
+ *
+ * defer command
+ * Runs command (which may have its own @policy) only after switchroot, for
+ * things the root filesystem does not need, like sound or wireless modules.
  * 
  * umount path
  * Unmounts the filesystem mounted at path.
  *
+ * resume [device [offset [timeout]]]
+ * Resume from the hibernation image on device, which may be given as a path,
+ * as major:minor or in the dev-tag form. Without arguments the resume= and
+ * resume_offset= kernel arguments are used. Waits at most timeout seconds
+ * (10 by default, or forever with the resumewait kernel argument) for the
+ * device, then boots normally. When resume= is on the kernel command line
+ * this runs automatically right before the first mount, fsck-all or
+ * switchroot.
+ *
  * lvm-lv-activate dev-tag vg-name lv-name
  * Activate the LVM2 logical volume specified by vg-name and lv-name. The logical
  * volume must have a tag (LABEL=xxx or UUID=xxx or UUID_SUB=xxx) that is
@@ -95,35 +192,373 @@
  * bcache-backing-device-activate dev-tag device
  * Activate the backing device for bcache. The bcache device must have a tag
  * (LABEL=xxx or UUID=xxx or UUID_SUB=xxx) that is specified by dev-tag
+ *
+ * luks-open opts name device key [name device key...]
+ * Unlock LUKS2 (or LUKS1) volumes as /dev/mapper/name by creating the dm-crypt
+ * mapping directly through device-mapper ioctls. key is keyfile:path or
+ * keyring:description, a user key in the user keyring. Its content is used as
+ * the raw volume key if it has the right size and matches the volume key
+ * digest, otherwise as the passphrase of each pbkdf2 keyslot in turn (argon2
+ * keyslots can only be opened with the raw key); a key that unlocks nothing
+ * fails before any mapping is created.
+ * opts is a comma separated list of dm-crypt flags (no_read_workqueue,
+ * no_write_workqueue, same_cpu_crypt, submit_from_crypt_cpus, allow_discards)
+ * and ro, or "-" for none. Several volumes are unlocked concurrently.
+ *
+ * verity-open opts name data-device hash-device roothash
+ * Set up the read-only dm-verity device /dev/mapper/name through device-mapper
+ * ioctls, with the geometry taken from the verity superblock on hash-device.
+ * roothash is the hex root hash, a file holding it, or "cmdline" for the
+ * roothash= kernel argument. opts is "-" or a comma separated list of
+ * check_at_most_once, ignore_zero_blocks, restart_on_corruption,
+ * panic_on_corruption, hash_offset=bytes, fec=device, fec_roots=n,
+ * fec_blocks=n, fec_start=n, sig=file (PKCS#7 signature of the root hash)
+ * and noprefetch. Unless noprefetch is given, the upper levels of the hash
+ * tree are warmed by background readers.
+ *
+ * md-assemble mddev dev-tag [degraded-timeout]
+ * Assemble the md array with v1.x superblocks whose array uuid is given by
+ * dev-tag (UUID=xxx) as mddev (/dev/mdN) through md ioctls. Members are
+ * picked up by the built-in superblock prober as they appear. The array is
+ * started as soon as all active members are present. With a write-intent
+ * bitmap it is also started as soon as a quorum (enough members to hold all
+ * the data: one mirror for raid1, one disk per near-copy set for raid10, all
+ * but the parity disks for raid4/5/6) is present and no further member
+ * turned up for a moment; members arriving after that are re-added by a
+ * background process until degraded-timeout seconds (10 by default) have
+ * passed. Without a bitmap such a member would be resynced completely, so
+ * the array waits for all of them. At the deadline it is started degraded
+ * with whatever showed up.
+ *
+ * nbd-connect opts nbddev host[:port] export
+ * Connect nbddev (/dev/nbdN, the nbd module must be loaded) to export on
+ * the NBD server at host, an IP address, port 10809 by default. The
+ * handshake is done here and the sockets are handed to the kernel through
+ * netlink, one hardware queue each. opts is "-" or a comma separated list
+ * of connections=n (the number of CPUs up to 4 by default, 1 unless the
+ * server allows several), block_size=bytes (the server's preference by
+ * default) and timeout=seconds (30 by default), which also bounds
+ * connecting and the handshake (to at most 30 seconds). The device can be
+ * given by dev-tag to the mount commands once this returns.
  */
 
 #include <ctype.h>
 #include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <termios.h>
 #include <unistd.h>
+#include <poll.h>
 #include <libkmod.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/btrfs.h>
+#include <linux/dm-ioctl.h>
+#include <linux/keyctl.h>
 #include <linux/loop.h>
+#include <linux/major.h>
+#include <linux/genetlink.h>
+#include <linux/if_alg.h>
+#include <linux/nbd.h>
+#include <linux/nbd-netlink.h>
+#include <linux/netlink.h>
+#include <linux/sched.h>
+#include <linux/raid/md_p.h>
+#include <linux/raid/md_u.h>
+#ifndef WITHOUT_BLKID
 #include <blkid/blkid.h>
+#endif
 
 
 #define MAX(a, b) ((a) > (b) ? a : b)
+#define MIN(a, b) ((a) < (b) ? a : b)
+
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64 _IOR(0x12, 114, size_t)
+#endif
 
 #define STATFS_RAMFS_MAGIC    0x858458f6
 #define STATFS_TMPFS_MAGIC    0x01021994
 
 
+#ifndef WITHOUT_BLKID
 /*@null@*/ blkid_cache mycache = NULL;
+#endif
+pthread_mutex_t mycacheLock = PTHREAD_MUTEX_INITIALIZER;   /* guards the dev-tag caches, blkid is not thread safe */
 bool testing = false;
 bool quiet = 0;
+bool sandbox = 0;
+
+/*
+ * Bump allocators. Whatever a script line allocates comes from lineArena,
+ * which runStartup() resets after every line, state that outlives a line
+ * comes from globalArena. Chunks are kept for reuse, never freed. Threads
+ * must not allocate from either, forked children may.
+ */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct arenaChunk {
+    struct arenaChunk * next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct arena {
+    struct arenaChunk * head;
+    struct arenaChunk * current;
+};
+
+static struct arena lineArena = { NULL, NULL };
+static struct arena globalArena = { NULL, NULL };
+
+static void * arenaAlloc(struct arena * a, size_t size) {
+    struct arenaChunk * chunk;
+
+    size = (size + 15) & ~(size_t)15;
+
+    /* after a reset the following chunks are reused before new ones are made */
+    for (chunk = a->current; chunk != NULL; chunk = chunk->next) {
+        if (chunk->size - chunk->used >= size)
+            break;
+        if (chunk->next != NULL)
+            chunk->next->used = 0;
+    }
+    if (chunk == NULL) {
+        size_t chunkSize = MAX(size, (size_t)ARENA_CHUNK_SIZE);
+
+        chunk = malloc(sizeof(struct arenaChunk) + chunkSize);
+        if (chunk == NULL) {
+            fprintf(stderr, "init: out of memory\n");
+            exit(1);
+        }
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        if (a->current == NULL) {
+            chunk->next = NULL;
+            a->head = chunk;
+        } else {
+            chunk->next = a->current->next;
+            a->current->next = chunk;
+        }
+    }
+    a->current = chunk;
+    chunk->used += size;
+    return chunk->data + chunk->used - size;
+}
+
+static char * arenaStrndup(struct arena * a, const char * str, size_t len) {
+    char * copy;
+
+    len = strnlen(str, len);
+    copy = arenaAlloc(a, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static char * arenaStrdup(struct arena * a, const char * str) {
+    return arenaStrndup(a, str, strlen(str));
+}
+
+static void arenaReset(struct arena * a) {
+    a->current = a->head;
+    if (a->head != NULL)
+        a->head->used = 0;
+}
+
+/* a mark taken before some allocations frees them all when restored, like a reset back to that point */
+struct arenaMark {
+    struct arenaChunk * chunk;
+    size_t used;
+};
+
+static struct arenaMark arenaGetMark(struct arena * a) {
+    struct arenaMark mark = { a->current, a->current != NULL ? a->current->used : 0 };
+
+    return mark;
+}
+
+static void arenaRestore(struct arena * a, struct arenaMark mark) {
+    if (mark.chunk == NULL) {
+        arenaReset(a);
+        return;
+    }
+    a->current = mark.chunk;
+    mark.chunk->used = mark.used;
+}
+
+/*
+ * Logging. Every record goes to /dev/kmsg with its subsystem, the kernel
+ * timestamps it. Records at or below the console level are queued in a ring
+ * that a helper thread writes to the console, so a slow serial console does
+ * not hold up the script; verbose records are dropped from the console when
+ * the ring is more than half full, they are still in the kernel log. The ring
+ * is drained before each line runs, so output the builtins write themselves
+ * follows the records of its line. In test mode and in forked children records
+ * are written synchronously, a sandbox leaves the host's kernel log alone.
+ */
+#define LOG_RING_SIZE (64 * 1024)
+#define LOG_LINE_SIZE 1024
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char ring[LOG_RING_SIZE];
+    unsigned long long head;    /* bytes queued so far */
+    unsigned long long tail;    /* bytes written so far */
+    unsigned int dropped;
+    bool threaded;
+    pid_t owner;
+    int kmsgFd;
+    int kernelConsoleLevel;     /* records below it are printed by the kernel itself */
+} logState = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, "", 0, 0, 0, false, 0, -1, 0 };
+
+static void * _implLogWriter(void * arg) {
+    pthread_mutex_lock(&logState.lock);
+    while (1) {
+        unsigned long long start;
+        size_t len;
+
+        /* the backlog is written out before the note about what was left out of it */
+        if (logState.head == logState.tail && logState.dropped > 0) {
+            char note[80];
+            int n = snprintf(note, sizeof(note), "<init> (%u messages not shown, see dmesg)\n", logState.dropped);
+            logState.dropped = 0;
+            pthread_mutex_unlock(&logState.lock);
+            (void)write(1, note, n);
+            pthread_mutex_lock(&logState.lock);
+        }
+
+        while (logState.head == logState.tail)
+            pthread_cond_wait(&logState.cond, &logState.lock);
+
+        /* write up to the end of the ring, the wrapped part goes next round */
+        start = logState.tail;
+        len = logState.head - start;
+        if (start % LOG_RING_SIZE + len > LOG_RING_SIZE)
+            len = LOG_RING_SIZE - start % LOG_RING_SIZE;
+        pthread_mutex_unlock(&logState.lock);
+
+        while (len > 0) {
+            ssize_t n = write(1, logState.ring + start % LOG_RING_SIZE, len);
+            if (n <= 0 && errno != EINTR)
+                n = len;
+            if (n > 0) {
+                start += n;
+                len -= n;
+            }
+        }
+
+        pthread_mutex_lock(&logState.lock);
+        logState.tail = start;
+        pthread_cond_broadcast(&logState.cond);
+    }
+    return NULL;
+}
+
+static void logInit(void) {
+    pthread_t thread;
+    char buf[32];
+    int fd, n;
+
+    if (testing)
+        return;
+
+    if (!sandbox)
+        logState.kmsgFd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
+
+    fd = open("/proc/sys/kernel/printk", O_RDONLY);
+    if (fd >= 0) {
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n > 0) {
+            buf[n] = '\0';
+            logState.kernelConsoleLevel = atoi(buf);
+        }
+    }
+
+    logState.owner = getpid();
+    if (!pthread_create(&thread, NULL, _implLogWriter, NULL)) {
+        pthread_detach(thread);
+        logState.threaded = true;
+    }
+}
+
+/* wait until everything queued reached the console, before exec or exit */
+static void logFlush(void) {
+    fflush(stdout);
+    if (!logState.threaded || getpid() != logState.owner)
+        return;
+    pthread_mutex_lock(&logState.lock);
+    while (logState.head != logState.tail)
+        pthread_cond_wait(&logState.cond, &logState.lock);
+    pthread_mutex_unlock(&logState.lock);
+}
+
+static void logMsg(int level, const char * subsystem, const char * fmt, ...) __attribute__((format(printf, 3, 4)));
+static void logMsg(int level, const char * subsystem, const char * fmt, ...) {
+    char msg[LOG_LINE_SIZE];
+    char line[LOG_LINE_SIZE + 64];
+    va_list ap;
+    int len, i;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    /* verbose records are filed as debug so the kernel never echoes them to the console synchronously */
+    if (logState.kmsgFd >= 0) {
+        len = snprintf(line, sizeof(line), "<%d>minitrd[%s]: %s\n",
+                       LOG_DAEMON | (level <= LOG_WARNING ? level : LOG_DEBUG), subsystem, msg);
+        (void)write(logState.kmsgFd, line, MIN(len, (int)sizeof(line) - 1));
+    }
+
+    if (level > (quiet ? LOG_WARNING : LOG_INFO))
+        return;
+    if (logState.kmsgFd >= 0 && level <= LOG_WARNING && level < logState.kernelConsoleLevel)
+        return;
+
+    len = snprintf(line, sizeof(line), "<init> %s\n", msg);
+    len = MIN(len, (int)sizeof(line) - 1);
+    if (!logState.threaded || getpid() != logState.owner) {
+        fputs(line, stdout);
+        return;
+    }
+
+    pthread_mutex_lock(&logState.lock);
+    if (level > LOG_WARNING && logState.head - logState.tail + len > LOG_RING_SIZE / 2) {
+        logState.dropped++;
+    } else {
+        while (logState.head - logState.tail + len > LOG_RING_SIZE)
+            pthread_cond_wait(&logState.cond, &logState.lock);
+        for (i = 0; i < len; i++)
+            logState.ring[(logState.head + i) % LOG_RING_SIZE] = line[i];
+        logState.head += len;
+        pthread_cond_broadcast(&logState.cond);
+    }
+    pthread_mutex_unlock(&logState.lock);
+}
 
 #define PATH "/bin:/sbin:/usr/bin:/usr/sbin"
 
@@ -203,20 +638,22 @@ char * getArg(char * cmd, char * end, char ** arg) {
 
 #define CMDLINESIZE 1024
 
-/* get the contents of the kernel command line from /proc/cmdline */
+/* get a modifiable copy of the kernel command line, /proc/cmdline is read only once */
 static char * getKernelCmdLine(void) {
+    static char * cmdline = NULL;
     int fd, i;
     char * buf;
 
+    if (cmdline != NULL)
+        return arenaStrdup(&lineArena, cmdline);
+
     fd = open("/proc/cmdline", O_RDONLY, 0);
     if (fd < 0) {
         fprintf(stderr, "getKernelCmdLine: failed to open /proc/cmdline: %d\n", errno);
         return NULL;
     }
 
-    buf = malloc(CMDLINESIZE);
-    if (!buf)
-        return buf;
+    buf = arenaAlloc(&globalArena, CMDLINESIZE);
 
     i = read(fd, buf, CMDLINESIZE);
     if (i < 0) {
@@ -230,7 +667,8 @@ static char * getKernelCmdLine(void) {
         buf[0] = '\0';
     else
         buf[i - 1] = '\0';
-    return buf;
+    cmdline = buf;
+    return arenaStrdup(&lineArena, cmdline);
 }
 
 static int hasKernelArg(char *arg) {
@@ -283,25 +721,522 @@ static char * getKernelArg(char * arg) {
     return NULL;
 }
 
-void waitForDev(const char *device) {
+/* get the value of a kernel arg "arg" (eg. "resume="), terminated at the first space */
+static char * getKernelArgValue(char * arg) {
+    char * start, * end;
+
+    start = getKernelArg(arg);
+    if (start == NULL) {
+        return NULL;
+    }
+    end = start;
+    while (*end != '\0' && !isspace(*end))
+        end++;
+    return arenaStrndup(&lineArena, start, end - start);
+}
+
+static long long monotonicMsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* time since the kernel started, including time spent suspended */
+static long long boottimeMsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Native superblock prober. Only the formats we boot from are recognized, and
+ * only the superblock offsets they use are read, so resolving a dev-tag costs
+ * a few reads per device instead of a probe of every known type. Readahead is
+ * started on all new devices before the first one is read. Results are kept
+ * until the device disappears from /sys/class/block, changes size or gets a
+ * new diskseq (the kernel bumps it whenever the media changes, e.g. a loop
+ * device is reattached); failed reads are not kept at all.
+ */
+#define PROBE_MAX_DEVICES 256
+
+struct probeDevice {
+    dev_t dev;
+    unsigned long long size;    /* in 512 byte sectors */
+    unsigned long long diskseq; /* of the disk, 0 on kernels without it */
+    char devName[64];
+    char type[24];
+    char uuid[40];
+    char uuidSub[40];
+    char label[256];
+    bool seen;
+};
+
+static struct probeDevice * probeDevices = NULL;
+static int probeDeviceCount = 0;
+
+static const unsigned char bcacheMagic[16] = {
+    0xc6, 0x85, 0x73, 0xf6, 0x4e, 0x1a, 0x45, 0xca, 0x82, 0x65, 0xf5, 0x7f, 0x48, 0xba, 0x6d, 0x81
+};
+static const unsigned char bcachefsMagic[16] = {
+    0xc6, 0x85, 0x73, 0xf6, 0x66, 0xce, 0x90, 0xa9, 0xd9, 0x6a, 0x60, 0xcf, 0x80, 0x3d, 0xf7, 0xef
+};
+
+static void _implProbeUuid(char * buf, const unsigned char * uuid) {
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10)
+            *buf++ = '-';
+        *buf++ = hex[uuid[i] >> 4];
+        *buf++ = hex[uuid[i] & 0xf];
+    }
+    *buf = '\0';
+}
+
+static void _implProbeLabel(char * buf, int buf_len, const unsigned char * label, int len) {
+    while (len > 0 && (label[len - 1] == ' ' || label[len - 1] == '\0'))
+        len--;
+    if (len >= buf_len)
+        len = buf_len - 1;
+    memcpy(buf, label, len);
+    buf[len] = '\0';
+}
+
+/* head is the first 8KiB, btrfs the 1KiB at 64KiB, tail the 4KiB md v1.0 superblock slot */
+static void _implProbeParse(struct probeDevice * pd, const unsigned char * head, const unsigned char * btrfs, const unsigned char * tail) {
+    const unsigned char * p;
+    int i;
+
+    /* containers first, an array member or an encrypted volume may look like a filesystem too */
+    for (i = 0; i < 3; i++) {
+        p = (i == 0) ? head : (i == 1) ? head + 4096 : tail;
+        if (p != NULL && le32toh(*(uint32_t *)p) == MD_SB_MAGIC && le32toh(*(uint32_t *)(p + 4)) == 1) {
+            strcpy(pd->type, "linux_raid_member");
+            _implProbeUuid(pd->uuid, p + 16);
+            _implProbeUuid(pd->uuidSub, p + 168);
+            _implProbeLabel(pd->label, sizeof(pd->label), p + 32, 32);
+            return;
+        }
+    }
+
+    if (!memcmp(head, "LUKS\xba\xbe", 6)) {
+        strcpy(pd->type, "crypto_LUKS");
+        _implProbeLabel(pd->uuid, sizeof(pd->uuid), head + 168, 40);
+        if (be16toh(*(uint16_t *)(head + 6)) == 2)
+            _implProbeLabel(pd->label, sizeof(pd->label), head + 24, 48);
+        return;
+    }
+
+    for (i = 0; i < 4; i++) {
+        p = head + 512 * i;
+        if (!memcmp(p, "LABELONE", 8) && !memcmp(p + 24, "LVM2 001", 8)) {
+            unsigned int off = le32toh(*(uint32_t *)(p + 20));
+            const unsigned char * id = p + off;
+            char * out = pd->uuid;
+            int j;
+
+            if (512 * i + off + 32 > 8192)
+                break;
+            strcpy(pd->type, "LVM2_member");
+            for (j = 0; j < 32; j++) {
+                if (j == 6 || j == 10 || j == 14 || j == 18 || j == 22 || j == 26)
+                    *out++ = '-';
+                *out++ = id[j];
+            }
+            *out = '\0';
+            return;
+        }
+    }
+
+    /* bcache and bcachefs share the superblock location, bcache versions are small */
+    p = head + 4096;
+    if (!memcmp(p + 24, bcacheMagic, 16) || !memcmp(p + 24, bcachefsMagic, 16)) {
+        if (!memcmp(p + 24, bcacheMagic, 16) && le64toh(*(uint64_t *)(p + 16)) <= 4) {
+            strcpy(pd->type, "bcache");
+            _implProbeUuid(pd->uuid, p + 40);
+        } else {
+            strcpy(pd->type, "bcachefs");
+            _implProbeUuid(pd->uuid, p + 56);
+        }
+        _implProbeLabel(pd->label, sizeof(pd->label), p + 72, 32);
+        return;
+    }
+
+    if (btrfs != NULL && !memcmp(btrfs + 0x40, "_BHRfS_M", 8)) {
+        strcpy(pd->type, "btrfs");
+        _implProbeUuid(pd->uuid, btrfs + 0x20);
+        _implProbeUuid(pd->uuidSub, btrfs + 0xc9 + 0x42);
+        _implProbeLabel(pd->label, sizeof(pd->label), btrfs + 0x12b, 256);
+        return;
+    }
+
+    if (le16toh(*(uint16_t *)(head + 1024 + 0x38)) == 0xef53) {
+        strcpy(pd->type, "ext4");
+        _implProbeUuid(pd->uuid, head + 1024 + 0x68);
+        _implProbeLabel(pd->label, sizeof(pd->label), head + 1024 + 0x78, 16);
+        return;
+    }
+
+    if (!memcmp(head, "XFSB", 4)) {
+        strcpy(pd->type, "xfs");
+        _implProbeUuid(pd->uuid, head + 32);
+        _implProbeLabel(pd->label, sizeof(pd->label), head + 108, 12);
+        return;
+    }
+
+    /* FAT32 keeps the volume id and label further into the boot sector than FAT12/16 */
+    if (head[510] == 0x55 && head[511] == 0xaa &&
+        (!memcmp(head + 82, "FAT32   ", 8) || !memcmp(head + 54, "FAT1", 4))) {
+        int off = memcmp(head + 82, "FAT32   ", 8) ? 39 : 67;
+        unsigned int id = le32toh(*(uint32_t *)(head + off));
+
+        strcpy(pd->type, "vfat");
+        snprintf(pd->uuid, sizeof(pd->uuid), "%04X-%04X", id >> 16, id & 0xffff);
+        if (memcmp(head + off + 4, "NO NAME    ", 11))
+            _implProbeLabel(pd->label, sizeof(pd->label), head + off + 4, 11);
+        return;
+    }
+}
+
+static int _implProbeReadSysfs(const char * path, char * buf, int buf_len) {
+    int fd, n;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    n = read(fd, buf, buf_len - 1);
+    close(fd);
+    if (n <= 0)
+        return 1;
+    while (n > 0 && buf[n - 1] == '\n')
+        n--;
+    buf[n] = '\0';
+    return 0;
+}
+
+/* refresh the device table from /sys/class/block, caller holds mycacheLock */
+static void _implProbeScan(void) {
+    struct probeDevice * pending[PROBE_MAX_DEVICES];
+    int fds[PROBE_MAX_DEVICES];
+    int pendingCount = 0;
+    DIR * dir;
+    struct dirent * ent;
+    int i;
+
+    if (probeDevices == NULL) {
+        probeDevices = calloc(PROBE_MAX_DEVICES, sizeof(struct probeDevice));
+        if (probeDevices == NULL)
+            return;
+    }
+    for (i = 0; i < probeDeviceCount; i++)
+        probeDevices[i].seen = false;
+
+    dir = opendir("/sys/class/block");
+    if (dir == NULL)
+        return;
+    while ((ent = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        char buf[64];
+        unsigned int maj, min;
+        unsigned long long size;
+        unsigned long long diskseq = 0;
+        struct probeDevice * pd;
+        dev_t dev;
+
+        if (ent->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "/sys/class/block/%s/dev", ent->d_name);
+        if (_implProbeReadSysfs(path, buf, sizeof(buf)) || sscanf(buf, "%u:%u", &maj, &min) != 2)
+            continue;
+        snprintf(path, sizeof(path), "/sys/class/block/%s/size", ent->d_name);
+        if (_implProbeReadSysfs(path, buf, sizeof(buf)) || (size = strtoull(buf, NULL, 10)) == 0)
+            continue;
+        dev = makedev(maj, min);
+
+        /* partitions share the diskseq of their disk */
+        snprintf(path, sizeof(path), "/sys/class/block/%s/diskseq", ent->d_name);
+        if (_implProbeReadSysfs(path, buf, sizeof(buf))) {
+            snprintf(path, sizeof(path), "/sys/class/block/%s/../diskseq", ent->d_name);
+            if (_implProbeReadSysfs(path, buf, sizeof(buf)))
+                *buf = '\0';
+        }
+        diskseq = strtoull(buf, NULL, 10);
+
+        for (i = 0; i < probeDeviceCount; i++) {
+            if (probeDevices[i].dev == dev && probeDevices[i].size == size && probeDevices[i].diskseq == diskseq)
+                break;
+        }
+        if (i < probeDeviceCount) {
+            probeDevices[i].seen = true;
+            continue;
+        }
+        /* known devices are still marked when the table is full, new ones just aren't probed */
+        if (probeDeviceCount + pendingCount == PROBE_MAX_DEVICES)
+            continue;
+
+        pd = &probeDevices[probeDeviceCount + pendingCount];
+        memset(pd, 0, sizeof(*pd));
+        pd->dev = dev;
+        pd->size = size;
+        pd->diskseq = diskseq;
+        pd->seen = true;
+
+        /* device-mapper devices are known by their /dev/mapper name */
+        snprintf(path, sizeof(path), "/sys/class/block/%s/dm/name", ent->d_name);
+        if (!_implProbeReadSysfs(path, buf, sizeof(buf)))
+            snprintf(pd->devName, sizeof(pd->devName), "/dev/mapper/%s", buf);
+        if (!*pd->devName || access(pd->devName, F_OK))
+            snprintf(pd->devName, sizeof(pd->devName), "/dev/%s", ent->d_name);
+
+        fds[pendingCount] = open(pd->devName, O_RDONLY | O_CLOEXEC);
+        if (fds[pendingCount] < 0)
+            continue;
+        pending[pendingCount++] = pd;
+    }
+    closedir(dir);
+
+    /* queue the reads of all devices before waiting for any of them */
+    for (i = 0; i < pendingCount; i++) {
+        (void)posix_fadvise(fds[i], 0, 8192, POSIX_FADV_WILLNEED);
+        if (pending[i]->size >= 256)
+            (void)posix_fadvise(fds[i], 65536, 1024, POSIX_FADV_WILLNEED);
+        if (pending[i]->size >= 128)
+            (void)posix_fadvise(fds[i], ((pending[i]->size - 16) & ~7ULL) << 9, 4096, POSIX_FADV_WILLNEED);
+    }
+
+    for (i = 0; i < pendingCount; i++) {
+        unsigned char head[8192];
+        unsigned char btrfs[1024];
+        unsigned char tail[4096];
+        unsigned long long size = pending[i]->size;
+        bool hasBtrfs, hasTail;
+
+        memset(head, 0, sizeof(head));
+        if (pread(fds[i], head, sizeof(head), 0) > 0) {
+            hasBtrfs = (size >= 256 && pread(fds[i], btrfs, sizeof(btrfs), 65536) == sizeof(btrfs));
+            hasTail = (size >= 128 && pread(fds[i], tail, sizeof(tail), ((size - 16) & ~7ULL) << 9) == sizeof(tail));
+            _implProbeParse(pending[i], head, hasBtrfs ? btrfs : NULL, hasTail ? tail : NULL);
+        } else {
+            /* dropped below and probed again next time */
+            pending[i]->seen = false;
+        }
+        close(fds[i]);
+    }
+
+    /* pending devices were filled in right after the known ones, devices that went away are dropped */
+    probeDeviceCount += pendingCount;
+    for (i = 0; i < probeDeviceCount; ) {
+        if (!probeDevices[i].seen)
+            probeDevices[i] = probeDevices[--probeDeviceCount];
+        else
+            i++;
+    }
+}
+
+static bool _implProbeMatch(struct probeDevice * pd, const char * token, const char * value) {
+    if (!*pd->type)
+        return false;
+    if (!strcmp(token, "LABEL"))
+        return !strcmp(pd->label, value);
+    if (!strcmp(token, "UUID"))
+        return !strcasecmp(pd->uuid, value);
+    if (!strcmp(token, "UUID_SUB"))
+        return *pd->uuidSub && !strcasecmp(pd->uuidSub, value);
+    return false;
+}
+
+static struct probeDevice * _implProbeFind(const char * token, const char * value) {
+    int i;
+
+    for (i = 0; i < probeDeviceCount; i++) {
+        if (_implProbeMatch(&probeDevices[i], token, value))
+            return &probeDevices[i];
+    }
+    return NULL;
+}
+
+/*
+ * Last-known-good device map, loaded by devmap-load and written back by
+ * devmap-save when it changed. A remembered device is checked by reading only
+ * the superblock its type lives in, the full scan is done on a mismatch.
+ */
+#define DEVMAP_MAX_ENTRIES 64
+
+struct devmapEntry {
+    char tag[300];
+    char devName[64];
+    char type[24];
+    dev_t dev;
+};
+
+static struct devmapEntry devmapEntries[DEVMAP_MAX_ENTRIES];
+static int devmapCount = 0;
+static bool devmapDirty = false;
+
+static struct devmapEntry * _implDevmapFind(const char * token, const char * value) {
+    char tag[300];
+    int i;
+
+    snprintf(tag, sizeof(tag), "%s=%s", token, value);
+    for (i = 0; i < devmapCount; i++) {
+        if (!strcmp(devmapEntries[i].tag, tag))
+            return &devmapEntries[i];
+    }
+    return NULL;
+}
+
+static bool _implDevmapVerify(struct devmapEntry * e, const char * token, const char * value) {
+    unsigned char head[8192];
+    unsigned char buf[4096];
+    struct probeDevice pd;
+    struct stat st;
+    int fd;
+
+    if (stat(e->devName, &st) || !S_ISBLK(st.st_mode) || st.st_rdev != e->dev)
+        return false;
+    fd = open(e->devName, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    memset(&pd, 0, sizeof(pd));
+    memset(head, 0, sizeof(head));
+    if (!strcmp(e->type, "btrfs")) {
+        if (pread(fd, buf, 1024, 65536) == 1024)
+            _implProbeParse(&pd, head, buf, NULL);
+    } else if (pread(fd, head, sizeof(head), 0) > 0) {
+        unsigned long long size;
+
+        /* md v1.0 is the only format not found at the start */
+        if (!strcmp(e->type, "linux_raid_member") && !ioctl(fd, BLKGETSIZE64, &size) && size >= 65536 &&
+            pread(fd, buf, sizeof(buf), (((size >> 9) - 16) & ~7ULL) << 9) == sizeof(buf))
+            _implProbeParse(&pd, head, NULL, buf);
+        else
+            _implProbeParse(&pd, head, NULL, NULL);
+    }
+    close(fd);
+
+    return !strcmp(pd.type, e->type) && _implProbeMatch(&pd, token, value);
+}
+
+static void _implDevmapRecord(const char * token, const char * value, struct probeDevice * pd) {
+    struct devmapEntry * e = _implDevmapFind(token, value);
+
+    if (e == NULL) {
+        if (devmapCount == DEVMAP_MAX_ENTRIES)
+            return;
+        e = &devmapEntries[devmapCount++];
+        snprintf(e->tag, sizeof(e->tag), "%s=%s", token, value);
+    } else if (!strcmp(e->devName, pd->devName) && !strcmp(e->type, pd->type) && e->dev == pd->dev) {
+        return;
+    }
+    snprintf(e->devName, sizeof(e->devName), "%s", pd->devName);
+    snprintf(e->type, sizeof(e->type), "%s", pd->type);
+    e->dev = pd->dev;
+    devmapDirty = true;
+}
+
+/* resolve a dev-tag to a device name, the native prober is asked first, returns NULL or a string to be freed */
+char * evaluateTag(const char * token, const char * value) {
+    struct devmapEntry * e;
+    struct probeDevice * pd;
+    char * devName = NULL;
+
+    pthread_mutex_lock(&mycacheLock);
+    e = _implDevmapFind(token, value);
+    if (e != NULL && _implDevmapVerify(e, token, value)) {
+        devName = strdup(e->devName);
+        pthread_mutex_unlock(&mycacheLock);
+        return devName;
+    }
+
+    _implProbeScan();
+    pd = _implProbeFind(token, value);
+    if (pd != NULL) {
+        devName = strdup(pd->devName);
+        _implDevmapRecord(token, value, pd);
+    }
+#ifndef WITHOUT_BLKID
+    else {
+        devName = blkid_evaluate_tag(token, value, &mycache);
+    }
+#endif
+    pthread_mutex_unlock(&mycacheLock);
+
+    return devName;
+}
+
+/* how long a burst of uevents is waited out, in ms */
+#define UEVENT_SETTLE 20
+
+static int _implUeventOpen(void) {
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;     /* kernel uevents */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* wait at most timeout ms for uevents, a burst of them is waited out for a short while */
+static void _implUeventWait(int fd, int timeout) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    long long deadline = monotonicMsec() + timeout;
+    char buf[4096];
+
+    if (fd < 0) {
+        (void)usleep(timeout * 1000);
+        return;
+    }
+    while (poll(&pfd, 1, timeout) > 0) {
+        while (recv(fd, buf, sizeof(buf), 0) > 0)
+            ;
+        timeout = MIN(UEVENT_SETTLE, (int)(deadline - monotonicMsec()));
+        if (timeout <= 0)
+            break;
+    }
+}
+
+/* wait until device appears, timeout is in seconds, negative means forever, returns 0 if the device is present */
+int waitForDevTimeout(const char *device, int timeout) {
     const char * token;
     const char * value;
+    long long deadline = monotonicMsec() + (long long)timeout * 1000;
 
     token = parseDevTag(device, &value);
     do {
         if (token != NULL) {
-            if (blkid_evaluate_tag(token, value, &mycache) != NULL) {
-                break;
+            char * devName = evaluateTag(token, value);
+            if (devName != NULL) {
+                free(devName);
+                return 0;
             }
         } else {
             if (!access(device, F_OK)) {
-                break;
+                return 0;
             }
         }
-        (void)sleep(1);
+        if (timeout >= 0 && monotonicMsec() >= deadline) {
+            return 1;
+        }
+        (void)usleep(100000);
     } while(1);
 }
 
+void waitForDev(const char *device) {
+    (void)waitForDevTimeout(device, -1);
+}
+
 /* remove all files/directories below dirName -- don't cross mountpoints */
 static int recursiveRemove(int fd)
 {
@@ -375,6 +1310,41 @@ done:
     return rc;
 }
 
+/*
+ * Workers that outlive their line (verity prefetch, md stragglers). We are
+ * pid 1, so they can't be handed off to anyone and are reaped here after
+ * each line. The wait4(-1) loops elsewhere may reap them first, ECHILD just
+ * drops them from the list.
+ */
+#define MAX_BACKGROUND 32
+
+static pid_t backgroundPids[MAX_BACKGROUND];
+static int backgroundCount = 0;
+
+static void reapBackground(void) {
+    int i = 0;
+
+    while (i < backgroundCount) {
+        pid_t rc = waitpid(backgroundPids[i], NULL, WNOHANG);
+
+        if (rc == backgroundPids[i] || (rc < 0 && errno == ECHILD)) {
+            backgroundPids[i] = backgroundPids[--backgroundCount];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void addBackground(pid_t pid) {
+    reapBackground();
+    if (backgroundCount == MAX_BACKGROUND) {
+        /* out of slots, wait for the oldest one */
+        (void)waitpid(backgroundPids[0], NULL, 0);
+        backgroundPids[0] = backgroundPids[--backgroundCount];
+    }
+    backgroundPids[backgroundCount++] = pid;
+}
+
 /* va_list causes segment fault, so I use this method */
 #define MAX_ARGV_COUNT 127
 static int runBinaryImpl(const char *bin, const char *argArray[], int argArrayLen) {
@@ -397,27 +1367,13 @@ static int runBinaryImpl(const char *bin, const char *argArray[], int argArrayLe
         return 1;
     }
 
-    theArgv = (char **)malloc(sizeof(char *) * (MAX_ARGV_COUNT + 1));
-    if (theArgv == NULL) {
-        fprintf(stderr, "init: out of memory\n");
-        return 1;
-    }
+    theArgv = arenaAlloc(&lineArena, sizeof(char *) * (MAX_ARGV_COUNT + 1));
 
     nextArg = theArgv;
-    *nextArg = strdup(bin);
-    if (*nextArg == NULL) {
-        fprintf(stderr, "init: out of memory\n");
-        return 1;
-    }
-    nextArg++;
+    *nextArg++ = arenaStrdup(&lineArena, bin);
 
     for (i = 0; i < argArrayLen; i++) {
-        *nextArg = strdup(argArray[i]);
-        if (*nextArg == NULL) {
-            fprintf(stderr, "init: out of memory\n");
-            return 1;
-        }
-        nextArg++;
+        *nextArg++ = arenaStrdup(&lineArena, argArray[i]);
     }
     *nextArg = NULL;
 
@@ -548,6 +1504,210 @@ int insmodCommand(char * cmd, char * end) {
     return 0;
 }
 
+#define MAX_COLDPLUG_WORKERS 8
+
+struct coldplugSet {
+    char ** names;
+    int count;
+    int cap;
+};
+
+static int _implColdplugAdd(struct coldplugSet * set, const char * name) {
+    int i;
+
+    for (i = 0; i < set->count; i++) {
+        if (!strcmp(set->names[i], name))
+            return 0;
+    }
+
+    if (set->count == set->cap) {
+        char ** names = arenaAlloc(&lineArena, sizeof(char *) * (set->cap ? set->cap * 2 : 64));
+        if (set->count > 0)
+            memcpy(names, set->names, sizeof(char *) * set->count);
+        set->names = names;
+        set->cap = set->cap ? set->cap * 2 : 64;
+    }
+
+    set->names[set->count++] = arenaStrdup(&lineArena, name);
+    return 0;
+}
+
+/* look up the modalias of every device below dfd in the alias index, don't follow symlinks */
+static int _implColdplugScan(struct kmod_ctx * ctx, int dfd, struct coldplugSet * set) {
+    DIR * dir;
+    struct dirent * d;
+    int fd;
+
+    fd = openat(dfd, "modalias", O_RDONLY);
+    if (fd >= 0) {
+        char alias[512];
+        int len = read(fd, alias, sizeof(alias) - 1);
+
+        close(fd);
+        while (len > 0 && isspace(alias[len - 1]))
+            len--;
+        if (len > 0) {
+            struct kmod_list * list = NULL;
+            struct kmod_list * l;
+
+            alias[len] = '\0';
+            if (kmod_module_new_from_lookup(ctx, alias, &list) == 0) {
+                kmod_list_foreach(l, list) {
+                    struct kmod_module * mod = kmod_module_get_module(l);
+                    if (testing) {
+                        printf("coldplug: %s -> %s\n", alias, kmod_module_get_name(mod));
+                    }
+                    if (_implColdplugAdd(set, kmod_module_get_name(mod))) {
+                        kmod_module_unref(mod);
+                        kmod_module_unref_list(list);
+                        return 1;
+                    }
+                    kmod_module_unref(mod);
+                }
+                kmod_module_unref_list(list);
+            }
+        }
+    }
+
+    if (!(dir = fdopendir(dfd))) {
+        close(dfd);
+        return 0;
+    }
+
+    while ((d = readdir(dir))) {
+        int cfd;
+
+        if (d->d_name[0] == '.')
+            continue;
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (d->d_type != DT_DIR && d->d_type != DT_UNKNOWN)
+            continue;
+#endif
+        cfd = openat(dirfd(dir), d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (cfd < 0)
+            continue;
+        if (_implColdplugScan(ctx, cfd, set)) {
+            closedir(dir);
+            return 1;
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/* load every module whose index modulo nworkers is worker, returns the number of failures */
+static int _implColdplugLoad(struct coldplugSet * set, int worker, int nworkers) {
+    const char * null_config = NULL;
+    struct kmod_ctx * ctx;
+    int failed = 0;
+    int i;
+
+    ctx = kmod_new(NULL, &null_config);
+    if (!ctx) {
+        fprintf(stderr, "coldplug: kmod_new() failed\n");
+        return set->count;
+    }
+
+    for (i = worker; i < set->count; i += nworkers) {
+        struct kmod_module * mod;
+        int err;
+
+        err = kmod_module_new_from_name(ctx, set->names[i], &mod);
+        if (err < 0) {
+            fprintf(stderr, "coldplug: could not find module %s: %s\n", set->names[i], strerror(-err));
+            failed++;
+            continue;
+        }
+
+        /* another worker may be inserting a shared dependency at the same time */
+        err = kmod_module_probe_insert_module(mod, 0, NULL, NULL, NULL, NULL);
+        if (err < 0 && err != -EEXIST) {
+            fprintf(stderr, "coldplug: could not insert module %s: %s\n", set->names[i], strerror(-err));
+            failed++;
+        }
+        kmod_module_unref(mod);
+    }
+
+    kmod_unref(ctx);
+    return failed;
+}
+
+int coldplugCommand(char * cmd, char * end) {
+    const char * null_config = NULL;
+    struct coldplugSet set = { NULL, 0, 0 };
+    struct kmod_ctx * ctx;
+    int pids[MAX_COLDPLUG_WORKERS];
+    int nworkers;
+    int rc = 0;
+    int fd, i;
+
+    if (cmd < end) {
+        fprintf(stderr, "coldplug: unexpected arguments\n");
+        return 1;
+    }
+
+    ctx = kmod_new(NULL, &null_config);
+    if (!ctx) {
+        fprintf(stderr, "coldplug: kmod_new() failed\n");
+        return 1;
+    }
+
+    /* map modules.alias.bin and modules.dep.bin once instead of per lookup */
+    if (kmod_load_resources(ctx) < 0) {
+        fprintf(stderr, "coldplug: failed to load module indexes\n");
+        kmod_unref(ctx);
+        return 1;
+    }
+
+    fd = open("/sys/devices", O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        fprintf(stderr, "coldplug: failed to open /sys/devices: %d\n", errno);
+        kmod_unref(ctx);
+        return 1;
+    }
+
+    rc = _implColdplugScan(ctx, fd, &set);
+    kmod_unref(ctx);
+    if (rc || testing || set.count == 0) {
+        return rc;
+    }
+
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers > MAX_COLDPLUG_WORKERS)
+        nworkers = MAX_COLDPLUG_WORKERS;
+    if (nworkers > set.count)
+        nworkers = set.count;
+    if (nworkers < 1)
+        nworkers = 1;
+
+    for (i = 0; i < nworkers; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            int failed = _implColdplugLoad(&set, i, nworkers);
+            _exit(failed > 255 ? 255 : failed);
+        }
+        if (pids[i] < 0) {
+            /* load the rest of this share ourselves */
+            fprintf(stderr, "coldplug: fork failed: %d\n", errno);
+            if (_implColdplugLoad(&set, i, nworkers))
+                rc = 1;
+        }
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        int status;
+
+        if (pids[i] <= 0)
+            continue;
+        if (waitpid(pids[i], &status, 0) != pids[i] || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
+
 int _implMountConvertOptions(char * cmd_name, char * options, int * pflags, char * buf, int buf_len) {
     char * start = options;
     char * end;
@@ -626,7 +1786,7 @@ int _implMountConvertDevice(char * cmd_name, char * device, char * buf, int buf_
 
     token = parseDevTag(device, &value);
     if (token != NULL) {
-        char * devName = blkid_evaluate_tag(token, value, &mycache);
+        char * devName = evaluateTag(token, value);
         if (devName == NULL) {
             fprintf(stderr, "%s: failed to get device specified by %s\n", cmd_name, device);
             return 1;
@@ -649,7 +1809,153 @@ int _implMountConvertDevice(char * cmd_name, char * device, char * buf, int buf_
     return 0;
 }
 
-int _implDoMount(char * fsType, char * options, int flags, char * device, char * mntPoint) {
+/* new mount API, the syscall numbers are the same on all architectures */
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_fsopen
+#define __NR_fsopen 430
+#endif
+#ifndef __NR_fsconfig
+#define __NR_fsconfig 431
+#endif
+#ifndef __NR_fsmount
+#define __NR_fsmount 432
+#endif
+
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC          0x00000001
+#define FSMOUNT_CLOEXEC         0x00000001
+#define FSCONFIG_SET_FLAG       0
+#define FSCONFIG_SET_STRING     1
+#define FSCONFIG_CMD_CREATE     6
+#define MOUNT_ATTR_RDONLY       0x00000001
+#define MOUNT_ATTR_NOSUID       0x00000002
+#define MOUNT_ATTR_NODEV        0x00000004
+#define MOUNT_ATTR_NOEXEC       0x00000008
+#define MOUNT_ATTR_RELATIME     0x00000000
+#define MOUNT_ATTR_NOATIME      0x00000010
+#define MOUNT_ATTR_STRICTATIME  0x00000020
+#define MOUNT_ATTR_NODIRATIME   0x00000080
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+
+#define MOUNT_API_UNSUPPORTED   (-2)
+
+/* print the messages the kernel queued on the filesystem context */
+static void _implPrintFsContextErrors(char * cmd_name, int fsfd) {
+    char buf[512];
+    int n;
+
+    while ((n = read(fsfd, buf, sizeof(buf) - 1)) > 0) {
+        buf[n] = '\0';
+        fprintf(stderr, "%s: %s\n", cmd_name, buf);
+    }
+}
+
+/* create the superblock and a detached mount for it, returns the mount fd, -1 on error or MOUNT_API_UNSUPPORTED */
+int _implPrepareMount(char * cmd_name, char * fsType, char * options, int flags, char * device) {
+    unsigned int attrs = 0;
+    int fsfd, mfd;
+
+    fsfd = syscall(__NR_fsopen, fsType, FSOPEN_CLOEXEC);
+    if (fsfd < 0) {
+        if (errno == ENOSYS) {
+            return MOUNT_API_UNSUPPORTED;
+        }
+        fprintf(stderr, "%s: error %d opening filesystem context for %s\n", cmd_name, errno, fsType);
+        return -1;
+    }
+
+    if (device != NULL && syscall(__NR_fsconfig, fsfd, FSCONFIG_SET_STRING, "source", device, 0)) {
+        fprintf(stderr, "%s: error %d setting source %s\n", cmd_name, errno, device);
+        goto fail;
+    }
+
+    if (options != NULL) {
+        char * opts = strdup(options);
+        char * opt, * savePtr;
+
+        if (opts == NULL) {
+            fprintf(stderr, "%s: out of memory\n", cmd_name);
+            goto fail;
+        }
+        for (opt = strtok_r(opts, ",", &savePtr); opt != NULL; opt = strtok_r(NULL, ",", &savePtr)) {
+            char * value = strchr(opt, '=');
+            int err;
+
+            if (value != NULL) {
+                *value++ = '\0';
+                err = syscall(__NR_fsconfig, fsfd, FSCONFIG_SET_STRING, opt, value, 0);
+            } else {
+                err = syscall(__NR_fsconfig, fsfd, FSCONFIG_SET_FLAG, opt, NULL, 0);
+            }
+            if (err) {
+                fprintf(stderr, "%s: error %d setting option %s\n", cmd_name, errno, opt);
+                free(opts);
+                goto fail;
+            }
+        }
+        free(opts);
+    }
+
+    /* MS_RDONLY and MS_SYNCHRONOUS are superblock flags, the rest are per-mount attributes */
+    if ((flags & MS_RDONLY) && syscall(__NR_fsconfig, fsfd, FSCONFIG_SET_FLAG, "ro", NULL, 0)) {
+        fprintf(stderr, "%s: error %d setting option ro\n", cmd_name, errno);
+        goto fail;
+    }
+    if ((flags & MS_SYNCHRONOUS) && syscall(__NR_fsconfig, fsfd, FSCONFIG_SET_FLAG, "sync", NULL, 0)) {
+        fprintf(stderr, "%s: error %d setting option sync\n", cmd_name, errno);
+        goto fail;
+    }
+
+    if (syscall(__NR_fsconfig, fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0)) {
+        fprintf(stderr, "%s: error %d mounting %s (%s)\n", cmd_name, errno, device, fsType);
+        goto fail;
+    }
+
+    if (flags & MS_RDONLY)
+        attrs |= MOUNT_ATTR_RDONLY;
+    if (flags & MS_NOSUID)
+        attrs |= MOUNT_ATTR_NOSUID;
+    if (flags & MS_NODEV)
+        attrs |= MOUNT_ATTR_NODEV;
+    if (flags & MS_NOEXEC)
+        attrs |= MOUNT_ATTR_NOEXEC;
+    if (flags & MS_NODIRATIME)
+        attrs |= MOUNT_ATTR_NODIRATIME;
+    if (flags & MS_NOATIME)
+        attrs |= MOUNT_ATTR_NOATIME;
+    else if (flags & MS_STRICTATIME)
+        attrs |= MOUNT_ATTR_STRICTATIME;
+
+    mfd = syscall(__NR_fsmount, fsfd, FSMOUNT_CLOEXEC, attrs);
+    if (mfd < 0) {
+        fprintf(stderr, "%s: error %d creating mount for %s\n", cmd_name, errno, device);
+        goto fail;
+    }
+
+    close(fsfd);
+    return mfd;
+
+fail:
+    _implPrintFsContextErrors(cmd_name, fsfd);
+    close(fsfd);
+    return -1;
+}
+
+/* attach a mount created by _implPrepareMount() at mntPoint, consumes mfd */
+int _implAttachMount(char * cmd_name, int mfd, char * mntPoint) {
+    if (syscall(__NR_move_mount, mfd, "", AT_FDCWD, mntPoint, MOVE_MOUNT_F_EMPTY_PATH)) {
+        fprintf(stderr, "%s: error %d attaching mount at %s\n", cmd_name, errno, mntPoint);
+        close(mfd);
+        return 1;
+    }
+    close(mfd);
+    return 0;
+}
+
+int _implDoMount(char * cmd_name, char * fsType, char * options, int flags, char * device, char * mntPoint) {
     if (testing) {
         printf("mount -o '%s' -t '%s' '%s' '%s'%s%s%s%s%s%s%s%s%s\n",
             options, fsType, device, mntPoint,
@@ -664,8 +1970,20 @@ int _implDoMount(char * fsType, char * options, int flags, char * device, char *
             (flags & MS_RELATIME) ? " +relatime " : ""
         );
     } else {
+        /* remounts and bind mounts don't create a superblock, keep them on mount(2) */
+        if (!(flags & (MS_REMOUNT | MS_BIND))) {
+            int mfd = _implPrepareMount(cmd_name, fsType, options, flags, device);
+            if (mfd >= 0) {
+                return _implAttachMount(cmd_name, mfd, mntPoint);
+            }
+            if (mfd != MOUNT_API_UNSUPPORTED) {
+                /* callee prints error message */
+                return 1;
+            }
+        }
+
         if (mount(device, mntPoint, fsType, flags, options)) {
-            fprintf(stderr, "mount: error %d mounting %s (%s)\n", errno, device, fsType);
+            fprintf(stderr, "%s: error %d mounting %s (%s)\n", cmd_name, errno, device, fsType);
             return 1;
         }
     }
@@ -728,7 +2046,7 @@ int mountCommand(char * cmd, char * end) {
 
     /* need to deal with options */ 
     if (options) {
-        char * newOpts = alloca(strlen(options) + 1);
+        char * newOpts = arenaAlloc(&lineArena, strlen(options) + 1);
         *newOpts = '\0';
         if (_implMountConvertOptions("mount", options, &flags, newOpts, strlen(options) + 1)) {
             /* callee prints error message */
@@ -738,16 +2056,16 @@ int mountCommand(char * cmd, char * end) {
     }
 
     if (*device != '/') {
-        char * newDevice = alloca(strlen(device) + 1);
+        char * newDevice = arenaAlloc(&lineArena, PATH_MAX);
         *newDevice = '\0';
-        if (_implMountConvertDevice("mount", device, newDevice, strlen(device) + 1)) {
+        if (_implMountConvertDevice("mount", device, newDevice, PATH_MAX)) {
             /* callee prints error message */
             return 1;
         }
         device = newDevice;
     }
 
-    if (_implDoMount(fsType, options, flags, device, mntPoint)) {
+    if (_implDoMount("mount", fsType, options, flags, device, mntPoint)) {
         /* callee prints error message */
         return 1;
     }
@@ -755,14 +2073,61 @@ int mountCommand(char * cmd, char * end) {
     return 0;
 }
 
+#define BTRFS_MAX_MEMBERS 64
+#define BTRFS_DEFAULT_TIMEOUT 30
+
+/* without /dev/btrfs-control the members are named in the mount options */
+static int _implMountBtrfsByOptions(char * mntPoint, char * options, int flags, char ** devices, int deviceCount) {
+    char realOptions[4096];
+    char * lastDev = NULL;
+    int i;
+
+    snprintf(realOptions, sizeof(realOptions), "%s", options);
+    for (i = 0; i < deviceCount; i++) {
+        char * prefix = (*realOptions ? ",device=" : "device=");
+
+        if (strlen(realOptions) + strlen(prefix) + 1 > 4096) {
+            fprintf(stderr, "mount-btrfs: options are too long\n");
+            return 1;
+        }
+        strcat(realOptions, prefix);
+
+        lastDev = realOptions + strlen(realOptions);
+        if (_implMountConvertDevice("mount-btrfs", devices[i], lastDev, 4096 - (lastDev - realOptions))) {
+            /* callee prints error message */
+            return 1;
+        }
+    }
+
+    return _implDoMount("mount-btrfs", "btrfs", realOptions, flags, lastDev, mntPoint);
+}
+
+/* BTRFS_IOC_SCAN_DEV or BTRFS_IOC_DEVICES_READY on devName */
+static int _implBtrfsControl(int ctlFd, unsigned long request, const char * devName) {
+    struct btrfs_ioctl_vol_args args;
+
+    memset(&args, 0, sizeof(args));
+    snprintf(args.name, sizeof(args.name), "%s", devName);
+    return ioctl(ctlFd, request, &args);
+}
+
 int mountBtrfsCommand(char * cmd, char * end) {
     char * usage = "usage: mount-btrfs <mntpoint> <opts> <device1> [device2...]";
     char * mntPoint;
     char * options;
+    char * kernelOptions;
     char realOptions[4096] = "";
+    char * devices[BTRFS_MAX_MEMBERS];
+    bool deviceFound[BTRFS_MAX_MEMBERS];
+    dev_t members[BTRFS_MAX_MEMBERS];
+    char readyDev[PATH_MAX] = "";
+    char fsUuid[40] = "";
     int flags = MS_MGC_VAL;
-    char * lastDev = NULL;
-    int i;
+    int deviceCount = 0, memberCount = 0;
+    int degradedTimeout = -1;
+    int ctlFd, ufd, rc, i, j;
+    long long deadline;
+    char * opt, * save;
 
     /* parse <mntpoint> */
     cmd = getArg(cmd, end, &mntPoint);
@@ -771,51 +2136,175 @@ int mountBtrfsCommand(char * cmd, char * end) {
         return 1;
     }
 
-    /* parse <opts> */
+    /* parse <opts>, x-degraded-timeout is ours, the rest goes to the kernel */
     cmd = getArg(cmd, end, &options);
     if (!cmd) {
         fprintf(stderr, "%s\n", usage);
         return 1;
     }
-    if (_implMountConvertOptions("mount-btrfs", options, &flags, realOptions, 4096)) {
+    kernelOptions = arenaAlloc(&lineArena, strlen(options) + 1);
+    *kernelOptions = '\0';
+    for (opt = strtok_r(options, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        if (!strncmp(opt, "x-degraded-timeout=", strlen("x-degraded-timeout="))) {
+            degradedTimeout = atoi(opt + strlen("x-degraded-timeout="));
+            continue;
+        }
+        if (*kernelOptions)
+            strcat(kernelOptions, ",");
+        strcat(kernelOptions, opt);
+    }
+    if (_implMountConvertOptions("mount-btrfs", kernelOptions, &flags, realOptions, 4096)) {
         /* callee prints error message */
         return 1;
     }
 
     /* parse <device1> <device2> ... */
-    for (i = 0; cmd < end; i++) {
-        char * prefix = (*realOptions ? ",device=" : "device=");
-        char * device;
-
-        cmd = getArg(cmd, end, &device);
-        if (!cmd) {
-            fprintf(stderr, "mount-btrfs: failed to parse device %d\n", i + 1);
-            return 1;
-        }
-
-        if (strlen(realOptions) + strlen(prefix) + 1 > 4096) {
-            fprintf(stderr, "mount-btrfs: options are too long\n");
+    while (cmd < end) {
+        if (deviceCount == BTRFS_MAX_MEMBERS) {
+            fprintf(stderr, "mount-btrfs: too many devices\n");
             return 1;
         }
-        strcat(realOptions, prefix);
-
-        lastDev = realOptions + strlen(realOptions);
-        if (_implMountConvertDevice("mount-btrfs", device, lastDev, 4096 - (lastDev - realOptions))) {
-            /* callee prints error message */
+        cmd = getArg(cmd, end, &devices[deviceCount]);
+        if (!cmd) {
+            fprintf(stderr, "mount-btrfs: failed to parse device %d\n", deviceCount + 1);
             return 1;
         }
+        deviceFound[deviceCount++] = false;
     }
-    if (i == 0) {
+    if (deviceCount == 0) {
         fprintf(stderr, "%s\n", usage);
         return 1;
     }
 
-    if (_implDoMount("btrfs", realOptions, flags, lastDev, mntPoint)) {
+    ctlFd = testing ? -1 : open("/dev/btrfs-control", O_RDWR | O_CLOEXEC);
+    if (ctlFd < 0) {
+        return _implMountBtrfsByOptions(mntPoint, realOptions, flags, devices, deviceCount);
+    }
+
+    /*
+     * Members are handed to the btrfs module as they appear, the named ones
+     * and any other device the prober finds with the same filesystem uuid,
+     * until the module says the filesystem is complete.
+     */
+    ufd = _implUeventOpen();
+    deadline = monotonicMsec() + (long long)(degradedTimeout >= 0 ? degradedTimeout : BTRFS_DEFAULT_TIMEOUT) * 1000;
+    while (1) {
+        struct stat sb;
+
+        for (i = 0; i < deviceCount; i++) {
+            const char * token, * value;
+            char * devName;
+
+            if (deviceFound[i])
+                continue;
+            token = parseDevTag(devices[i], &value);
+            if (token != NULL) {
+                devName = evaluateTag(token, value);
+            } else {
+                devName = access(devices[i], F_OK) ? NULL : strdup(devices[i]);
+            }
+            if (devName == NULL)
+                continue;
+            deviceFound[i] = true;
+
+            if (stat(devName, &sb) || !S_ISBLK(sb.st_mode)) {
+                fprintf(stderr, "mount-btrfs: %s is not a block device\n", devName);
+                free(devName);
+                goto fail;
+            }
+            for (j = 0; j < memberCount && members[j] != sb.st_rdev; j++)
+                ;
+            if (j == memberCount) {
+                if (_implBtrfsControl(ctlFd, BTRFS_IOC_SCAN_DEV, devName)) {
+                    fprintf(stderr, "mount-btrfs: failed to register %s: %d\n", devName, errno);
+                    free(devName);
+                    goto fail;
+                }
+                members[memberCount++] = sb.st_rdev;
+            }
+            if (!*readyDev)
+                snprintf(readyDev, sizeof(readyDev), "%s", devName);
+            free(devName);
+        }
+
+        /* the filesystem uuid of the first member tells the others */
+        if (*readyDev) {
+            char candNames[BTRFS_MAX_MEMBERS][64];
+            dev_t candDevs[BTRFS_MAX_MEMBERS];
+            int candidates = 0;
+
+            pthread_mutex_lock(&mycacheLock);
+            _implProbeScan();
+            if (!*fsUuid && !stat(readyDev, &sb)) {
+                for (i = 0; i < probeDeviceCount; i++) {
+                    if (probeDevices[i].dev == sb.st_rdev && !strcmp(probeDevices[i].type, "btrfs"))
+                        strcpy(fsUuid, probeDevices[i].uuid);
+                }
+            }
+            for (i = 0; *fsUuid && i < probeDeviceCount && candidates < BTRFS_MAX_MEMBERS; i++) {
+                struct probeDevice * pd = &probeDevices[i];
+
+                if (strcmp(pd->type, "btrfs") || strcmp(pd->uuid, fsUuid))
+                    continue;
+                strcpy(candNames[candidates], pd->devName);
+                candDevs[candidates++] = pd->dev;
+            }
+            pthread_mutex_unlock(&mycacheLock);
+
+            for (i = 0; i < candidates && memberCount < BTRFS_MAX_MEMBERS; i++) {
+                for (j = 0; j < memberCount && members[j] != candDevs[i]; j++)
+                    ;
+                if (j < memberCount)
+                    continue;
+                if (_implBtrfsControl(ctlFd, BTRFS_IOC_SCAN_DEV, candNames[i])) {
+                    fprintf(stderr, "mount-btrfs: failed to register %s: %d\n", candNames[i], errno);
+                    continue;
+                }
+                members[memberCount++] = candDevs[i];
+            }
+
+            rc = _implBtrfsControl(ctlFd, BTRFS_IOC_DEVICES_READY, readyDev);
+            if (rc == 0)
+                break;
+            if (rc < 0) {
+                fprintf(stderr, "mount-btrfs: failed to query %s: %d\n", readyDev, errno);
+                goto fail;
+            }
+        }
+
+        if (monotonicMsec() >= deadline) {
+            if (degradedTimeout < 0 || !*readyDev) {
+                fprintf(stderr, "mount-btrfs: filesystem is incomplete after %d seconds\n",
+                        degradedTimeout >= 0 ? degradedTimeout : BTRFS_DEFAULT_TIMEOUT);
+                goto fail;
+            }
+            logMsg(LOG_WARNING, "btrfs", "mounting %s degraded with %d device(s)", mntPoint, memberCount);
+            if (strlen(realOptions) + strlen(",degraded") + 1 > sizeof(realOptions)) {
+                fprintf(stderr, "mount-btrfs: options are too long\n");
+                goto fail;
+            }
+            strcat(realOptions, *realOptions ? ",degraded" : "degraded");
+            break;
+        }
+        _implUeventWait(ufd, 100);
+    }
+
+    if (ufd >= 0)
+        close(ufd);
+    close(ctlFd);
+
+    if (_implDoMount("mount-btrfs", "btrfs", realOptions, flags, readyDev, mntPoint)) {
         /* callee prints error message */
         return 1;
     }
 
     return 0;
+
+fail:
+    if (ufd >= 0)
+        close(ufd);
+    close(ctlFd);
+    return 1;
 }
 
 int mountBcachefsCommand(char * cmd, char * end) {
@@ -872,7 +2361,7 @@ int mountBcachefsCommand(char * cmd, char * end) {
         return 1;
     }
 
-    if (_implDoMount("bcachefs", realOptions, flags, realDevices, mntPoint)) {
+    if (_implDoMount("mount-bcachefs", "bcachefs", realOptions, flags, realDevices, mntPoint)) {
         /* callee prints error message */
         return 1;
     }
@@ -880,730 +2369,4600 @@ int mountBcachefsCommand(char * cmd, char * end) {
     return 0;
 }
 
-int otherCommand(char * bin, char * cmd, char * end, int doFork) {
-    char ** args;
-    char ** nextArg;
-    int pid, wpid;
-    int status;
-    char fullPath[255];
-    static const char * sysPath = PATH;
-    const char * pathStart;
-    const char * pathEnd;
-    char * stdoutFile = NULL;
-    int stdoutFd = 0;
-
-    args = (char **)malloc(sizeof(char *) * 128);
-    if (!args)
-        return 1;
-    nextArg = args;
+#define MOUNT_TABLE_MAX_ENTRIES     64
+#define MOUNT_TABLE_DEFAULT_TIMEOUT 30
 
-    if (!strchr(bin, '/')) {
-        pathStart = sysPath;
-        while (*pathStart) {
-            pathEnd = strchr(pathStart, ':');
+struct mountTableEntry {
+    char * device;
+    char * fsType;
+    char mntPoint[PATH_MAX];
+    char options[1024];
+    int flags;
+    int timeout;
+    bool nofail;
+    bool bind;              /* device is a path below prefix, bind mounted */
+    int parent;             /* index of the entry mounted below, -1 for none */
+    int mfd;                /* prepared mount, -1 on error */
+    bool failed;
+    bool threadValid;
+    pthread_t thread;
+};
 
-            if (!pathEnd) pathEnd = pathStart + strlen(pathStart);
+/* decode the octal escapes (\040 and friends) fstab uses for white space */
+static void _implFstabUnescape(char * s) {
+    char * out = s;
 
-            strncpy(fullPath, pathStart, pathEnd - pathStart);
-            fullPath[pathEnd - pathStart] = '/';
-            strcpy(fullPath + (pathEnd - pathStart + 1), bin); 
+    while (*s) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *out++ = (s[1] - '0') * 64 + (s[2] - '0') * 8 + (s[3] - '0');
+            s += 4;
+        } else {
+            *out++ = *s++;
+        }
+    }
+    *out = '\0';
+}
 
-            pathStart = pathEnd;
-            if (*pathStart) pathStart++;
+/*
+ * parse a systemd time span ("90", "500ms", "1min 30s", "infinity") into
+ * seconds, rounded up; 0 and infinity mean forever (-1), -2 if s is not one
+ */
+static int _implParseTimespan(const char * s) {
+    static const struct {
+        const char * name;
+        long long usec;
+    } units[] = {
+        { "", 1000000LL }, { "us", 1LL }, { "usec", 1LL }, { "ms", 1000LL }, { "msec", 1000LL },
+        { "s", 1000000LL }, { "sec", 1000000LL }, { "second", 1000000LL }, { "seconds", 1000000LL },
+        { "m", 60000000LL }, { "min", 60000000LL }, { "minute", 60000000LL }, { "minutes", 60000000LL },
+        { "h", 3600000000LL }, { "hr", 3600000000LL }, { "hour", 3600000000LL }, { "hours", 3600000000LL },
+        { "d", 86400000000LL }, { "day", 86400000000LL }, { "days", 86400000000LL },
+    };
+    long long total = 0;
+    bool any = false;
+
+    if (!strcmp(s, "infinity"))
+        return -1;
+
+    while (1) {
+        unsigned long long n;
+        char * p;
+        size_t len;
+        int i;
+
+        while (isspace(*s))
+            s++;
+        if (*s == '\0')
+            break;
+        if (!isdigit(*s))
+            return -2;
+        n = strtoull(s, &p, 10);
+        for (s = p; isspace(*s); s++)
+            ;
+        for (len = 0; isalpha(s[len]); len++)
+            ;
+        for (i = 0; i < (int)(sizeof(units) / sizeof(units[0])); i++) {
+            if (strlen(units[i].name) == len && !strncmp(units[i].name, s, len))
+                break;
+        }
+        if (i == (int)(sizeof(units) / sizeof(units[0])))
+            return -2;
+        s += len;
+        /* longer than anybody waits for a device */
+        if (n > (unsigned long long)INT_MAX * 1000000ULL / units[i].usec)
+            return -1;
+        total += n * units[i].usec;
+        if (total > (long long)INT_MAX * 1000000LL)
+            return -1;
+        any = true;
+    }
+
+    if (!any)
+        return -2;
+    if (total == 0)
+        return -1;
+    return (total + 999999) / 1000000;
+}
+
+static int _implMountPointDepth(const char * path) {
+    int depth = 0;
+
+    for (; *path; path++) {
+        if (*path == '/' && path[1] != '/' && path[1] != '\0')
+            depth++;
+    }
+    return depth;
+}
+
+static bool _implIsMountPointBelow(const char * child, const char * parent) {
+    int len = strlen(parent);
+
+    while (len > 0 && parent[len - 1] == '/')
+        len--;
+    return !strncmp(child, parent, len) && child[len] == '/';
+}
+
+/* wait for the device and create the superblock, everything but attaching it */
+static void * _implMountTableWorker(void * arg) {
+    struct mountTableEntry * e = arg;
+    char devName[PATH_MAX];
+
+    e->mfd = -1;
+    if (waitForDevTimeout(e->device, e->timeout)) {
+        fprintf(stderr, "mount-table: device %s for %s did not show up in %d seconds\n", e->device, e->mntPoint, e->timeout);
+        return NULL;
+    }
+    if (_implMountConvertDevice("mount-table", e->device, devName, sizeof(devName))) {
+        /* callee prints error message */
+        return NULL;
+    }
+    e->mfd = _implPrepareMount("mount-table", e->fsType, *e->options ? e->options : NULL, e->flags, devName);
+    return NULL;
+}
+
+/* parse fstab into entries sorted so that every entry comes after the one it is mounted below */
+static int _implMountTableParse(char * contents, char * prefix, int defaultTimeout, struct mountTableEntry * entries, int * pCount) {
+    char * line, * savePtr;
+    int count = 0;
+    int i, j;
+
+    for (line = strtok_r(contents, "\n", &savePtr); line != NULL; line = strtok_r(NULL, "\n", &savePtr)) {
+        char * fields[4];
+        char * fieldSave;
+        char * opt, * optSave;
+        char options[1024] = "";
+        struct mountTableEntry * e;
+        int n;
+
+        while (isspace(*line)) line++;
+        if (*line == '#' || *line == '\0')
+            continue;
+
+        for (n = 0, fields[0] = strtok_r(line, " \t", &fieldSave); n < 4 && fields[n] != NULL; ) {
+            if (++n < 4)
+                fields[n] = strtok_r(NULL, " \t", &fieldSave);
+        }
+        if (n < 4) {
+            fprintf(stderr, "mount-table: malformed line for %s\n", fields[0]);
+            return 1;
+        }
+        for (n = 0; n < 4; n++)
+            _implFstabUnescape(fields[n]);
+
+        /* the root filesystem is already mounted, pseudo filesystems are left to the real init */
+        if (!strcmp(fields[1], "/") || !strcmp(fields[2], "swap") ||
+            (*fields[0] != '/' && parseDevTag(fields[0], NULL) == NULL && strchr(fields[0], '=') == NULL))
+            continue;
+
+        if (count == MOUNT_TABLE_MAX_ENTRIES) {
+            fprintf(stderr, "mount-table: too many entries\n");
+            return 1;
+        }
+        e = &entries[count];
+        memset(e, 0, sizeof(*e));
+        e->device = fields[0];
+        e->fsType = fields[2];
+        e->flags = MS_MGC_VAL;
+        e->timeout = defaultTimeout;
+        e->parent = -1;
+        e->mfd = -1;
+        snprintf(e->mntPoint, sizeof(e->mntPoint), "%s%s", prefix, fields[1]);
+
+        /* options only meaningful to user space are consumed here */
+        for (opt = strtok_r(fields[3], ",", &optSave); opt != NULL; opt = strtok_r(NULL, ",", &optSave)) {
+            if (!strcmp(opt, "noauto") || !strcmp(opt, "_netdev")) {
+                break;
+            } else if (!strcmp(opt, "nofail")) {
+                e->nofail = true;
+            } else if (!strcmp(opt, "bind") || !strcmp(opt, "rbind")) {
+                e->bind = true;
+                e->flags |= MS_BIND | (!strcmp(opt, "rbind") ? MS_REC : 0);
+            } else if (!strncmp(opt, "x-systemd.device-timeout=", strlen("x-systemd.device-timeout="))) {
+                e->timeout = _implParseTimespan(opt + strlen("x-systemd.device-timeout="));
+                if (e->timeout < -1) {
+                    fprintf(stderr, "mount-table: invalid time span in %s\n", opt);
+                    return 1;
+                }
+            } else if (!strncmp(opt, "x-", 2) || !strcmp(opt, "auto") || !strcmp(opt, "user") || !strcmp(opt, "nouser")) {
+                ;
+            } else {
+                snprintf(options + strlen(options), sizeof(options) - strlen(options), "%s%s", *options ? "," : "", opt);
+            }
+        }
+        if (opt != NULL)
+            continue;
+
+        if (_implMountConvertOptions("mount-table", options, &e->flags, e->options, sizeof(e->options))) {
+            /* callee prints error message */
+            return 1;
+        }
+
+        if (e->bind) {
+            char * source = arenaAlloc(&lineArena, strlen(prefix) + strlen(fields[0]) + 1);
+
+            sprintf(source, "%s%s", prefix, fields[0]);
+            e->device = source;
+        } else if (*e->device != '/' && parseDevTag(e->device, NULL) == NULL) {
+            /* PARTUUID=, PARTLABEL= and friends, fails like a device that never showed up */
+            fprintf(stderr, "mount-table: unsupported device %s for %s\n", e->device, e->mntPoint);
+            e->failed = true;
+        }
+        count++;
+    }
+
+    /* parents have fewer path components than their children */
+    for (i = 1; i < count; i++) {
+        struct mountTableEntry tmp = entries[i];
+        for (j = i; j > 0 && _implMountPointDepth(entries[j - 1].mntPoint) > _implMountPointDepth(tmp.mntPoint); j--)
+            entries[j] = entries[j - 1];
+        entries[j] = tmp;
+    }
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < i; j++) {
+            if (_implIsMountPointBelow(entries[i].mntPoint, entries[j].mntPoint))
+                entries[i].parent = j;
+        }
+    }
+
+    *pCount = count;
+    return 0;
+}
+
+int mountTableCommand(char * cmd, char * end) {
+    char * usage = "usage: mount-table <fstab> [prefix [timeout]]";
+    char * fstab;
+    char * prefix = "";
+    char * timeoutStr = NULL;
+    char * contents;
+    struct mountTableEntry * entries;
+    struct stat sb;
+    int count = 0;
+    int rc = 0;
+    int fd, i;
+
+    if (!(cmd = getArg(cmd, end, &fstab))) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
+    }
+    if (cmd < end && !(cmd = getArg(cmd, end, &prefix))) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
+    }
+    if (cmd < end && !(cmd = getArg(cmd, end, &timeoutStr))) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
+    }
+    if (cmd < end) {
+        fprintf(stderr, "mount-table: unexpected arguments\n");
+        return 1;
+    }
+
+    fd = open(fstab, O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb)) {
+        fprintf(stderr, "mount-table: failed to open %s: %d\n", fstab, errno);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    contents = arenaAlloc(&lineArena, sb.st_size + 1);
+    entries = arenaAlloc(&lineArena, sizeof(struct mountTableEntry) * MOUNT_TABLE_MAX_ENTRIES);
+    if (read(fd, contents, sb.st_size) != sb.st_size) {
+        fprintf(stderr, "mount-table: failed to read %s: %d\n", fstab, errno);
+        close(fd);
+        return 1;
+    }
+    contents[sb.st_size] = '\0';
+    close(fd);
+
+    if (_implMountTableParse(contents, prefix, timeoutStr ? atoi(timeoutStr) : MOUNT_TABLE_DEFAULT_TIMEOUT, entries, &count)) {
+        /* callee prints error message */
+        return 1;
+    }
+
+    if (testing) {
+        for (i = 0; i < count; i++) {
+            printf("mount-table: mount -o '%s' -t '%s' '%s' '%s' (after %s, timeout %d)\n",
+                entries[i].options, entries[i].fsType, entries[i].device, entries[i].mntPoint,
+                entries[i].parent >= 0 ? entries[entries[i].parent].mntPoint : "-", entries[i].timeout);
+        }
+        return 0;
+    }
+
+    /* superblocks of all entries are created concurrently ... */
+    for (i = 0; i < count; i++) {
+        if (entries[i].bind || entries[i].failed)
+            continue;
+        if (pthread_create(&entries[i].thread, NULL, _implMountTableWorker, &entries[i])) {
+            fprintf(stderr, "mount-table: failed to create thread for %s\n", entries[i].mntPoint);
+            _implMountTableWorker(&entries[i]);
+        } else {
+            entries[i].threadValid = true;
+        }
+    }
+
+    /* ... and attached parent first as they become ready, bind mounts last as their sources may be any of the others */
+    for (i = 0; i < 2 * count; i++) {
+        struct mountTableEntry * e = &entries[i % count];
+
+        if (e->bind != (i >= count))
+            continue;
+
+        if (e->threadValid) {
+            pthread_join(e->thread, NULL);
+        }
+
+        if (e->failed) {
+            ;
+        } else if (e->parent >= 0 && entries[e->parent].failed) {
+            fprintf(stderr, "mount-table: not mounting %s, %s failed\n", e->mntPoint, entries[e->parent].mntPoint);
+            if (e->mfd >= 0)
+                close(e->mfd);
+            e->failed = true;
+        } else if (e->bind) {
+            /* a bind mount takes its flags from the source, a read-only or nosuid one needs a remount */
+            e->failed = _implDoMount("mount-table", "none", NULL, e->flags & (MS_BIND | MS_REC), e->device, e->mntPoint) ||
+                        ((e->flags & ~(MS_MGC_VAL | MS_BIND | MS_REC)) &&
+                         _implDoMount("mount-table", "none", NULL, e->flags | MS_REMOUNT, e->device, e->mntPoint));
+        } else if (e->mfd >= 0) {
+            e->failed = _implAttachMount("mount-table", e->mfd, e->mntPoint);
+        } else if (e->mfd == MOUNT_API_UNSUPPORTED) {
+            char devName[PATH_MAX];
+            e->failed = _implMountConvertDevice("mount-table", e->device, devName, sizeof(devName)) ||
+                        _implDoMount("mount-table", e->fsType, *e->options ? e->options : NULL, e->flags, devName, e->mntPoint);
+        } else {
+            e->failed = true;
+        }
+
+        if (e->failed && !e->nofail) {
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
+
+#define FSCK_MAX_JOBS       32
+#define FSCK_MAX_DISKS      16
+
+/* find the whole disks a block device lives on, following partitions and the slaves of dm, md, bcache...,
+ * with stacked set the devices in between are returned too */
+static int _implBlockLeafDisks(dev_t dev, dev_t * disks, int count, int max, bool stacked) {
+    char path[PATH_MAX];
+    char buf[32];
+    unsigned int maj, min;
+    DIR * dir;
+    struct dirent * ent;
+    bool hasSlaves = false;
+    int fd, n, i;
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition", major(dev), minor(dev));
+    if (!access(path, F_OK)) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev", major(dev), minor(dev));
+        fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            n = read(fd, buf, sizeof(buf) - 1);
+            close(fd);
+            if (n > 0) {
+                buf[n] = '\0';
+                if (sscanf(buf, "%u:%u", &maj, &min) == 2)
+                    dev = makedev(maj, min);
+            }
+        }
+    } else {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves", major(dev), minor(dev));
+        dir = opendir(path);
+        if (dir != NULL) {
+            while ((ent = readdir(dir)) != NULL) {
+                if (ent->d_name[0] == '.')
+                    continue;
+                snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves/%s/dev", major(dev), minor(dev), ent->d_name);
+                fd = open(path, O_RDONLY);
+                if (fd < 0)
+                    continue;
+                n = read(fd, buf, sizeof(buf) - 1);
+                close(fd);
+                if (n <= 0)
+                    continue;
+                buf[n] = '\0';
+                if (sscanf(buf, "%u:%u", &maj, &min) != 2)
+                    continue;
+                hasSlaves = true;
+                count = _implBlockLeafDisks(makedev(maj, min), disks, count, max, stacked);
+            }
+            closedir(dir);
+        }
+        if (hasSlaves && !stacked)
+            return count;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (disks[i] == dev)
+            return count;
+    }
+    if (count < max)
+        disks[count++] = dev;
+    return count;
+}
+
+struct fsckJob {
+    char * fsType;
+    char devName[PATH_MAX];
+    char checker[PATH_MAX];
+    dev_t disks[FSCK_MAX_DISKS];
+    int diskCount;
+    int group;              /* jobs of the same group share a disk and run one after another */
+    int pid;
+    int exitCode;
+    long long startTime;
+    long long duration;
+};
+
+static int _implFsckGroupRoot(struct fsckJob * jobs, int i) {
+    while (jobs[i].group != i)
+        i = jobs[i].group;
+    return i;
+}
+
+static int _implFsckStart(struct fsckJob * job) {
+    char * args[4];
+
+    args[0] = job->checker;
+    args[1] = "-a";
+    args[2] = job->devName;
+    args[3] = NULL;
+
+    job->startTime = monotonicMsec();
+    job->pid = fork();
+    if (job->pid < 0) {
+        fprintf(stderr, "fsck-all: failed to fork for %s: %d\n", job->devName, errno);
+        job->pid = 0;
+        return 1;
+    }
+    if (job->pid == 0) {
+        execve(args[0], args, env);
+        fprintf(stderr, "fsck-all: failed in exec of %s\n", args[0]);
+        exit(8);
+    }
+    return 0;
+}
+
+/* start the first job of group at or after index from that starts, returns whether one is running */
+static bool _implFsckStartNext(struct fsckJob * jobs, int count, int group, int from) {
+    int j;
+
+    for (j = from; j < count; j++) {
+        if (jobs[j].group != group || jobs[j].exitCode != -1 || jobs[j].pid != 0)
+            continue;
+        if (!_implFsckStart(&jobs[j]))
+            return true;
+        jobs[j].exitCode = 8;
+    }
+    return false;
+}
+
+int fsckAllCommand(char * cmd, char * end) {
+    char * usage = "usage: fsck-all <type> <device> [<type> <device>...]";
+    struct fsckJob * jobs;
+    int count = 0;
+    int running = 0;
+    int rc = 0;
+    int i, j, k;
+
+    jobs = arenaAlloc(&lineArena, sizeof(struct fsckJob) * FSCK_MAX_JOBS);
+
+    while (cmd < end) {
+        struct fsckJob * job = &jobs[count];
+        char * device;
+        struct stat sb;
+
+        if (count == FSCK_MAX_JOBS) {
+            fprintf(stderr, "fsck-all: too many filesystems\n");
+            return 1;
+        }
+        if (!(cmd = getArg(cmd, end, &job->fsType)) || !(cmd = getArg(cmd, end, &device))) {
+            fprintf(stderr, "%s\n", usage);
+            return 1;
+        }
+        if (_implMountConvertDevice("fsck-all", device, job->devName, sizeof(job->devName))) {
+            /* callee prints error message */
+            return 1;
+        }
+
+        /* filesystems without a checker (or with a no-op one) are always clean */
+        snprintf(job->checker, sizeof(job->checker), "/sbin/fsck.%s", job->fsType);
+        if (access(job->checker, X_OK) && !testing)
+            continue;
+
+        job->diskCount = 0;
+        if (!stat(job->devName, &sb) && S_ISBLK(sb.st_mode))
+            job->diskCount = _implBlockLeafDisks(sb.st_rdev, job->disks, 0, FSCK_MAX_DISKS, false);
+        job->group = count;
+        job->pid = 0;
+        job->exitCode = -1;
+        job->duration = 0;
+        count++;
+    }
+    if (count == 0) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
+    }
+
+    /* union jobs sharing a disk, groups are ordered by their first job */
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < i; j++) {
+            bool shared = false;
+            for (k = 0; k < jobs[i].diskCount && !shared; k++) {
+                int l;
+                for (l = 0; l < jobs[j].diskCount && !shared; l++)
+                    shared = (jobs[i].disks[k] == jobs[j].disks[l]);
+            }
+            if (shared) {
+                int ri = _implFsckGroupRoot(jobs, i);
+                int rj = _implFsckGroupRoot(jobs, j);
+                if (ri < rj)
+                    jobs[rj].group = ri;
+                else
+                    jobs[ri].group = rj;
+            }
+        }
+    }
+    for (i = 0; i < count; i++)
+        jobs[i].group = _implFsckGroupRoot(jobs, i);
+
+    if (testing) {
+        for (i = 0; i < count; i++)
+            printf("fsck-all: %s -a %s (group %d)\n", jobs[i].checker, jobs[i].devName, jobs[i].group);
+        return 0;
+    }
+
+    /* start the first job of every group, each exit (or failed start) moves on to the next job of its group */
+    for (i = 0; i < count; i++) {
+        if (jobs[i].group == i && _implFsckStartNext(jobs, count, i, i))
+            running++;
+    }
+    while (running > 0) {
+        int status;
+        int pid = wait4(-1, &status, 0, NULL);
+
+        if (pid < 0) {
+            fprintf(stderr, "fsck-all: failed to wait for checkers: %d\n", errno);
+            return 1;
+        }
+        for (i = 0; i < count && jobs[i].pid != pid; i++)
+            ;
+        if (i == count)
+            continue;
+
+        running--;
+        jobs[i].pid = 0;
+        jobs[i].duration = monotonicMsec() - jobs[i].startTime;
+        jobs[i].exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 8;
+
+        if (_implFsckStartNext(jobs, count, jobs[i].group, i + 1))
+            running++;
+    }
+
+    /* 0 is clean, 1 and 2 mean errors were corrected, anything above needs a human */
+    for (i = 0; i < count; i++) {
+        if (jobs[i].exitCode == -1) {
+            fprintf(stderr, "fsck-all: %s was never checked\n", jobs[i].devName);
+            rc = 1;
+        } else if (jobs[i].exitCode == 0) {
+            if (!quiet)
+                printf("fsck-all: %s clean (%lld ms)\n", jobs[i].devName, jobs[i].duration);
+        } else if (jobs[i].exitCode == 1) {
+            printf("fsck-all: %s had errors corrected (%lld ms)\n", jobs[i].devName, jobs[i].duration);
+        } else if (jobs[i].exitCode < 4) {
+            /* the checker changed what the kernel may already have cached, don't mount on top of that */
+            fprintf(stderr, "fsck-all: %s had errors corrected, the system should be rebooted (%lld ms)\n", jobs[i].devName, jobs[i].duration);
+            rc = 1;
+        } else {
+            fprintf(stderr, "fsck-all: %s failed with exit code %d (%lld ms)\n", jobs[i].devName, jobs[i].exitCode, jobs[i].duration);
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
+
+/* tags and names are stored with white space and backslashes octal escaped, the way fstab and mountinfo do it */
+static void _implDevmapEscape(const char * in, char * out) {
+    for (; *in; in++) {
+        if (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\\')
+            out += sprintf(out, "\\%03o", (unsigned char)*in);
+        else
+            *out++ = *in;
+    }
+    *out = '\0';
+}
+
+int devmapLoadCommand(char * cmd, char * end) {
+    char * file;
+    char line[2048];
+    char tag[sizeof(line)];
+    char devName[sizeof(line)];
+    FILE * f;
+
+    if (!(cmd = getArg(cmd, end, &file))) {
+        fprintf(stderr, "devmap-load: file expected\n");
+        return 1;
+    }
+    if (cmd < end) {
+        fprintf(stderr, "devmap-load: unexpected arguments\n");
+        return 1;
+    }
+
+    /* there is no map on the first boot */
+    f = fopen(file, "r");
+    if (f == NULL) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "devmap-load: failed to open %s: %d\n", file, errno);
+            return 1;
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&mycacheLock);
+    devmapCount = 0;
+    while (fgets(line, sizeof(line), f) != NULL && devmapCount < DEVMAP_MAX_ENTRIES) {
+        struct devmapEntry * e = &devmapEntries[devmapCount];
+        unsigned int maj, min;
+
+        if (sscanf(line, "%2047s %2047s %u:%u %23s", tag, devName, &maj, &min, e->type) != 5)
+            continue;
+        _implFstabUnescape(tag);
+        _implFstabUnescape(devName);
+        if (strlen(tag) >= sizeof(e->tag) || strlen(devName) >= sizeof(e->devName) || parseDevTag(tag, NULL) == NULL)
+            continue;
+        strcpy(e->tag, tag);
+        strcpy(e->devName, devName);
+        e->dev = makedev(maj, min);
+        devmapCount++;
+    }
+    devmapDirty = false;
+    if (testing) {
+        printf("devmap-load: %d entries from %s\n", devmapCount, file);
+    }
+    pthread_mutex_unlock(&mycacheLock);
+
+    fclose(f);
+    return 0;
+}
+
+int devmapSaveCommand(char * cmd, char * end) {
+    char * file;
+    char tmpFile[PATH_MAX];
+    FILE * f;
+    int i;
+
+    if (!(cmd = getArg(cmd, end, &file))) {
+        fprintf(stderr, "devmap-save: file expected\n");
+        return 1;
+    }
+    if (cmd < end) {
+        fprintf(stderr, "devmap-save: unexpected arguments\n");
+        return 1;
+    }
+
+    pthread_mutex_lock(&mycacheLock);
+    if (!devmapDirty) {
+        pthread_mutex_unlock(&mycacheLock);
+        return 0;
+    }
+
+    if (testing) {
+        for (i = 0; i < devmapCount; i++)
+            printf("devmap-save: %s %s %u:%u %s\n", devmapEntries[i].tag, devmapEntries[i].devName,
+                   major(devmapEntries[i].dev), minor(devmapEntries[i].dev), devmapEntries[i].type);
+        pthread_mutex_unlock(&mycacheLock);
+        return 0;
+    }
+
+    /* replace the map atomically, a torn file would only cost a full scan but is easy to avoid */
+    snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", file);
+    f = fopen(tmpFile, "w");
+    if (f == NULL) {
+        fprintf(stderr, "devmap-save: failed to create %s: %d\n", tmpFile, errno);
+        pthread_mutex_unlock(&mycacheLock);
+        return 1;
+    }
+    for (i = 0; i < devmapCount; i++) {
+        char tag[4 * sizeof(devmapEntries[i].tag)];
+        char devName[4 * sizeof(devmapEntries[i].devName)];
+
+        _implDevmapEscape(devmapEntries[i].tag, tag);
+        _implDevmapEscape(devmapEntries[i].devName, devName);
+        fprintf(f, "%s %s %u:%u %s\n", tag, devName,
+                major(devmapEntries[i].dev), minor(devmapEntries[i].dev), devmapEntries[i].type);
+    }
+    if (fflush(f) || fsync(fileno(f)) || fclose(f) || rename(tmpFile, file)) {
+        fprintf(stderr, "devmap-save: failed to write %s: %d\n", file, errno);
+        pthread_mutex_unlock(&mycacheLock);
+        return 1;
+    }
+    devmapDirty = false;
+    pthread_mutex_unlock(&mycacheLock);
+
+    return 0;
+}
+
+#define BLK_TUNE_MAX_DEVICES 32
+
+int blkTuneCommand(char * cmd, char * end) {
+    char * usage = "usage: blk-tune <device> <attribute=value> [...]";
+    char * device;
+    char devName[PATH_MAX];
+    dev_t devs[BLK_TUNE_MAX_DEVICES];
+    dev_t leaves[BLK_TUNE_MAX_DEVICES];
+    int devCount = 0, leafCount = 0;
+    struct stat sb;
+    char * setting;
+    int rc = 0;
+    int i, j;
+
+    if (!(cmd = getArg(cmd, end, &device)) || cmd >= end) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
+    }
+    if (_implMountConvertDevice("blk-tune", device, devName, sizeof(devName))) {
+        /* callee prints error message */
+        return 1;
+    }
+
+    if (testing) {
+        while ((cmd = getArg(cmd, end, &setting)))
+            printf("blk-tune: queue/%s on %s and the devices below it\n", setting, devName);
+        return 0;
+    }
+
+    if (stat(devName, &sb) || !S_ISBLK(sb.st_mode)) {
+        fprintf(stderr, "blk-tune: %s is not a block device\n", devName);
+        return 1;
+    }
+    devCount = _implBlockLeafDisks(sb.st_rdev, devs, 0, BLK_TUNE_MAX_DEVICES, true);
+    leafCount = _implBlockLeafDisks(sb.st_rdev, leaves, 0, BLK_TUNE_MAX_DEVICES, false);
+
+    while ((cmd = getArg(cmd, end, &setting))) {
+        char * value = strchr(setting, '=');
+        bool found = false;
+
+        if (value == NULL || value == setting || strchr(setting, '/') != NULL) {
+            fprintf(stderr, "blk-tune: invalid setting %s\n", setting);
+            return 1;
+        }
+        *value++ = '\0';
+
+        for (i = 0; i < devCount; i++) {
+            char path[PATH_MAX];
+            bool leaf = false;
+            int fd;
+
+            for (j = 0; j < leafCount; j++)
+                leaf = leaf || (leaves[j] == devs[i]);
+
+            /* the sysfs attributes are written as is, never created or truncated */
+            snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s", major(devs[i]), minor(devs[i]), setting);
+            fd = open(path, O_WRONLY);
+            if (fd < 0 && errno == ENOENT)
+                continue;
+            found = true;
+            if (fd < 0 || write(fd, value, strlen(value)) != strlen(value)) {
+                /* bio based stacked devices have no scheduler or request queue to tune */
+                if (leaf) {
+                    fprintf(stderr, "blk-tune: failed to set %s=%s on %u:%u: %d\n", setting, value, major(devs[i]), minor(devs[i]), errno);
+                    rc = 1;
+                }
+            }
+            if (fd >= 0)
+                close(fd);
+        }
+        if (!found) {
+            fprintf(stderr, "blk-tune: no device below %s has queue attribute %s\n", devName, setting);
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
+
+int otherCommand(char * bin, char * cmd, char * end, int doFork) {
+    char ** args;
+    char ** nextArg;
+    int pid, wpid;
+    int status;
+    char fullPath[255];
+    static const char * sysPath = PATH;
+    const char * pathStart;
+    const char * pathEnd;
+    char * stdoutFile = NULL;
+    int stdoutFd = 0;
+
+    args = arenaAlloc(&lineArena, sizeof(char *) * 128);
+    nextArg = args;
+
+    if (!strchr(bin, '/')) {
+        pathStart = sysPath;
+        while (*pathStart) {
+            pathEnd = strchr(pathStart, ':');
+
+            if (!pathEnd) pathEnd = pathStart + strlen(pathStart);
+
+            strncpy(fullPath, pathStart, pathEnd - pathStart);
+            fullPath[pathEnd - pathStart] = '/';
+            strcpy(fullPath + (pathEnd - pathStart + 1), bin); 
+
+            pathStart = pathEnd;
+            if (*pathStart) pathStart++;
+
+            if (!access(fullPath, X_OK)) {
+            bin = fullPath;
+            break;
+            }
+        }
+    }
+
+    *nextArg = arenaStrdup(&lineArena, bin);
+
+    while (cmd && cmd < end) {
+        nextArg++;
+        cmd = getArg(cmd, end, nextArg);
+    }
+    
+    if (cmd) nextArg++;
+    *nextArg = NULL;
+
+    /* if the next-to-last arg is a >, redirect the output properly */
+    if (((nextArg - args) >= 2) && !strcmp(*(nextArg - 2), ">")) {
+        stdoutFile = *(nextArg - 1);
+        *(nextArg - 2) = NULL;
+
+        stdoutFd = open(stdoutFile, O_CREAT | O_RDWR | O_TRUNC, 0600);
+        if (stdoutFd < 0) {
+            fprintf(stderr, "init: failed to open %s: %d\n", stdoutFile, errno);
+            return 1;
+        }
+    }
+
+    if (testing) {
+        printf("%s ", bin);
+        nextArg = args + 1;
+        while (*nextArg)
+            printf(" '%s'", *nextArg++);
+        if (stdoutFile)
+            printf(" (> %s)", stdoutFile);
+        printf("\n");
+    } else {
+        if (!doFork) {
+            logFlush();
+        }
+        if (!doFork || !(pid = fork())) {
+            /* child */
+            dup2(stdoutFd, 1);
+            execve(args[0], args, env);
+            fprintf(stderr, "ERROR: failed in exec of %s\n", args[0]);
+            return 1;
+        }
+
+        close(stdoutFd);
+
+        for (;;) {
+            wpid = wait4(-1, &status, 0, NULL);
+            if (wpid == -1) {
+                fprintf(stderr, "ERROR: Failed to wait for process %d\n", wpid);
+                return 1;
+            }
+
+            if (wpid != pid)
+                continue;
+
+            if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+                fprintf(stderr, "ERROR: %s exited abnormally! (pid %d)\n", args[0], pid);
+                return 1;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int losetupCommand(char * cmd, char * end) {
+    char * device;
+    char * file;
+    int fd;
+    struct loop_info loopInfo;
+    int dev;
+
+    if (!(cmd = getArg(cmd, end, &device))) {
+        fprintf(stderr, "losetup: missing device\n");
+        return 1;
+    }
+
+    if (!(cmd = getArg(cmd, end, &file))) {
+        fprintf(stderr, "losetup: missing file\n");
+        return 1;
+    }
+
+    if (cmd < end) {
+        fprintf(stderr, "losetup: unexpected arguments\n");
+        return 1;
+    }
+
+    if (testing) {
+        printf("losetup '%s' '%s'\n", device, file);
+    } else {
+        dev = open(device, O_RDWR, 0);
+        if (dev < 0) {
+            fprintf(stderr, "losetup: failed to open %s: %d\n", device, errno);
+            return 1;
+        }
+
+        fd = open(file, O_RDWR, 0);
+        if (fd < 0) {
+            fprintf(stderr, "losetup: failed to open %s: %d\n", file, errno);
+            close(dev);
+            return 1;
+        }
+
+        if (ioctl(dev, LOOP_SET_FD, (long) fd)) {
+            fprintf(stderr, "losetup: LOOP_SET_FD failed: %d\n", errno);
+            close(dev);
+            close(fd);
+            return 1;
+        }
+
+        close(fd);
+
+        memset(&loopInfo, 0, sizeof(loopInfo));
+        strcpy(loopInfo.lo_name, file);
+
+        if (ioctl(dev, LOOP_SET_STATUS, &loopInfo)) 
+            printf("losetup: LOOP_SET_STATUS failed: %d\n", errno);
+
+        close(dev);
+    }
+
+    return 0;
+}
+
+/* boot statistics, logged by switchroot right before the real init starts */
+static long long initStartBoottime = 0;
+static int linesRun = 0;
+static int linesFailed = 0;
+
+static void _implLogBootStats(void) {
+    struct rusage self, children;
+    long long now = boottimeMsec();
+
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    logMsg(LOG_INFO, "stats", "switchroot %lld ms after kernel start, %lld ms in init, max rss %ld KiB (children %ld KiB), %d lines, %d failed",
+           now, now - initStartBoottime, self.ru_maxrss, children.ru_maxrss, linesRun, linesFailed);
+}
+
+/* lines marked with defer, run by a background worker after switchroot */
+#define MAX_DEFERRED_LINES 64
+#define DEFERRED_LOG "run/minitrd/deferred.log"
+
+static char * deferredLines[MAX_DEFERRED_LINES];
+static int deferredCount = 0;
+static const char * deferredMounts[] = { "/dev", "/proc", "/sys", NULL };
+
+static void _implRunDeferred(int oldRootFd, int logFd);
+
+int deferCommand(char * cmd, char * end) {
+    while (cmd < end && isspace(*cmd)) cmd++;
+    if (cmd >= end) {
+        fprintf(stderr, "defer: command expected\n");
+        return 1;
+    }
+    if (deferredCount == MAX_DEFERRED_LINES) {
+        fprintf(stderr, "defer: too many deferred lines\n");
+        return 1;
+    }
+
+    /* keep the terminating newline, the line is run like any other later */
+    deferredLines[deferredCount++] = arenaStrndup(&globalArena, cmd, end - cmd + 1);
+    if (testing) {
+        printf("defer: %.*s\n", (int)(end - cmd), cmd);
+    }
+    return 0;
+}
+
+#define MAX_INIT_ARGS 32
+/* This is based on code from util-linux/sys-utils/run_init.c */
+int switchrootCommand(char * cmd, char * end) {
+    char * newroot;
+    const char * initprogs[] = { "/sbin/init", "/etc/init", "/bin/init", "/bin/sh", NULL };
+    const char * umounts[] = { "/dev", "/proc", "/sys", NULL };
+    struct stat newroot_stat;
+    char * init = NULL, * cmdline = NULL;
+    char ** initargs;
+    int fd, cfd, i;
+    struct statfs stfs;
+
+    if (!(cmd = getArg(cmd, end, &newroot))) {
+        fprintf(stderr, "switchroot: new root mount point expected\n");
+        return 1;
+    }
+
+    if (cmd < end) {
+        if (!(cmd = getArg(cmd, end, &init))) {
+            fprintf(stderr, "switchroot: init program expected\n");
+            return 1;
+        }
+
+        if (cmd < end) {
+            cmdline = arenaStrndup(&lineArena, cmd, end - cmd);
+        }
+    }
+
+    if (init == NULL) {
+        init = getKernelArg("init=");
+        if (init == NULL)
+            cmdline = getKernelCmdLine();
+    }
+
+    /* a sandbox keeps the terminal it was started from */
+    if (!sandbox) {
+        if ((fd = open("/dev/console", O_RDWR)) < 0) {
+            fprintf(stderr, "switchroot: error opening /dev/console!!!!: %d\n", errno);
+            return 1;
+        }
+
+        if (dup2(fd, 0) != 0) {
+            fprintf(stderr, "switchroot: error dup2'ing fd of %d to 0\n", fd);
+        }
+        if (dup2(fd, 1) != 1) {
+            fprintf(stderr, "switchroot: error dup2'ing fd of %d to 1\n", fd);
+        }
+        if (dup2(fd, 2) != 2) {
+            fprintf(stderr, "switchroot: error dup2'ing fd of %d to 2\n", fd);
+        }
+        if (fd > 2) {
+            close(fd);
+        }
+    }
+
+    cfd = open("/", O_RDONLY);
+    if (cfd < 0) {
+        fprintf(stderr, "switchroot: cannot open /\n");
+        return 1;
+    }
+
+    if (fstatfs(cfd, &stfs) != 0) {
+        fprintf(stderr, "switchroot: stat failed /\n");
+        return 1;
+    }
+
+    if (stfs.f_type != (__SWORD_TYPE)STATFS_RAMFS_MAGIC && stfs.f_type != (__SWORD_TYPE)STATFS_TMPFS_MAGIC) {
+        fprintf(stderr, "switchroot: old root filesystem is not an initramfs");
+        return 1;
+    }
+
+    if (stat(newroot, &newroot_stat) != 0) {
+        fprintf(stderr, "switchroot: stat failed %s\n", newroot);
+        return 1;
+    }
+
+    /* the deferred worker reports to /run, which must survive the real init mounting it */
+    if (deferredCount > 0 && !sandbox) {
+        char path[PATH_MAX];
+        struct stat sb;
+
+        snprintf(path, sizeof(path), "%s/run", newroot);
+        if (!stat(path, &sb) && sb.st_dev == newroot_stat.st_dev &&
+            mount("tmpfs", path, "tmpfs", MS_NOSUID | MS_NODEV | MS_STRICTATIME, "mode=755")) {
+            fprintf(stderr, "switchroot: failed to mount tmpfs on %s: %d\n", path, errno);
+        }
+        snprintf(path, sizeof(path), "%s/run/minitrd", newroot);
+        (void)mkdir(path, 0755);
+    }
+
+    for (i = 0; umounts[i] != NULL; i++) {
+        char newmount[PATH_MAX];
+        struct stat sb;
+
+        snprintf(newmount, sizeof(newmount), "%s%s", newroot, umounts[i]);
+
+        if (stat(newmount, &sb) != 0) {
+            fprintf(stderr, "switchroot: stat failed %s\n", newmount);
+            return 1;
+        }
+
+        if (sb.st_dev != newroot_stat.st_dev) {
+            /* mount point seems to be mounted already */
+            umount2(umounts[i], MNT_DETACH);
+            continue;
+        }
+
+        if (mount(umounts[i], newmount, NULL, MS_MOVE, NULL) < 0) {
+            fprintf(stderr, "switchroot: failed to mount moving %s to %s\n", umounts[i], newmount);
+            return 1;
+        }
+    }
+
+    if (chdir(newroot)) {
+        fprintf(stderr, "switchroot: chdir(%s) failed: %d\n", newroot, errno);
+        return 1;
+    }
+
+    if (mount(".", "/", NULL, MS_MOVE, NULL) < 0) {
+        fprintf(stderr, "switchroot: mount failed: %d\n", errno);
+        return 1;
+    }
+
+    /*
+     * The deferred worker stays in the old root, where the files of the
+     * deferred lines are, and removes it once it is done. It is not waited
+     * for, the real init reaps it. A sandbox neither frees its old root nor
+     * starts init, so there is nothing to run the deferred lines after.
+     */
+    if (deferredCount > 0 && !sandbox) {
+        int logFd = open(DEFERRED_LOG, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        pid_t pid;
+
+        logFlush();
+        pid = fork();
+        if (pid == 0) {
+            _implRunDeferred(cfd, logFd);
+        }
+        if (pid < 0) {
+            fprintf(stderr, "switchroot: failed to start the deferred worker: %d\n", errno);
+        } else {
+            logMsg(LOG_INFO, "switchroot", "(%d deferred lines continue in the background, pid %d)", deferredCount, (int)pid);
+            cfd = -1;
+        }
+        if (logFd >= 0) {
+            close(logFd);
+        }
+    }
+
+    if (chroot(".") || chdir("/")) {
+        fprintf(stderr, "switchroot: chroot() failed: %d\n", errno);
+        return 1;
+    }
+
+    if (cfd >= 0) {
+        if (!sandbox)
+            recursiveRemove(cfd);
+        close(cfd);
+    }
+
+    if (init == NULL) {
+        for (i = 0; initprogs[i] != NULL; i++) {
+            if (!access(initprogs[i], X_OK)) {
+                init = arenaStrdup(&lineArena, initprogs[i]);
+                break;
+            }
+        }
+    }
+
+    i = 0;
+    initargs = arenaAlloc(&lineArena, sizeof(char *) * (MAX_INIT_ARGS + 1));
+    if (cmdline && init) {
+        initargs[i++] = arenaStrdup(&lineArena, init);
+    } else {
+        cmdline = init;
+        initargs[0] = NULL;
+    }
+
+    if (cmdline != NULL) {
+        char * chptr, * start;
+
+        start = chptr = cmdline;
+        for (; (i < MAX_INIT_ARGS) && (*start != '\0'); i++) {
+            while (*chptr && !isspace(*chptr)) chptr++;
+            if (*chptr != '\0') *(chptr++) = '\0';
+            initargs[i] = arenaStrdup(&lineArena, start);
+            start = chptr;
+        }
+    }
+
+    initargs[i] = NULL;
+
+    if (access(initargs[0], X_OK)) {
+        logMsg(LOG_WARNING, "switchroot", "can't access %s", initargs[0]);
+    }
+
+    _implLogBootStats();
+
+    if (sandbox) {
+        logMsg(LOG_INFO, "switchroot", "(sandbox: %s is the root now, not starting %s, %d deferred lines not run)",
+               newroot, initargs[0], deferredCount);
+        return 0;
+    }
+
+    logFlush();
+    execv(initargs[0], initargs);
+    fprintf(stderr, "exec of init (%s) failed!!!: %d\n", initargs[0], errno);
+    return 1;
+}
+
+int isEchoQuiet(int fd) {
+    if (!quiet) return 0;
+    if (fd != 1) return 0;
+    return 1;
+}
+
+int echoCommand(char * cmd, char * end) {
+    char * args[256];
+    char ** nextArg = args;
+    int outFd = 1;
+    int num = 0;
+    int i;
+    int newline = 1;
+    int length = 0;
+    char *string;
+
+    if (testing && !quiet) {
+        printf("(echo) ");
+        fflush(stdout);
+    }
+
+    while ((cmd = getArg(cmd, end, nextArg))) {
+        if (!strncmp("-n", *nextArg, MAX(2, strlen(*nextArg)))) {
+            newline = 0;
+        } else {
+            length += strlen(*nextArg);
+            nextArg++, num++;
+        }
+    }
+    length += num + 1;
+
+    if ((nextArg - args >= 2) && !strcmp(*(nextArg - 2), ">")) {
+        outFd = open(*(nextArg - 1), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outFd < 0) {
+            fprintf(stderr, "echo: cannot open %s for write: %d\n", 
+                *(nextArg - 1), errno);
+            return 1;
+        }
+
+        newline = 0;
+        num -= 2;
+    }
+    string = arenaAlloc(&lineArena, length);
+    *string = '\0';
+    for (i = 0; i < num;i ++) {
+        if (i) strcat(string, " ");
+        strcat(string, args[i]);
+    }
+
+    if (newline) strcat(string, "\n");
+    if (!isEchoQuiet(outFd)) write(outFd, string, strlen(string));
+
+    if (outFd != 1) close(outFd);
+
+    return 0;
+}
+
+int umountCommand(char * cmd, char * end) {
+    char * path;
+
+    if (!(cmd = getArg(cmd, end, &path))) {
+        fprintf(stderr, "umount: path expected\n");
+        return 1;
+    }
+
+    if (cmd < end) {
+        fprintf(stderr, "umount: unexpected arguments\n");
+        return 1;
+    }
+
+    if (umount(path)) {
+        fprintf(stderr, "umount %s failed: %d\n", path, errno);
+        return 1;
+    }
+
+    return 0;
+}
+
+int mkdirCommand(char * cmd, char * end) {
+    char * dir;
+    int ignoreExists = 0;
+
+    cmd = getArg(cmd, end, &dir);
+
+    if (cmd && !strcmp(dir, "-p")) {
+        ignoreExists = 1;
+        cmd = getArg(cmd, end, &dir);
+    }
+
+    if (!cmd) {
+        fprintf(stderr, "mkdir: directory expected\n");
+        return 1;
+    }
+
+    if (mkdir(dir, 0755)) {
+        if (!ignoreExists && errno == EEXIST) {
+            fprintf(stderr, "mkdir: failed to create %s: %d\n", dir, errno);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int accessCommand(char * cmd, char * end) {
+    char * permStr;
+    int perms = 0;
+    char * file = NULL;
+
+    cmd = getArg(cmd, end, &permStr);
+    if (cmd) cmd = getArg(cmd, end, &file);
+
+    if (!cmd || *permStr != '-') {
+        fprintf(stderr, "usage: access -[perm] file\n");
+        return 1;
+    }
+
+    permStr++;
+    while (*permStr) {
+        switch (*permStr) {
+            case 'r': perms |= R_OK; break;
+            case 'w': perms |= W_OK; break;
+            case 'x': perms |= X_OK; break;
+            case 'f': perms |= F_OK; break;
+            default:
+                fprintf(stderr, "perms must be -[r][w][x][f]\n");
+                return 1;
+        }
+
+        permStr++;
+    }
+
+    if ((file == NULL) || (access(file, perms))) {
+        return 1;
+    }
+
+    return 0;
+}
+
+int sleepCommand(char * cmd, char * end) {
+    char *delaystr;
+    int delay;
+
+    if (!(cmd = getArg(cmd, end, &delaystr))) {
+        fprintf(stderr, "sleep: delay expected\n");
+        return 1;
+    }
+
+    delay = atoi(delaystr);
+    (void)sleep(delay);
+
+    return 0;
+}
+
+int readlinkCommand(char * cmd, char * end) {
+    char * path;
+    char * buf, * respath, * fullpath;
+    struct stat sb;
+    ssize_t n;
+
+    if (!(cmd = getArg(cmd, end, &path))) {
+        fprintf(stderr, "readlink: file expected\n");
+        return 1;
+    }
+
+    if (lstat(path, &sb) == -1) {
+        fprintf(stderr, "unable to stat %s: %d\n", path, errno);
+        return 1;
+    }
+
+    if (!S_ISLNK(sb.st_mode)) {
+        printf("%s\n", path);
+        return 0;
+    }
+    
+    buf = arenaAlloc(&lineArena, PATH_MAX);
+    n = readlink(path, buf, PATH_MAX - 1);
+    if (n == -1) {
+        fprintf(stderr, "error readlink %s: %d\n", path, errno);
+        return 1;
+    }
+    buf[n] = '\0';
+
+    /* symlink is absolute */
+    if (buf[0] == '/') {
+        printf("%s\n", buf);
+        return 0;
+    } 
+   
+    /* nope, need to handle the relative symlink case too */
+    respath = strrchr(path, '/');
+    if (respath) {
+        *respath = '\0';
+    }
+
+    fullpath = arenaAlloc(&lineArena, PATH_MAX * 2);
+    /* and normalize it */
+    snprintf(fullpath, PATH_MAX * 2, "%s/%s", path, buf);
+    respath = arenaAlloc(&lineArena, PATH_MAX);
+    if (!(respath = realpath(fullpath, respath))) {
+        fprintf(stderr, "error realpath %s: %d\n", fullpath, errno);
+        return 1;
+    }
+
+    printf("%s\n", respath);
+    return 0;
+}
+
+int lvmLvActivateCommand(char * cmd, char * end) {
+    char * dev_tag;
+    char * vg_name;
+    char * lv_name;
+
+    if (!(cmd = getArg(cmd, end, &dev_tag))) {
+        fprintf(stderr, "lvm-lv-activate: missing dev-tag\n");
+        return 1;
+    }
+    if (parseDevTag(dev_tag, NULL) == NULL) {
+        fprintf(stderr, "lvm-lv-activate: invalid dev-tag\n");
+        return 1;
+    }
+
+    if (!(cmd = getArg(cmd, end, &vg_name))) {
+        fprintf(stderr, "lvm-lv-activate: missing vgname\n");
+        return 1;
+    }
+
+    if (!(cmd = getArg(cmd, end, &lv_name))) {
+        fprintf(stderr, "lvm-lv-activate: missing lvname\n");
+        return 1;
+    }
+
+    if (cmd < end) {
+        fprintf(stderr, "lvm-lv-activate: unexpected arguments\n");
+        return 1;
+    }
+
+    if (runBinary2("/sbin/lvm", "vgchange", "-ay") != 0) {
+        /* callee prints error message */
+        return 1;
+    }
+
+    waitForDev(dev_tag);
+
+    return 0;
+}
+
+int bcacheActivateCacheDeviceCommand(char * cmd, char *end) {
+    char * bcacheRegisterFile;
+    char * device;
+    const char * token;
+    const char * value;
+
+    if (!quiet) {
+        bcacheRegisterFile = "/sys/fs/bcache/register";
+    } else {
+        bcacheRegisterFile = "/sys/fs/bcache/register_quiet";
+    }
+
+    if (!(cmd = getArg(cmd, end, &device))) {
+        fprintf(stderr, "bcache-cache-device-activate: missing device\n");
+        return 1;
+    }
+
+    if (cmd < end) {
+        fprintf(stderr, "bcache-cache-device-activate: unexpected arguments\n");
+        return 1;
+    }
+
+    token = parseDevTag(device, &value);
+    if (token != NULL) {
+        char * devName = evaluateTag(token, value);
+        if (devName == NULL) {
+            fprintf(stderr, "bcache-cache-device-activate: failed to get device %s\n", device);
+            return 1;
+        }
+        device = arenaStrdup(&lineArena, devName);
+        free(devName);
+    }
+
+    if (!testing) {
+        int fd = open(bcacheRegisterFile, O_WRONLY, 0);
+        if (fd < 0) {
+            fprintf(stderr, "bcache-cache-device-activate: failed to open %s: %d\n", bcacheRegisterFile, errno);
+            return 1;
+        }
+
+        if (write(fd, device, strlen(device)) != strlen(device)) {
+            fprintf(stderr, "bcache-cache-device-activate: failed to write %s: %d\n", bcacheRegisterFile, errno);
+            close(fd);
+            return 1;
+        }
+
+        close(fd);
+    }
+
+    return 0;
+}
+
+int bcacheActivateBackingDeviceCommand(char * cmd, char *end) {
+    char * bcacheRegisterFile;
+    char * dev_tag;
+    char * device;
+    const char * token;
+    const char * value;
+
+    if (!quiet) {
+        bcacheRegisterFile = "/sys/fs/bcache/register";
+    } else {
+        bcacheRegisterFile = "/sys/fs/bcache/register_quiet";
+    }
+
+    if (!(cmd = getArg(cmd, end, &dev_tag))) {
+        fprintf(stderr, "bcache-backing-device-activate: missing dev-tag\n");
+        return 1;
+    }
+
+    if (!(cmd = getArg(cmd, end, &device))) {
+        fprintf(stderr, "bcache-backing-device-activate: missing device\n");
+        return 1;
+    }
+
+    if (cmd < end) {
+        fprintf(stderr, "bcache-backing-device-activate: unexpected arguments\n");
+        return 1;
+    }
+
+    if (parseDevTag(dev_tag, NULL) == NULL) {
+        fprintf(stderr, "bcache-backing-device-activate: invalid dev-tag\n");
+        return 1;
+    }
+
+    token = parseDevTag(device, &value);
+    if (token != NULL) {
+        char * devName = evaluateTag(token, value);
+        if (devName == NULL) {
+            fprintf(stderr, "bcache-backing-device-activate: failed to get device %s\n", device);
+            return 1;
+        }
+        device = arenaStrdup(&lineArena, devName);
+        free(devName);
+    }
+
+    if (!testing) {
+        int fd = open(bcacheRegisterFile, O_WRONLY, 0);
+        if (fd < 0) {
+            fprintf(stderr, "bcache-backing-device-activate: failed to open %s: %d\n", bcacheRegisterFile, errno);
+            return 1;
+        }
+
+        if (write(fd, device, strlen(device)) != strlen(device)) {
+            fprintf(stderr, "bcache-backing-device-activate: failed to write %s: %d\n", bcacheRegisterFile, errno);
+            close(fd);
+            return 1;
+        }
+
+        close(fd);
+    }
+
+    waitForDev(dev_tag);
+
+    return 0;
+}
+
+#define DM_CONTROL "/dev/mapper/control"
+#define DM_BUFFER_SIZE 16384
+
+static void _implDmInit(struct dm_ioctl * dmi, int size, const char * name, const char * uuid) {
+    memset(dmi, 0, size);
+    dmi->version[0] = DM_VERSION_MAJOR;
+    dmi->data_size = size;
+    dmi->data_start = sizeof(struct dm_ioctl);
+    if (name != NULL) {
+        snprintf(dmi->name, sizeof(dmi->name), "%s", name);
+    }
+    if (uuid != NULL) {
+        snprintf(dmi->uuid, sizeof(dmi->uuid), "%s", uuid);
+    }
+}
+
+/* create and activate a device-mapper device with a single target, the new device node is /dev/mapper/name */
+static int _implDmCreate(char * cmd_name, const char * name, const char * uuid, const char * target,
+                         unsigned long long sectors, const char * params, bool readOnly) {
+    char * buf;
+    struct dm_ioctl * dmi;
+    struct dm_target_spec * spec;
+    char devName[PATH_MAX];
+    dev_t dev;
+    int fd;
+
+    if (sizeof(struct dm_ioctl) + sizeof(struct dm_target_spec) + strlen(params) + 1 > DM_BUFFER_SIZE) {
+        fprintf(stderr, "%s: table for %s is too long\n", cmd_name, name);
+        return 1;
+    }
+
+    fd = open(DM_CONTROL, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %d\n", cmd_name, DM_CONTROL, errno);
+        return 1;
+    }
+
+    buf = arenaAlloc(&lineArena, DM_BUFFER_SIZE);
+    dmi = (struct dm_ioctl *)buf;
+
+    _implDmInit(dmi, DM_BUFFER_SIZE, name, uuid);
+    if (ioctl(fd, DM_DEV_CREATE, dmi)) {
+        fprintf(stderr, "%s: failed to create device-mapper device %s: %d\n", cmd_name, name, errno);
+        goto fail;
+    }
+    dev = dmi->dev;
+
+    _implDmInit(dmi, DM_BUFFER_SIZE, name, NULL);
+    dmi->target_count = 1;
+    if (readOnly) {
+        dmi->flags |= DM_READONLY_FLAG;
+    }
+    spec = (struct dm_target_spec *)(buf + sizeof(struct dm_ioctl));
+    spec->sector_start = 0;
+    spec->length = sectors;
+    strncpy(spec->target_type, target, sizeof(spec->target_type) - 1);
+    strcpy((char *)(spec + 1), params);
+    if (ioctl(fd, DM_TABLE_LOAD, dmi)) {
+        fprintf(stderr, "%s: failed to load %s table for %s: %d\n", cmd_name, target, name, errno);
+        goto fail_remove;
+    }
+
+    /* DM_DEV_SUSPEND without DM_SUSPEND_FLAG resumes the device, which makes the loaded table live */
+    _implDmInit(dmi, DM_BUFFER_SIZE, name, NULL);
+    if (ioctl(fd, DM_DEV_SUSPEND, dmi)) {
+        fprintf(stderr, "%s: failed to activate %s: %d\n", cmd_name, name, errno);
+        goto fail_remove;
+    }
+
+    /* there is no udev to create the /dev/mapper link */
+    (void)mkdir("/dev/mapper", 0755);
+    snprintf(devName, sizeof(devName), "/dev/mapper/%s", name);
+    if (mknod(devName, S_IFBLK | 0600, dev) && errno != EEXIST) {
+        fprintf(stderr, "%s: failed to create %s: %d\n", cmd_name, devName, errno);
+    }
+
+    close(fd);
+    return 0;
+
+fail_remove:
+    _implDmInit(dmi, DM_BUFFER_SIZE, name, NULL);
+    (void)ioctl(fd, DM_DEV_REMOVE, dmi);
+fail:
+    close(fd);
+    return 1;
+}
+
+/*
+ * SHA-1 and SHA-256 share the padding and the 64 byte block, only the
+ * compression function and the digest length differ. LUKS digests and
+ * keyslots use them through PBKDF2, bcachefs through scrypt.
+ */
+struct hashAlg {
+    const char * name;
+    int digestLen;
+    const uint32_t * iv;
+    void (*block)(uint32_t * h, const unsigned char * p);
+};
+
+struct hashCtx {
+    const struct hashAlg * alg;
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t sha1Iv[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+static const uint32_t sha256Iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void _implSha1Block(uint32_t * h, const unsigned char * p) {
+    uint32_t w[80], a, b, c, d, e, t;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = be32toh(*(const uint32_t *)(p + i * 4));
+    for (; i < 80; i++)
+        w[i] = ROTL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (i = 0; i < 80; i++) {
+        if (i < 20)
+            t = ((b & c) | (~b & d)) + 0x5a827999;
+        else if (i < 40)
+            t = (b ^ c ^ d) + 0x6ed9eba1;
+        else if (i < 60)
+            t = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc;
+        else
+            t = (b ^ c ^ d) + 0xca62c1d6;
+        t += ROTL32(a, 5) + e + w[i];
+        e = d, d = c, c = ROTL32(b, 30), b = a, a = t;
+    }
+    h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+}
+
+static void _implSha256Block(uint32_t * h, const unsigned char * p) {
+    uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = be32toh(*(const uint32_t *)(p + i * 4));
+    for (; i < 64; i++)
+        w[i] = w[i - 16] + (ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               w[i - 7] + (ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (i = 0; i < 64; i++) {
+        t1 = k + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+    }
+    h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e, h[5] += f, h[6] += g, h[7] += k;
+}
+
+static const struct hashAlg hashAlgs[] = {
+    { "sha1",   20, sha1Iv,   _implSha1Block },
+    { "sha256", 32, sha256Iv, _implSha256Block },
+};
+
+#define HASH_SHA256             (&hashAlgs[1])
+#define HASH_MAX_DIGEST         32
+
+static const struct hashAlg * _implHashFind(const char * name) {
+    int i;
+
+    for (i = 0; i < sizeof(hashAlgs) / sizeof(hashAlgs[0]); i++) {
+        if (!strcmp(hashAlgs[i].name, name))
+            return &hashAlgs[i];
+    }
+    return NULL;
+}
+
+static void _implHashInit(struct hashCtx * c, const struct hashAlg * alg) {
+    c->alg = alg;
+    memcpy(c->h, alg->iv, alg->digestLen);
+    c->len = 0;
+}
+
+static void _implHashUpdate(struct hashCtx * c, const void * data, size_t len) {
+    const unsigned char * p = data;
+    size_t fill = c->len % 64;
+
+    c->len += len;
+    if (fill > 0) {
+        size_t n = MIN(len, 64 - fill);
+
+        memcpy(c->buf + fill, p, n);
+        p += n;
+        len -= n;
+        if (fill + n < 64)
+            return;
+        c->alg->block(c->h, c->buf);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        c->alg->block(c->h, p);
+    memcpy(c->buf, p, len);
+}
+
+static void _implHashFinal(struct hashCtx * c, unsigned char * out) {
+    uint64_t bits = htobe64(c->len * 8);
+    size_t fill = c->len % 64;
+    int i;
+
+    c->buf[fill++] = 0x80;
+    if (fill > 56) {
+        memset(c->buf + fill, 0, 64 - fill);
+        c->alg->block(c->h, c->buf);
+        fill = 0;
+    }
+    memset(c->buf + fill, 0, 56 - fill);
+    memcpy(c->buf + 56, &bits, 8);
+    c->alg->block(c->h, c->buf);
+    for (i = 0; i < c->alg->digestLen / 4; i++)
+        *(uint32_t *)(out + i * 4) = htobe32(c->h[i]);
+}
+
+/* PBKDF2-HMAC, scrypt runs it with a single iteration */
+static void _implPbkdf2(const struct hashAlg * alg, const void * pass, size_t passLen, const void * salt, size_t saltLen,
+                        unsigned long long iterations, unsigned char * out, size_t outLen) {
+    struct hashCtx inner, outer, c;
+    unsigned char key[64], u[HASH_MAX_DIGEST], t[HASH_MAX_DIGEST];
+    unsigned long long k;
+    int dl = alg->digestLen;
+    uint32_t i, be;
+    int j;
+
+    memset(key, 0, sizeof(key));
+    if (passLen > 64) {
+        _implHashInit(&c, alg);
+        _implHashUpdate(&c, pass, passLen);
+        _implHashFinal(&c, key);
+    } else {
+        memcpy(key, pass, passLen);
+    }
+    for (j = 0; j < 64; j++)
+        key[j] ^= 0x36;
+    _implHashInit(&inner, alg);
+    _implHashUpdate(&inner, key, 64);
+    for (j = 0; j < 64; j++)
+        key[j] ^= 0x36 ^ 0x5c;
+    _implHashInit(&outer, alg);
+    _implHashUpdate(&outer, key, 64);
+
+    for (i = 1; outLen > 0; i++) {
+        be = htobe32(i);
+        c = inner;
+        _implHashUpdate(&c, salt, saltLen);
+        _implHashUpdate(&c, &be, 4);
+        _implHashFinal(&c, u);
+        c = outer;
+        _implHashUpdate(&c, u, dl);
+        _implHashFinal(&c, u);
+        memcpy(t, u, dl);
+        for (k = 1; k < iterations; k++) {
+            c = inner;
+            _implHashUpdate(&c, u, dl);
+            _implHashFinal(&c, u);
+            c = outer;
+            _implHashUpdate(&c, u, dl);
+            _implHashFinal(&c, u);
+            for (j = 0; j < dl; j++)
+                t[j] ^= u[j];
+        }
+        memcpy(out, t, MIN(outLen, dl));
+        out += MIN(outLen, dl);
+        outLen -= MIN(outLen, dl);
+    }
+    memset(key, 0, sizeof(key));
+    memset(u, 0, sizeof(u));
+    memset(t, 0, sizeof(t));
+    memset(&inner, 0, sizeof(inner));
+    memset(&outer, 0, sizeof(outer));
+    memset(&c, 0, sizeof(c));
+}
+
+static long _implAddKey(const char * type, const char * description, const void * payload, size_t plen, int keyring) {
+    return syscall(__NR_add_key, type, description, payload, plen, keyring);
+}
+
+static long _implKeyctl(int operation, unsigned long arg2, unsigned long arg3, unsigned long arg4) {
+    return syscall(__NR_keyctl, operation, arg2, arg3, arg4, 0UL);
+}
+
+/* just enough JSON walking for the LUKS2 metadata area */
+static const char * _implJsonSkipSpace(const char * p, const char * end) {
+    while (p < end && isspace(*p)) p++;
+    return p;
+}
+
+static const char * _implJsonSkipValue(const char * p, const char * end) {
+    int depth = 0;
+
+    p = _implJsonSkipSpace(p, end);
+    do {
+        if (p >= end) {
+            return NULL;
+        }
+        if (*p == '"') {
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\') p++;
+            }
+            p++;
+        } else if (*p == '{' || *p == '[') {
+            depth++, p++;
+        } else if (*p == '}' || *p == ']') {
+            depth--, p++;
+        } else if (depth == 0) {
+            while (p < end && *p != ',' && *p != '}' && *p != ']' && !isspace(*p)) p++;
+        } else {
+            p++;
+        }
+    } while (depth > 0);
+
+    return p <= end ? p : NULL;
+}
+
+/* get the value of member key (or of the first member if key is NULL) of the object at p */
+static const char * _implJsonMember(const char * p, const char * end, const char * key) {
+    if (p == NULL) {
+        return NULL;
+    }
+
+    p = _implJsonSkipSpace(p, end);
+    if (p >= end || *p != '{') {
+        return NULL;
+    }
+    p++;
+
+    while (1) {
+        const char * name;
+        int nameLen;
+
+        p = _implJsonSkipSpace(p, end);
+        if (p >= end || *p != '"') {
+            return NULL;
+        }
+        name = ++p;
+        while (p < end && *p != '"') p++;
+        if (p >= end) {
+            return NULL;
+        }
+        nameLen = p - name;
+
+        p = _implJsonSkipSpace(p + 1, end);
+        if (p >= end || *p != ':') {
+            return NULL;
+        }
+        p = _implJsonSkipSpace(p + 1, end);
+
+        if (key == NULL || (strlen(key) == nameLen && !strncmp(name, key, nameLen))) {
+            return p;
+        }
+
+        p = _implJsonSkipValue(p, end);
+        if (p == NULL) {
+            return NULL;
+        }
+        p = _implJsonSkipSpace(p, end);
+        if (p >= end || *p != ',') {
+            return NULL;
+        }
+        p++;
+    }
+}
+
+static int _implJsonString(const char * p, const char * end, char * buf, int buf_len) {
+    const char * s;
+
+    if (p == NULL || *p != '"') {
+        return 1;
+    }
+    s = ++p;
+    while (p < end && *p != '"') p++;
+    if (p >= end || p - s + 1 > buf_len) {
+        return 1;
+    }
+    memcpy(buf, s, p - s);
+    buf[p - s] = '\0';
+    return 0;
+}
+
+/* LUKS2 stores 64bit numbers as strings, smaller ones as plain numbers */
+static int _implJsonNumber(const char * p, const char * end, unsigned long long * value) {
+    if (p == NULL) {
+        return 1;
+    }
+    if (*p == '"') {
+        p++;
+    }
+    if (p >= end || !isdigit(*p)) {
+        return 1;
+    }
+    *value = strtoull(p, NULL, 10);
+    return 0;
+}
+
+/* LUKS2 keeps salts and digests base64 encoded, returns the decoded length or -1 */
+static int _implBase64Decode(const char * s, unsigned char * out, int outLen) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t acc = 0;
+    int bits = 0, n = 0;
+    char * c;
+
+    for (; *s != '\0' && *s != '='; s++) {
+        c = strchr(alphabet, *s);
+        if (c == NULL) {
+            return -1;
+        }
+        acc = (acc << 6) | (c - alphabet);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n >= outLen) {
+                return -1;
+            }
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+#define LUKS_MAGIC              "LUKS\xba\xbe"
+#define LUKS_MAGIC_LEN          6
+#define LUKS2_BIN_HDR_SIZE      4096
+#define LUKS2_MAX_HDR_SIZE      (4 * 1024 * 1024)
+#define LUKS_KEY_DESC_PREFIX    "minitrd:"
+#define LUKS_MAX_KEY_SIZE       128
+#define LUKS_MAX_KEYSLOTS       32
+#define LUKS_KEYFILE_MAX        8192
+#define LUKS1_KEYSLOTS          8
+#define LUKS1_KEY_ENABLED       0x00AC71F3
+
+struct luksKeyslot {
+    char kdfHash[16];                   /* empty unless the keyslot uses pbkdf2 */
+    unsigned long long iterations;
+    unsigned char salt[64];
+    int saltLen;
+    char afHash[16];
+    unsigned long long stripes;
+    char encryption[64];
+    unsigned long long areaOffset;      /* in bytes */
+    unsigned long long areaKeySize;
+};
+
+struct luksVolume {
+    int version;
+    char uuid[40];
+    char cipher[64];
+    unsigned long long offset;          /* data offset in bytes */
+    unsigned long long size;            /* data size in bytes, 0 means up to the end of the device */
+    unsigned long long ivTweak;
+    unsigned long long sectorSize;
+    unsigned long long keySize;
+    const struct hashAlg * digestAlg;   /* PBKDF2 digest every candidate volume key is checked against */
+    unsigned long long digestIterations;
+    unsigned char digestSalt[64];
+    int digestSaltLen;
+    unsigned char digest[64];
+    int digestLen;
+    int keyslotCount;
+    struct luksKeyslot keyslots[LUKS_MAX_KEYSLOTS];
+};
+
+static int _implLuks2ReadKeyslot(const char * keyslot, const char * end, struct luksKeyslot * ks) {
+    const char * kdf = _implJsonMember(keyslot, end, "kdf");
+    const char * area = _implJsonMember(keyslot, end, "area");
+    const char * af = _implJsonMember(keyslot, end, "af");
+    char buf[128];
+
+    if (_implJsonString(_implJsonMember(area, end, "encryption"), end, ks->encryption, sizeof(ks->encryption)) ||
+        _implJsonNumber(_implJsonMember(area, end, "offset"), end, &ks->areaOffset) ||
+        _implJsonNumber(_implJsonMember(area, end, "key_size"), end, &ks->areaKeySize) ||
+        _implJsonString(_implJsonMember(af, end, "hash"), end, ks->afHash, sizeof(ks->afHash)) ||
+        _implJsonNumber(_implJsonMember(af, end, "stripes"), end, &ks->stripes)) {
+        return 1;
+    }
+
+    /* argon2 keyslots are left to the raw volume key */
+    if (_implJsonString(_implJsonMember(kdf, end, "type"), end, buf, sizeof(buf)) || strcmp(buf, "pbkdf2")) {
+        return 0;
+    }
+    if (_implJsonString(_implJsonMember(kdf, end, "salt"), end, buf, sizeof(buf)) ||
+        (ks->saltLen = _implBase64Decode(buf, ks->salt, sizeof(ks->salt))) < 0 ||
+        _implJsonNumber(_implJsonMember(kdf, end, "iterations"), end, &ks->iterations) ||
+        _implJsonString(_implJsonMember(kdf, end, "hash"), end, ks->kdfHash, sizeof(ks->kdfHash))) {
+        return 1;
+    }
+    return 0;
+}
+
+static int _implLuksReadHeader(char * cmd_name, int fd, char * device, struct luksVolume * vol) {
+    unsigned char hdr[LUKS2_BIN_HDR_SIZE];
+    unsigned long long hdrSize;
+    char * json, * jsonEnd;
+    const char * segment;
+    const char * keyslots;
+    const char * digest;
+    const char * p;
+    char buf[128];
+    int i;
+
+    if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr, LUKS_MAGIC, LUKS_MAGIC_LEN)) {
+        fprintf(stderr, "%s: %s is not a LUKS device\n", cmd_name, device);
+        return 1;
+    }
+
+    memset(vol, 0, sizeof(*vol));
+    vol->version = be16toh(*(uint16_t *)(hdr + 6));
+    memcpy(vol->uuid, hdr + 168, sizeof(vol->uuid) - 1);
+
+    if (vol->version == 1) {
+        char cipherName[33] = "", cipherMode[33] = "", hashSpec[33] = "";
+
+        memcpy(cipherName, hdr + 8, 32);
+        memcpy(cipherMode, hdr + 40, 32);
+        memcpy(hashSpec, hdr + 72, 32);
+        snprintf(vol->cipher, sizeof(vol->cipher), "%s-%s", cipherName, cipherMode);
+        vol->offset = (unsigned long long)be32toh(*(uint32_t *)(hdr + 104)) * 512;
+        vol->keySize = be32toh(*(uint32_t *)(hdr + 108));
+        vol->sectorSize = 512;
+
+        /* one hash for the digest, the keyslot kdf and the anti-forensic split */
+        vol->digestAlg = _implHashFind(hashSpec);
+        if (vol->digestAlg == NULL) {
+            fprintf(stderr, "%s: %s uses unsupported hash %s\n", cmd_name, device, hashSpec);
+            return 1;
+        }
+        memcpy(vol->digest, hdr + 112, 20);
+        vol->digestLen = 20;
+        memcpy(vol->digestSalt, hdr + 132, 32);
+        vol->digestSaltLen = 32;
+        vol->digestIterations = be32toh(*(uint32_t *)(hdr + 164));
+
+        for (i = 0; i < LUKS1_KEYSLOTS; i++) {
+            const unsigned char * slot = hdr + 208 + i * 48;
+            struct luksKeyslot * ks = &vol->keyslots[vol->keyslotCount];
+
+            if (be32toh(*(uint32_t *)slot) != LUKS1_KEY_ENABLED)
+                continue;
+            snprintf(ks->kdfHash, sizeof(ks->kdfHash), "%s", hashSpec);
+            snprintf(ks->afHash, sizeof(ks->afHash), "%s", hashSpec);
+            snprintf(ks->encryption, sizeof(ks->encryption), "%s", vol->cipher);
+            ks->iterations = be32toh(*(uint32_t *)(slot + 4));
+            memcpy(ks->salt, slot + 8, 32);
+            ks->saltLen = 32;
+            ks->areaOffset = (unsigned long long)be32toh(*(uint32_t *)(slot + 40)) * 512;
+            ks->stripes = be32toh(*(uint32_t *)(slot + 44));
+            ks->areaKeySize = vol->keySize;
+            vol->keyslotCount++;
+        }
+    } else if (vol->version == 2) {
+        hdrSize = be64toh(*(uint64_t *)(hdr + 8));
+        if (hdrSize <= LUKS2_BIN_HDR_SIZE || hdrSize > LUKS2_MAX_HDR_SIZE) {
+            fprintf(stderr, "%s: %s has invalid LUKS2 header size\n", cmd_name, device);
+            return 1;
+        }
+
+        json = arenaAlloc(&lineArena, hdrSize - LUKS2_BIN_HDR_SIZE + 1);
+        if (pread(fd, json, hdrSize - LUKS2_BIN_HDR_SIZE, LUKS2_BIN_HDR_SIZE) != hdrSize - LUKS2_BIN_HDR_SIZE) {
+            fprintf(stderr, "%s: failed to read LUKS2 metadata of %s: %d\n", cmd_name, device, errno);
+            return 1;
+        }
+        json[hdrSize - LUKS2_BIN_HDR_SIZE] = '\0';
+        jsonEnd = json + strlen(json);
+
+        segment = _implJsonMember(_implJsonMember(json, jsonEnd, "segments"), jsonEnd, "0");
+        if (_implJsonString(_implJsonMember(segment, jsonEnd, "type"), jsonEnd, buf, sizeof(buf)) || strcmp(buf, "crypt")) {
+            fprintf(stderr, "%s: %s has no crypt segment\n", cmd_name, device);
+            return 1;
+        }
+        if (_implJsonMember(segment, jsonEnd, "integrity") != NULL) {
+            fprintf(stderr, "%s: %s uses authenticated encryption, which is not supported\n", cmd_name, device);
+            return 1;
+        }
+        if (_implJsonString(_implJsonMember(segment, jsonEnd, "encryption"), jsonEnd, vol->cipher, sizeof(vol->cipher)) ||
+            _implJsonNumber(_implJsonMember(segment, jsonEnd, "offset"), jsonEnd, &vol->offset) ||
+            _implJsonNumber(_implJsonMember(segment, jsonEnd, "iv_tweak"), jsonEnd, &vol->ivTweak) ||
+            _implJsonNumber(_implJsonMember(segment, jsonEnd, "sector_size"), jsonEnd, &vol->sectorSize)) {
+            fprintf(stderr, "%s: %s has an invalid crypt segment\n", cmd_name, device);
+            return 1;
+        }
+        p = _implJsonMember(segment, jsonEnd, "size");
+        if (_implJsonString(p, jsonEnd, buf, sizeof(buf)) || strcmp(buf, "dynamic")) {
+            if (_implJsonNumber(p, jsonEnd, &vol->size)) {
+                fprintf(stderr, "%s: %s has an invalid segment size\n", cmd_name, device);
+                return 1;
+            }
+        }
+
+        /* cryptsetup only ever writes pbkdf2 digests */
+        digest = _implJsonMember(_implJsonMember(json, jsonEnd, "digests"), jsonEnd, NULL);
+        if (_implJsonString(_implJsonMember(digest, jsonEnd, "type"), jsonEnd, buf, sizeof(buf)) || strcmp(buf, "pbkdf2") ||
+            _implJsonString(_implJsonMember(digest, jsonEnd, "hash"), jsonEnd, buf, sizeof(buf)) ||
+            (vol->digestAlg = _implHashFind(buf)) == NULL ||
+            _implJsonNumber(_implJsonMember(digest, jsonEnd, "iterations"), jsonEnd, &vol->digestIterations) ||
+            _implJsonString(_implJsonMember(digest, jsonEnd, "salt"), jsonEnd, buf, sizeof(buf)) ||
+            (vol->digestSaltLen = _implBase64Decode(buf, vol->digestSalt, sizeof(vol->digestSalt))) < 0 ||
+            _implJsonString(_implJsonMember(digest, jsonEnd, "digest"), jsonEnd, buf, sizeof(buf)) ||
+            (vol->digestLen = _implBase64Decode(buf, vol->digest, sizeof(vol->digest))) <= 0 ||
+            vol->digestLen > vol->digestAlg->digestLen) {
+            fprintf(stderr, "%s: %s has no supported volume key digest\n", cmd_name, device);
+            return 1;
+        }
+
+        /* all keyslots wrap the same volume key */
+        keyslots = _implJsonMember(json, jsonEnd, "keyslots");
+        for (i = 0; i < LUKS_MAX_KEYSLOTS; i++) {
+            unsigned long long keySize;
+
+            snprintf(buf, sizeof(buf), "%d", i);
+            p = _implJsonMember(keyslots, jsonEnd, buf);
+            if (p == NULL)
+                continue;
+            if (_implJsonNumber(_implJsonMember(p, jsonEnd, "key_size"), jsonEnd, &keySize) ||
+                _implLuks2ReadKeyslot(p, jsonEnd, &vol->keyslots[vol->keyslotCount])) {
+                fprintf(stderr, "%s: %s has an invalid keyslot %d\n", cmd_name, device, i);
+                return 1;
+            }
+            vol->keySize = keySize;
+            vol->keyslotCount++;
+        }
+        if (vol->keyslotCount == 0) {
+            fprintf(stderr, "%s: %s has no usable keyslot\n", cmd_name, device);
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "%s: %s has unsupported LUKS version %d\n", cmd_name, device, vol->version);
+        return 1;
+    }
+
+    if (vol->keySize == 0 || vol->keySize > LUKS_MAX_KEY_SIZE) {
+        fprintf(stderr, "%s: %s has unsupported key size %llu\n", cmd_name, device, vol->keySize);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* a candidate volume key is only good if it reproduces the digest in the header */
+static bool _implLuksCheckKey(struct luksVolume * vol, const unsigned char * key) {
+    unsigned char digest[HASH_MAX_DIGEST];
+    bool ok;
+
+    _implPbkdf2(vol->digestAlg, key, vol->keySize, vol->digestSalt, vol->digestSaltLen, vol->digestIterations, digest, vol->digestLen);
+    ok = !memcmp(digest, vol->digest, vol->digestLen);
+    memset(digest, 0, sizeof(digest));
+    return ok;
+}
+
+/*
+ * decrypt a keyslot area through the kernel crypto API (AF_ALG), 512 byte
+ * sector by sector with the sector number as IV, the way dm-crypt encrypted it
+ */
+static int _implLuksDecryptArea(char * cmd_name, const char * encryption, const unsigned char * key, int keyLen,
+                                unsigned char * buf, size_t len) {
+    struct sockaddr_alg sa = { .salg_family = AF_ALG, .salg_type = "skcipher" };
+    char cipher[64], * chain, * ivMode;
+    size_t off;
+    int tfm, op = -1;
+    int rc = 1;
+
+    snprintf(cipher, sizeof(cipher), "%s", encryption);
+    chain = strchr(cipher, '-');
+    ivMode = chain != NULL ? strchr(chain + 1, '-') : NULL;
+    if (ivMode == NULL) {
+        fprintf(stderr, "%s: unsupported keyslot encryption %s\n", cmd_name, encryption);
+        return 1;
+    }
+    *chain++ = '\0';
+    *ivMode++ = '\0';
+    if (!strcmp(ivMode, "plain64") || !strcmp(ivMode, "plain")) {
+        snprintf((char *)sa.salg_name, sizeof(sa.salg_name), "%s(%s)", chain, cipher);
+    } else if (!strncmp(ivMode, "essiv:", strlen("essiv:"))) {
+        snprintf((char *)sa.salg_name, sizeof(sa.salg_name), "essiv(%s(%s),%s)", chain, cipher, ivMode + strlen("essiv:"));
+    } else {
+        fprintf(stderr, "%s: unsupported keyslot encryption %s\n", cmd_name, encryption);
+        return 1;
+    }
+
+    tfm = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (tfm < 0 || bind(tfm, (struct sockaddr *)&sa, sizeof(sa)) ||
+        setsockopt(tfm, SOL_ALG, ALG_SET_KEY, key, keyLen) ||
+        (op = accept(tfm, NULL, 0)) < 0) {
+        fprintf(stderr, "%s: kernel crypto API has no %s: %d\n", cmd_name, sa.salg_name, errno);
+        goto out;
+    }
+
+    for (off = 0; off < len; off += 512) {
+        char cbuf[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct af_alg_iv) + 16)];
+        struct iovec iov = { .iov_base = buf + off, .iov_len = 512 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+        struct cmsghdr * cmsg;
+        struct af_alg_iv * iv;
+        uint64_t sector = htole64(strcmp(ivMode, "plain") ? off / 512 : (uint32_t)(off / 512));
+
+        memset(cbuf, 0, sizeof(cbuf));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_OP;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+        *(uint32_t *)CMSG_DATA(cmsg) = ALG_OP_DECRYPT;
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+        cmsg->cmsg_level = SOL_ALG;
+        cmsg->cmsg_type = ALG_SET_IV;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + 16);
+        iv = (struct af_alg_iv *)CMSG_DATA(cmsg);
+        iv->ivlen = 16;
+        memcpy(iv->iv, &sector, sizeof(sector));
+
+        if (sendmsg(op, &msg, 0) != 512 || read(op, buf + off, 512) != 512) {
+            fprintf(stderr, "%s: failed to decrypt keyslot: %d\n", cmd_name, errno);
+            goto out;
+        }
+    }
+    rc = 0;
+
+out:
+    if (op >= 0)
+        close(op);
+    if (tfm >= 0)
+        close(tfm);
+    return rc;
+}
+
+/* undo the anti-forensic split: xor the stripes together, diffusing with the hash in between */
+static void _implLuksAfMerge(const struct hashAlg * alg, const unsigned char * src, size_t keyLen, unsigned long long stripes,
+                             unsigned char * key) {
+    unsigned char digest[HASH_MAX_DIGEST];
+    struct hashCtx c;
+    unsigned long long s;
+    size_t j, n;
+    uint32_t i, be;
+
+    memset(key, 0, keyLen);
+    for (s = 0; s < stripes; s++) {
+        for (j = 0; j < keyLen; j++)
+            key[j] ^= src[s * keyLen + j];
+        if (s + 1 == stripes)
+            break;
+        for (i = 0; i * alg->digestLen < keyLen; i++) {
+            n = MIN(keyLen - i * alg->digestLen, alg->digestLen);
+            be = htobe32(i);
+            _implHashInit(&c, alg);
+            _implHashUpdate(&c, &be, 4);
+            _implHashUpdate(&c, key + i * alg->digestLen, n);
+            _implHashFinal(&c, digest);
+            memcpy(key + i * alg->digestLen, digest, n);
+        }
+    }
+    memset(digest, 0, sizeof(digest));
+}
+
+/* recover the volume key from a pbkdf2 keyslot with pass as the passphrase */
+static int _implLuksKeyslotOpen(char * cmd_name, int fd, struct luksVolume * vol, struct luksKeyslot * ks,
+                                const void * pass, size_t passLen, unsigned char * key) {
+    const struct hashAlg * kdf = _implHashFind(ks->kdfHash);
+    const struct hashAlg * af = _implHashFind(ks->afHash);
+    unsigned char derived[LUKS_MAX_KEY_SIZE];
+    unsigned char * area;
+    size_t len;
+    int rc = 1;
+
+    if (kdf == NULL || af == NULL || ks->areaKeySize > sizeof(derived) || ks->stripes == 0 || ks->stripes > 0x10000) {
+        return 1;
+    }
+
+    len = (vol->keySize * ks->stripes + 511) & ~(size_t)511;
+    area = malloc(len);
+    if (area == NULL) {
+        return 1;
+    }
+    if (pread(fd, area, len, ks->areaOffset) != len) {
+        fprintf(stderr, "%s: failed to read keyslot: %d\n", cmd_name, errno);
+        goto out;
+    }
+
+    _implPbkdf2(kdf, pass, passLen, ks->salt, ks->saltLen, ks->iterations, derived, ks->areaKeySize);
+    if (_implLuksDecryptArea(cmd_name, ks->encryption, derived, ks->areaKeySize, area, len)) {
+        /* callee prints error message */
+        goto out;
+    }
+    _implLuksAfMerge(af, area, vol->keySize, ks->stripes, key);
+    rc = 0;
+
+out:
+    memset(derived, 0, sizeof(derived));
+    memset(area, 0, len);
+    free(area);
+    return rc;
+}
+
+/*
+ * get the volume key out of secret: taken as the raw volume key when it has
+ * the right length and matches the digest, otherwise as the passphrase for
+ * each pbkdf2 keyslot in turn
+ */
+static int _implLuksUnlock(char * cmd_name, int fd, char * device, struct luksVolume * vol,
+                           const unsigned char * secret, size_t secretLen, unsigned char * key) {
+    int i;
+
+    if (secretLen == vol->keySize && _implLuksCheckKey(vol, secret)) {
+        memcpy(key, secret, secretLen);
+        return 0;
+    }
+    for (i = 0; i < vol->keyslotCount; i++) {
+        if (vol->keyslots[i].kdfHash[0] == '\0')
+            continue;
+        if (!_implLuksKeyslotOpen(cmd_name, fd, vol, &vol->keyslots[i], secret, secretLen, key) && _implLuksCheckKey(vol, key)) {
+            return 0;
+        }
+    }
+
+    memset(key, 0, vol->keySize);
+    fprintf(stderr, "%s: key does not match the volume key digest or any pbkdf2 keyslot of %s\n", cmd_name, device);
+    return 1;
+}
+
+/* unlock a single LUKS volume, keySpec is keyfile:path or keyring:description */
+static int _implLuksOpen(char * name, char * device, char * keySpec, char * optParams, int optCount, bool readOnly) {
+    char * cmd_name = "luks-open";
+    char devName[PATH_MAX];
+    char keyDesc[256];
+    char dmUuid[DM_UUID_LEN];
+    char params[1024];
+    unsigned char secret[LUKS_KEYFILE_MAX];
+    unsigned char key[LUKS_MAX_KEY_SIZE];
+    struct luksVolume vol;
+    struct stat sb;
+    unsigned long long devSize;
+    long keySerial = -1;
+    long n;
+    char * p;
+    int fd;
+    int rc;
+
+    if (_implMountConvertDevice(cmd_name, device, devName, sizeof(devName))) {
+        /* callee prints error message */
+        return 1;
+    }
+
+    if (!strncmp(keySpec, "keyring:", strlen("keyring:"))) {
+        /* a user key, logon keys can't be read back to check them against the header */
+        keySerial = _implKeyctl(KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING, (unsigned long)"user", (unsigned long)(keySpec + strlen("keyring:")));
+        n = keySerial < 0 ? -1 : _implKeyctl(KEYCTL_READ, keySerial, (unsigned long)secret, sizeof(secret));
+        if (n < 0 || n > sizeof(secret)) {
+            fprintf(stderr, "%s: failed to read user key %s: %d\n", cmd_name, keySpec + strlen("keyring:"), errno);
+            return 1;
+        }
+        keySerial = -1;
+    } else if (!strncmp(keySpec, "keyfile:", strlen("keyfile:"))) {
+        fd = open(keySpec + strlen("keyfile:"), O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "%s: failed to open key file %s: %d\n", cmd_name, keySpec + strlen("keyfile:"), errno);
+            return 1;
+        }
+        n = read(fd, secret, sizeof(secret));
+        close(fd);
+        if (n <= 0) {
+            fprintf(stderr, "%s: failed to read key file %s: %d\n", cmd_name, keySpec + strlen("keyfile:"), errno);
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "%s: invalid key %s, keyfile:<path> or keyring:<description> expected\n", cmd_name, keySpec);
+        return 1;
+    }
 
-            if (!access(fullPath, X_OK)) {
-            bin = fullPath;
+    fd = open(devName, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %d\n", cmd_name, devName, errno);
+        goto fail;
+    }
+    if (_implLuksReadHeader(cmd_name, fd, devName, &vol) ||
+        _implLuksUnlock(cmd_name, fd, devName, &vol, secret, n, key)) {
+        /* callee prints error message */
+        close(fd);
+        goto fail;
+    }
+    memset(secret, 0, sizeof(secret));
+    if (fstat(fd, &sb) || (S_ISREG(sb.st_mode) ? (devSize = sb.st_size, 0) : ioctl(fd, BLKGETSIZE64, &devSize))) {
+        fprintf(stderr, "%s: failed to get size of %s: %d\n", cmd_name, devName, errno);
+        close(fd);
+        goto fail;
+    }
+    close(fd);
+
+    if (vol.size == 0) {
+        if (devSize <= vol.offset) {
+            fprintf(stderr, "%s: %s is too small\n", cmd_name, devName);
+            goto fail;
+        }
+        vol.size = devSize - vol.offset;
+    }
+
+    /* dm-crypt looks the key up by description, so the key never shows up in the table */
+    snprintf(keyDesc, sizeof(keyDesc), LUKS_KEY_DESC_PREFIX "%s", name);
+    if (!testing) {
+        keySerial = _implAddKey("logon", keyDesc, key, vol.keySize, KEY_SPEC_USER_KEYRING);
+        if (keySerial < 0) {
+            fprintf(stderr, "%s: failed to add key for %s to the keyring: %d\n", cmd_name, name, errno);
+            goto fail;
+        }
+    }
+    memset(key, 0, sizeof(key));
+
+    /* the same uuid cryptsetup uses, so later tools recognize the mapping */
+    n = snprintf(dmUuid, sizeof(dmUuid), "CRYPT-LUKS%d-", vol.version);
+    for (p = vol.uuid; *p != '\0'; p++) {
+        if (*p != '-')
+            dmUuid[n++] = *p;
+    }
+    snprintf(dmUuid + n, sizeof(dmUuid) - n, "-%s", name);
+
+    if (vol.sectorSize != 512) {
+        optCount++;
+    }
+    snprintf(params, sizeof(params), "%s :%llu:logon:%s %llu %u:%u %llu",
+             vol.cipher, vol.keySize, keyDesc, vol.ivTweak, major(sb.st_rdev), minor(sb.st_rdev), vol.offset / 512);
+    if (optCount > 0) {
+        snprintf(params + strlen(params), sizeof(params) - strlen(params), " %d%s", optCount, optParams);
+        if (vol.sectorSize != 512) {
+            snprintf(params + strlen(params), sizeof(params) - strlen(params), " sector_size:%llu", vol.sectorSize);
+        }
+    }
+
+    if (testing) {
+        printf("luks-open '%s' '%s': crypt 0 %llu %s\n", name, devName, vol.size / 512, params);
+        return 0;
+    }
+
+    rc = _implDmCreate(cmd_name, name, dmUuid, "crypt", vol.size / 512, params, readOnly);
+
+    /* dm-crypt keeps its own copy, don't leave the key we added lying around */
+    (void)_implKeyctl(KEYCTL_INVALIDATE, keySerial, 0, 0);
+
+    return rc;
+
+fail:
+    memset(secret, 0, sizeof(secret));
+    memset(key, 0, sizeof(key));
+    return 1;
+}
+
+int luksOpenCommand(char * cmd, char * end) {
+    char * usage = "usage: luks-open <opts> <name> <device> <key> [<name> <device> <key>...]";
+    char * options;
+    char optParams[256] = "";
+    int optCount = 0;
+    bool readOnly = false;
+    char * args[3 * 32];
+    int pids[32];
+    int num, i;
+    int rc = 0;
+
+    if (!(cmd = getArg(cmd, end, &options))) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
+    }
+
+    /* dm-crypt performance flags, "-" for none */
+    if (strcmp(options, "-")) {
+        char * opt;
+
+        for (opt = strtok(options, ","); opt != NULL; opt = strtok(NULL, ",")) {
+            if (!strcmp(opt, "ro")) {
+                readOnly = true;
+            } else if (!strcmp(opt, "no_read_workqueue") || !strcmp(opt, "no_write_workqueue") ||
+                       !strcmp(opt, "same_cpu_crypt") || !strcmp(opt, "submit_from_crypt_cpus") ||
+                       !strcmp(opt, "allow_discards")) {
+                snprintf(optParams + strlen(optParams), sizeof(optParams) - strlen(optParams), " %s", opt);
+                optCount++;
+            } else {
+                fprintf(stderr, "luks-open: unknown option %s\n", opt);
+                return 1;
+            }
+        }
+    }
+
+    for (num = 0; cmd < end; num++) {
+        if (num == sizeof(args) / sizeof(args[0])) {
+            fprintf(stderr, "luks-open: too many volumes\n");
+            return 1;
+        }
+        if (!(cmd = getArg(cmd, end, &args[num]))) {
+            fprintf(stderr, "%s\n", usage);
+            return 1;
+        }
+    }
+    if (num == 0 || num % 3 != 0) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
+    }
+
+    /* a single volume, or test mode where output order matters */
+    if (num == 3 || testing) {
+        for (i = 0; i < num; i += 3) {
+            if (_implLuksOpen(args[i], args[i + 1], args[i + 2], optParams, optCount, readOnly))
+                rc = 1;
+        }
+        return rc;
+    }
+
+    for (i = 0; i < num; i += 3) {
+        pids[i / 3] = fork();
+        if (pids[i / 3] == 0) {
+            _exit(_implLuksOpen(args[i], args[i + 1], args[i + 2], optParams, optCount, readOnly));
+        }
+        if (pids[i / 3] < 0) {
+            fprintf(stderr, "luks-open: fork failed: %d\n", errno);
+            if (_implLuksOpen(args[i], args[i + 1], args[i + 2], optParams, optCount, readOnly))
+                rc = 1;
+        }
+    }
+
+    for (i = 0; i < num / 3; i++) {
+        int status;
+
+        if (pids[i] <= 0)
+            continue;
+        if (waitpid(pids[i], &status, 0) != pids[i] || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * bcachefs encryption: the passphrase goes through scrypt (PBKDF2-HMAC-SHA256
+ * around salsa20/8) and the result must decrypt the key in the crypt field
+ * of the superblock with ChaCha20. The kernel finds it in the keyring as
+ * bcachefs:<user uuid>.
+ */
+#define BCH_SB_OFFSET           4096
+#define BCH_SB_FIELDS_OFFSET    752
+#define BCH_SB_MAX_SIZE         (1 << 20)
+#define BCH_SB_FIELD_CRYPT      2
+#define BCH_KEY_MAGIC           "bch**key"
+#define BCH_KDF_SCRYPT          0
+#define BCH_PASSPHRASE_MAX      1024
+
+static void _implSalsa208(uint32_t * b) {
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, b, sizeof(x));
+    for (i = 0; i < 8; i += 2) {
+        x[4] ^= ROTL32(x[0] + x[12], 7);   x[8] ^= ROTL32(x[4] + x[0], 9);
+        x[12] ^= ROTL32(x[8] + x[4], 13);  x[0] ^= ROTL32(x[12] + x[8], 18);
+        x[9] ^= ROTL32(x[5] + x[1], 7);    x[13] ^= ROTL32(x[9] + x[5], 9);
+        x[1] ^= ROTL32(x[13] + x[9], 13);  x[5] ^= ROTL32(x[1] + x[13], 18);
+        x[14] ^= ROTL32(x[10] + x[6], 7);  x[2] ^= ROTL32(x[14] + x[10], 9);
+        x[6] ^= ROTL32(x[2] + x[14], 13);  x[10] ^= ROTL32(x[6] + x[2], 18);
+        x[3] ^= ROTL32(x[15] + x[11], 7);  x[7] ^= ROTL32(x[3] + x[15], 9);
+        x[11] ^= ROTL32(x[7] + x[3], 13);  x[15] ^= ROTL32(x[11] + x[7], 18);
+        x[1] ^= ROTL32(x[0] + x[3], 7);    x[2] ^= ROTL32(x[1] + x[0], 9);
+        x[3] ^= ROTL32(x[2] + x[1], 13);   x[0] ^= ROTL32(x[3] + x[2], 18);
+        x[6] ^= ROTL32(x[5] + x[4], 7);    x[7] ^= ROTL32(x[6] + x[5], 9);
+        x[4] ^= ROTL32(x[7] + x[6], 13);   x[5] ^= ROTL32(x[4] + x[7], 18);
+        x[11] ^= ROTL32(x[10] + x[9], 7);  x[8] ^= ROTL32(x[11] + x[10], 9);
+        x[9] ^= ROTL32(x[8] + x[11], 13);  x[10] ^= ROTL32(x[9] + x[8], 18);
+        x[12] ^= ROTL32(x[15] + x[14], 7); x[13] ^= ROTL32(x[12] + x[15], 9);
+        x[14] ^= ROTL32(x[13] + x[12], 13); x[15] ^= ROTL32(x[14] + x[13], 18);
+    }
+    for (i = 0; i < 16; i++)
+        b[i] += x[i];
+}
+
+/* scrypt BlockMix, b and y are 32 * r words */
+static void _implScryptBlockMix(uint32_t * b, uint32_t * y, int r) {
+    uint32_t x[16];
+    int i, j;
+
+    memcpy(x, b + (2 * r - 1) * 16, sizeof(x));
+    for (i = 0; i < 2 * r; i++) {
+        for (j = 0; j < 16; j++)
+            x[j] ^= b[i * 16 + j];
+        _implSalsa208(x);
+        memcpy(y + ((i & 1) * r + i / 2) * 16, x, sizeof(x));
+    }
+    memcpy(b, y, sizeof(uint32_t) * 32 * r);
+}
+
+static int _implScrypt(const void * pass, size_t passLen, const void * salt, size_t saltLen,
+                       uint64_t n, uint32_t r, uint32_t p, unsigned char * out, size_t outLen) {
+    size_t blockLen = 128 * (size_t)r;
+    unsigned char * b;
+    uint32_t * x, * y, * v;
+    uint64_t i, j;
+    uint32_t k, w;
+
+    if (n < 2 || (n & (n - 1)) || r == 0 || p == 0 || n > SIZE_MAX / blockLen)
+        return 1;
+    b = malloc(blockLen * p);
+    x = malloc(blockLen * 2);
+    v = malloc(blockLen * n);
+    if (b == NULL || x == NULL || v == NULL) {
+        free(b);
+        free(x);
+        free(v);
+        return 1;
+    }
+    y = x + 32 * r;
+
+    _implPbkdf2(HASH_SHA256, pass, passLen, salt, saltLen, 1, b, blockLen * p);
+    for (k = 0; k < p; k++) {
+        for (w = 0; w < 32 * r; w++)
+            x[w] = le32toh(*(uint32_t *)(b + k * blockLen + w * 4));
+        for (i = 0; i < n; i++) {
+            memcpy(v + i * 32 * r, x, blockLen);
+            _implScryptBlockMix(x, y, r);
+        }
+        for (i = 0; i < n; i++) {
+            j = x[(2 * r - 1) * 16] & (n - 1);
+            for (w = 0; w < 32 * r; w++)
+                x[w] ^= v[j * 32 * r + w];
+            _implScryptBlockMix(x, y, r);
+        }
+        for (w = 0; w < 32 * r; w++)
+            *(uint32_t *)(b + k * blockLen + w * 4) = htole32(x[w]);
+    }
+    _implPbkdf2(HASH_SHA256, pass, passLen, b, blockLen * p, 1, out, outLen);
+
+    memset(b, 0, blockLen * p);
+    memset(x, 0, blockLen * 2);
+    memset(v, 0, blockLen * n);
+    free(b);
+    free(x);
+    free(v);
+    return 0;
+}
+
+#define CHACHA_QR(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8);  c += d; b ^= c; b = ROTL32(b, 7)
+
+/* ChaCha20 with a 32 bit block counter and a 96 bit nonce (RFC 7539) */
+static void _implChacha20Xor(const unsigned char * key, const uint32_t * nonce, uint32_t counter, unsigned char * buf, size_t len) {
+    uint32_t state[16], x[16];
+    unsigned char stream[64];
+    size_t i, n;
+    int j;
+
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (j = 0; j < 8; j++)
+        state[4 + j] = le32toh(*(const uint32_t *)(key + j * 4));
+    state[12] = counter;
+    state[13] = nonce[0];
+    state[14] = nonce[1];
+    state[15] = nonce[2];
+
+    while (len > 0) {
+        memcpy(x, state, sizeof(x));
+        for (j = 0; j < 10; j++) {
+            CHACHA_QR(x[0], x[4], x[8], x[12]);
+            CHACHA_QR(x[1], x[5], x[9], x[13]);
+            CHACHA_QR(x[2], x[6], x[10], x[14]);
+            CHACHA_QR(x[3], x[7], x[11], x[15]);
+            CHACHA_QR(x[0], x[5], x[10], x[15]);
+            CHACHA_QR(x[1], x[6], x[11], x[12]);
+            CHACHA_QR(x[2], x[7], x[8], x[13]);
+            CHACHA_QR(x[3], x[4], x[9], x[14]);
+        }
+        for (j = 0; j < 16; j++)
+            *(uint32_t *)(stream + j * 4) = htole32(x[j] + state[j]);
+        n = MIN(len, sizeof(stream));
+        for (i = 0; i < n; i++)
+            buf[i] ^= stream[i];
+        buf += n;
+        len -= n;
+        state[12]++;
+    }
+    memset(x, 0, sizeof(x));
+    memset(stream, 0, sizeof(stream));
+}
+
+/* read the passphrase from the console without echoing it */
+static int _implReadPassphrase(char * cmd_name, const char * device, char * buf, int buf_len) {
+    struct termios old, quiet;
+    int fd, n;
+
+    fd = open("/dev/console", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to open /dev/console: %d\n", cmd_name, errno);
+        return 1;
+    }
+    logFlush();
+    dprintf(fd, "Enter passphrase for %s: ", device);
+    if (!tcgetattr(fd, &old)) {
+        quiet = old;
+        quiet.c_lflag &= ~ECHO;
+        (void)tcsetattr(fd, TCSAFLUSH, &quiet);
+    }
+    n = read(fd, buf, buf_len - 1);
+    (void)tcsetattr(fd, TCSAFLUSH, &old);
+    dprintf(fd, "\n");
+    close(fd);
+    if (n <= 0)
+        return 1;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\r\n")] = '\0';
+    return 0;
+}
+
+int bcachefsUnlockCommand(char * cmd, char * end) {
+    char * usage = "usage: bcachefs-unlock <opts> <device>";
+    char * cmd_name = "bcachefs-unlock";
+    char * options, * device;
+    char devName[PATH_MAX];
+    char passphrase[BCH_PASSPHRASE_MAX];
+    char keyDesc[64];
+    char uuid[40];
+    unsigned char head[BCH_SB_FIELDS_OFFSET];
+    unsigned char * sb = NULL, * field, * crypt = NULL;
+    unsigned char key[32], check[40];
+    uint32_t nonce[3];
+    uint64_t flags, kdfFlags;
+    char * keyFile = NULL;
+    int keyring = KEY_SPEC_USER_KEYRING;
+    size_t sbSize;
+    int fd, n;
+    int rc = 1;
+
+    if (!(cmd = getArg(cmd, end, &options)) || !(cmd = getArg(cmd, end, &device))) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
+    }
+    if (cmd < end) {
+        fprintf(stderr, "bcachefs-unlock: unexpected arguments\n");
+        return 1;
+    }
+
+    if (strcmp(options, "-")) {
+        char * opt;
+
+        for (opt = strtok(options, ","); opt != NULL; opt = strtok(NULL, ",")) {
+            if (!strncmp(opt, "keyfile=", strlen("keyfile="))) {
+                keyFile = opt + strlen("keyfile=");
+            } else if (!strcmp(opt, "keyring=user")) {
+                keyring = KEY_SPEC_USER_KEYRING;
+            } else if (!strcmp(opt, "keyring=session")) {
+                keyring = KEY_SPEC_SESSION_KEYRING;
+            } else if (!strcmp(opt, "keyring=user_session")) {
+                keyring = KEY_SPEC_USER_SESSION_KEYRING;
+            } else {
+                fprintf(stderr, "bcachefs-unlock: unknown option %s\n", opt);
+                return 1;
+            }
+        }
+    }
+
+    if (_implMountConvertDevice(cmd_name, device, devName, sizeof(devName))) {
+        /* callee prints error message */
+        return 1;
+    }
+
+    if (testing) {
+        printf("bcachefs-unlock %s with %s%s\n", devName, keyFile ? "key file " : "passphrase from the console", keyFile ? keyFile : "");
+        return 0;
+    }
+
+    fd = open(devName, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "bcachefs-unlock: failed to open %s: %d\n", devName, errno);
+        return 1;
+    }
+    if (pread(fd, head, sizeof(head), BCH_SB_OFFSET) != sizeof(head) ||
+        (memcmp(head + 24, bcachefsMagic, 16) && memcmp(head + 24, bcacheMagic, 16))) {
+        fprintf(stderr, "bcachefs-unlock: no bcachefs superblock on %s\n", devName);
+        close(fd);
+        return 1;
+    }
+    sbSize = BCH_SB_FIELDS_OFFSET + (size_t)le32toh(*(uint32_t *)(head + 124)) * 8;
+    if (sbSize > BCH_SB_MAX_SIZE || (sb = arenaAlloc(&lineArena, sbSize)) == NULL ||
+        pread(fd, sb, sbSize, BCH_SB_OFFSET) != (ssize_t)sbSize) {
+        fprintf(stderr, "bcachefs-unlock: failed to read the superblock of %s\n", devName);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    /* fields are 8 byte headers (u64s, type) and their payload */
+    for (field = sb + BCH_SB_FIELDS_OFFSET; field + 8 <= sb + sbSize; field += (size_t)le32toh(*(uint32_t *)field) * 8) {
+        uint32_t u64s = le32toh(*(uint32_t *)field);
+
+        if (u64s == 0 || field + (size_t)u64s * 8 > sb + sbSize)
+            break;
+        if (le32toh(*(uint32_t *)(field + 4)) == BCH_SB_FIELD_CRYPT && u64s * 8 >= 64) {
+            crypt = field;
             break;
+        }
+    }
+    if (crypt == NULL || !memcmp(crypt + 24, BCH_KEY_MAGIC, 8)) {
+        fprintf(stderr, "bcachefs-unlock: %s is not encrypted\n", devName);
+        return 1;
+    }
+    flags = le64toh(*(uint64_t *)(crypt + 8));
+    kdfFlags = le64toh(*(uint64_t *)(crypt + 16));
+    if ((flags & 0xf) != BCH_KDF_SCRYPT || (kdfFlags & 0xffff) >= 48 ||
+        ((kdfFlags >> 16) & 0xffff) >= 16 || ((kdfFlags >> 32) & 0xffff) >= 16) {
+        fprintf(stderr, "bcachefs-unlock: unsupported key derivation on %s\n", devName);
+        return 1;
+    }
+
+    if (keyFile != NULL) {
+        fd = open(keyFile, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "bcachefs-unlock: failed to open key file %s: %d\n", keyFile, errno);
+            return 1;
+        }
+        n = read(fd, passphrase, sizeof(passphrase) - 1);
+        close(fd);
+        if (n < 0) {
+            fprintf(stderr, "bcachefs-unlock: failed to read key file %s: %d\n", keyFile, errno);
+            return 1;
+        }
+        passphrase[n] = '\0';
+        if (n > 0 && passphrase[n - 1] == '\n')
+            passphrase[n - 1] = '\0';
+    } else if (_implReadPassphrase(cmd_name, devName, passphrase, sizeof(passphrase))) {
+        fprintf(stderr, "bcachefs-unlock: no passphrase for %s\n", devName);
+        return 1;
+    }
+
+    /* the salt is "bcache" with its terminating NUL, as bcachefs-tools has it */
+    if (_implScrypt(passphrase, strlen(passphrase), "bcache", 7,
+                    1ULL << (kdfFlags & 0xffff), 1U << ((kdfFlags >> 16) & 0xffff), 1U << ((kdfFlags >> 32) & 0xffff),
+                    key, sizeof(key))) {
+        fprintf(stderr, "bcachefs-unlock: key derivation for %s failed\n", devName);
+        goto out;
+    }
+
+    /* the nonce comes from the first 8 bytes of the internal uuid */
+    nonce[0] = 0;
+    memcpy(&nonce[1], sb + 40, 8);
+    memcpy(check, crypt + 24, sizeof(check));
+    _implChacha20Xor(key, nonce, 0, check, sizeof(check));
+    if (memcmp(check, BCH_KEY_MAGIC, 8)) {
+        fprintf(stderr, "bcachefs-unlock: wrong passphrase for %s\n", devName);
+        goto out;
+    }
+
+    _implProbeUuid(uuid, sb + 56);
+    snprintf(keyDesc, sizeof(keyDesc), "bcachefs:%s", uuid);
+    if (_implAddKey("user", keyDesc, key, sizeof(key), keyring) < 0) {
+        fprintf(stderr, "bcachefs-unlock: failed to add key for %s to the keyring: %d\n", devName, errno);
+        goto out;
+    }
+    rc = 0;
+
+out:
+    memset(passphrase, 0, sizeof(passphrase));
+    memset(key, 0, sizeof(key));
+    memset(check, 0, sizeof(check));
+    return rc;
+}
+
+#define VERITY_SIGNATURE        "verity\0\0"
+#define VERITY_MAX_LEVELS       63
+#define VERITY_PREFETCH_WORKERS 4
+
+struct verityVolume {
+    unsigned int hashType;
+    char uuid[33];
+    char algorithm[32];
+    unsigned int dataBlockSize;
+    unsigned int hashBlockSize;
+    unsigned long long dataBlocks;
+    unsigned long long hashStart;       /* in hash blocks */
+    unsigned long long hashBlocks;      /* hash tree size in hash blocks */
+    int hashPerBlockBits;
+    int levels;
+    char salt[2 * 256 + 1];
+};
+
+static int _implVerityReadSuperblock(char * cmd_name, char * hashDev, unsigned long long hashOffset, struct verityVolume * vol) {
+    unsigned char sb[512];
+    unsigned int saltSize, digestSize;
+    int fd, i;
+
+    fd = open(hashDev, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %d\n", cmd_name, hashDev, errno);
+        return 1;
+    }
+    if (pread(fd, sb, sizeof(sb), hashOffset) != sizeof(sb) || memcmp(sb, VERITY_SIGNATURE, 8) || le32toh(*(uint32_t *)(sb + 8)) != 1) {
+        fprintf(stderr, "%s: no verity superblock on %s\n", cmd_name, hashDev);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    memset(vol, 0, sizeof(*vol));
+    vol->hashType = le32toh(*(uint32_t *)(sb + 12));
+    for (i = 0; i < 16; i++) {
+        sprintf(vol->uuid + i * 2, "%02x", sb[16 + i]);
+    }
+    memcpy(vol->algorithm, sb + 32, sizeof(vol->algorithm) - 1);
+    vol->dataBlockSize = le32toh(*(uint32_t *)(sb + 64));
+    vol->hashBlockSize = le32toh(*(uint32_t *)(sb + 68));
+    vol->dataBlocks = le64toh(*(uint64_t *)(sb + 72));
+    saltSize = le16toh(*(uint16_t *)(sb + 80));
+    if (saltSize > 256 || vol->dataBlocks == 0 ||
+        vol->dataBlockSize < 512 || (vol->dataBlockSize & (vol->dataBlockSize - 1)) ||
+        vol->hashBlockSize < 512 || (vol->hashBlockSize & (vol->hashBlockSize - 1))) {
+        fprintf(stderr, "%s: invalid verity superblock on %s\n", cmd_name, hashDev);
+        return 1;
+    }
+    strcpy(vol->salt, "-");
+    for (i = 0; i < saltSize; i++) {
+        sprintf(vol->salt + i * 2, "%02x", sb[88 + i]);
+    }
+
+    /* the tree starts right after the superblock */
+    vol->hashStart = hashOffset / vol->hashBlockSize + 1;
+
+    if (!strcmp(vol->algorithm, "sha1")) {
+        digestSize = 20;
+    } else if (!strcmp(vol->algorithm, "sha256")) {
+        digestSize = 32;
+    } else if (!strcmp(vol->algorithm, "sha512")) {
+        digestSize = 64;
+    } else {
+        digestSize = 0;
+    }
+
+    /* same tree geometry as dm-verity, only needed for prefetching and FEC */
+    if (digestSize != 0) {
+        unsigned int perBlock = 1;
+
+        while (perBlock * 2 * digestSize <= vol->hashBlockSize) {
+            perBlock *= 2;
+            vol->hashPerBlockBits++;
+        }
+        while (vol->levels < VERITY_MAX_LEVELS && ((vol->dataBlocks - 1) >> (vol->hashPerBlockBits * vol->levels)))
+            vol->levels++;
+        for (i = 0; i < vol->levels; i++) {
+            int shift = (i + 1) * vol->hashPerBlockBits;
+            vol->hashBlocks += (shift >= 64) ? 1 : (vol->dataBlocks + (1ULL << shift) - 1) >> shift;
+        }
+    }
+
+    return 0;
+}
+
+/* read one data block under every level 1 hash block so dm-verity caches levels 1 and up */
+static void _implVerityPrefetch(char * name, struct verityVolume * vol) {
+    char devName[PATH_MAX];
+    unsigned long long stride, nblocks;
+    int i;
+
+    if (vol->hashPerBlockBits == 0) {
+        return;
+    }
+
+    stride = (vol->levels >= 2) ? 1ULL << (2 * vol->hashPerBlockBits) : vol->dataBlocks;
+    nblocks = (vol->dataBlocks + stride - 1) / stride;
+    snprintf(devName, sizeof(devName), "/dev/mapper/%s", name);
+
+    /* not waited for, the workers run while the rest of startup.rc goes on and are reaped later */
+    for (i = 0; i < VERITY_PREFETCH_WORKERS && i < nblocks; i++) {
+        pid_t pid = fork();
+
+        if (pid > 0) {
+            addBackground(pid);
+        } else if (pid == 0) {
+            char * buf = arenaAlloc(&lineArena, vol->dataBlockSize);
+            unsigned long long b;
+            int fd = open(devName, O_RDONLY);
+
+            if (fd < 0)
+                _exit(1);
+            (void)posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+            for (b = i; b < nblocks; b += VERITY_PREFETCH_WORKERS) {
+                (void)pread(fd, buf, vol->dataBlockSize, b * stride * vol->dataBlockSize);
             }
+            _exit(0);
         }
     }
+}
 
-    *nextArg = strdup(bin);
+static int _implReadHexFile(char * cmd_name, const char * path, char * buf, int buf_len) {
+    int fd, n;
 
-    while (cmd && cmd < end) {
-        nextArg++;
-        cmd = getArg(cmd, end, nextArg);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %d\n", cmd_name, path, errno);
+        return 1;
+    }
+    n = read(fd, buf, buf_len - 1);
+    close(fd);
+    if (n <= 0) {
+        fprintf(stderr, "%s: failed to read %s\n", cmd_name, path);
+        return 1;
+    }
+    while (n > 0 && isspace(buf[n - 1]))
+        n--;
+    buf[n] = '\0';
+    return 0;
+}
+
+int verityOpenCommand(char * cmd, char * end) {
+    char * usage = "usage: verity-open <opts> <name> <data-device> <hash-device> <roothash>";
+    char * cmd_name = "verity-open";
+    char * options, * name, * dataDev, * hashDev, * rootHashArg;
+    char dataDevName[PATH_MAX], hashDevName[PATH_MAX], fecDevName[PATH_MAX];
+    char rootHash[2 * 64 + 2];
+    char optParams[PATH_MAX + 256] = "";
+    char params[PATH_MAX * 3 + 1024];
+    char dmUuid[DM_UUID_LEN];
+    char * fecDev = NULL;
+    char * sigFile = NULL;
+    unsigned long long hashOffset = 0;
+    unsigned long long fecRoots = 2, fecBlocks = 0, fecStart = 0;
+    bool prefetch = true;
+    int optCount = 0;
+    struct verityVolume vol;
+    struct stat dataSb, hashSb;
+    char * p;
+
+    if (!(cmd = getArg(cmd, end, &options)) || !(cmd = getArg(cmd, end, &name)) ||
+        !(cmd = getArg(cmd, end, &dataDev)) || !(cmd = getArg(cmd, end, &hashDev)) ||
+        !(cmd = getArg(cmd, end, &rootHashArg))) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
+    }
+    if (cmd < end) {
+        fprintf(stderr, "verity-open: unexpected arguments\n");
+        return 1;
+    }
+
+    if (strcmp(options, "-")) {
+        char * opt;
+
+        for (opt = strtok(options, ","); opt != NULL; opt = strtok(NULL, ",")) {
+            if (!strcmp(opt, "check_at_most_once") || !strcmp(opt, "ignore_zero_blocks") ||
+                !strcmp(opt, "restart_on_corruption") || !strcmp(opt, "panic_on_corruption")) {
+                snprintf(optParams + strlen(optParams), sizeof(optParams) - strlen(optParams), " %s", opt);
+                optCount++;
+            } else if (!strncmp(opt, "hash_offset=", strlen("hash_offset="))) {
+                hashOffset = strtoull(opt + strlen("hash_offset="), NULL, 10);
+            } else if (!strncmp(opt, "fec=", strlen("fec="))) {
+                fecDev = opt + strlen("fec=");
+            } else if (!strncmp(opt, "fec_roots=", strlen("fec_roots="))) {
+                fecRoots = strtoull(opt + strlen("fec_roots="), NULL, 10);
+            } else if (!strncmp(opt, "fec_blocks=", strlen("fec_blocks="))) {
+                fecBlocks = strtoull(opt + strlen("fec_blocks="), NULL, 10);
+            } else if (!strncmp(opt, "fec_start=", strlen("fec_start="))) {
+                fecStart = strtoull(opt + strlen("fec_start="), NULL, 10);
+            } else if (!strncmp(opt, "sig=", strlen("sig="))) {
+                sigFile = opt + strlen("sig=");
+            } else if (!strcmp(opt, "noprefetch")) {
+                prefetch = false;
+            } else {
+                fprintf(stderr, "verity-open: unknown option %s\n", opt);
+                return 1;
+            }
+        }
+    }
+
+    /* root hash given literally, as a file, or by roothash= on the kernel command line */
+    if (!strcmp(rootHashArg, "cmdline")) {
+        char * value = getKernelArgValue("roothash=");
+        if (value == NULL || strlen(value) >= sizeof(rootHash)) {
+            fprintf(stderr, "verity-open: no valid roothash= on the kernel command line\n");
+            return 1;
+        }
+        strcpy(rootHash, value);
+    } else if (*rootHashArg == '/') {
+        if (_implReadHexFile(cmd_name, rootHashArg, rootHash, sizeof(rootHash))) {
+            /* callee prints error message */
+            return 1;
+        }
+    } else if (strlen(rootHashArg) < sizeof(rootHash)) {
+        strcpy(rootHash, rootHashArg);
+    } else {
+        fprintf(stderr, "verity-open: root hash is too long\n");
+        return 1;
+    }
+    for (p = rootHash; *p != '\0'; p++) {
+        if (!isxdigit(*p)) {
+            fprintf(stderr, "verity-open: invalid root hash %s\n", rootHash);
+            return 1;
+        }
+    }
+
+    if (_implMountConvertDevice(cmd_name, dataDev, dataDevName, sizeof(dataDevName)) ||
+        _implMountConvertDevice(cmd_name, hashDev, hashDevName, sizeof(hashDevName))) {
+        /* callee prints error message */
+        return 1;
+    }
+    if (_implVerityReadSuperblock(cmd_name, hashDevName, hashOffset, &vol)) {
+        /* callee prints error message */
+        return 1;
+    }
+    if (!testing && (stat(dataDevName, &dataSb) || stat(hashDevName, &hashSb))) {
+        fprintf(stderr, "verity-open: failed to stat %s or %s: %d\n", dataDevName, hashDevName, errno);
+        return 1;
     }
-    
-    if (cmd) nextArg++;
-    *nextArg = NULL;
 
-    /* if the next-to-last arg is a >, redirect the output properly */
-    if (((nextArg - args) >= 2) && !strcmp(*(nextArg - 2), ">")) {
-        stdoutFile = *(nextArg - 1);
-        *(nextArg - 2) = NULL;
+    if (fecDev != NULL) {
+        struct stat fecSb;
 
-        stdoutFd = open(stdoutFile, O_CREAT | O_RDWR | O_TRUNC, 0600);
-        if (stdoutFd < 0) {
-            fprintf(stderr, "init: failed to open %s: %d\n", stdoutFile, errno);
+        if (_implMountConvertDevice(cmd_name, fecDev, fecDevName, sizeof(fecDevName))) {
+            /* callee prints error message */
             return 1;
         }
+        if (!testing) {
+            if (stat(fecDevName, &fecSb)) {
+                fprintf(stderr, "verity-open: failed to stat %s: %d\n", fecDevName, errno);
+                return 1;
+            }
+            snprintf(fecDevName, sizeof(fecDevName), "%u:%u", major(fecSb.st_rdev), minor(fecSb.st_rdev));
+        }
+        /* by default the codewords cover the data blocks followed by everything up to the end of the tree */
+        if (fecBlocks == 0) {
+            fecBlocks = vol.dataBlocks + (vol.hashStart + vol.hashBlocks) * vol.hashBlockSize / vol.dataBlockSize;
+        }
+        snprintf(optParams + strlen(optParams), sizeof(optParams) - strlen(optParams),
+                 " use_fec_from_device %s fec_roots %llu fec_blocks %llu fec_start %llu",
+                 fecDevName, fecRoots, fecBlocks, fecStart);
+        optCount += 8;
     }
 
-    if (testing) {
-        printf("%s ", bin);
-        nextArg = args + 1;
-        while (*nextArg)
-            printf(" '%s'", *nextArg++);
-        if (stdoutFile)
-            printf(" (> %s)", stdoutFile);
-        printf("\n");
-    } else {
-        if (!doFork || !(pid = fork())) {
-            /* child */
-            dup2(stdoutFd, 1);
-            execve(args[0], args, env);
-            fprintf(stderr, "ERROR: failed in exec of %s\n", args[0]);
-            return 1;
-        }
+    if (sigFile != NULL) {
+        char keyDesc[256];
 
-        close(stdoutFd);
+        snprintf(keyDesc, sizeof(keyDesc), LUKS_KEY_DESC_PREFIX "verity:%s", name);
+        if (!testing) {
+            char sig[8192];
+            int fd, n;
 
-        for (;;) {
-            wpid = wait4(-1, &status, 0, NULL);
-            if (wpid == -1) {
-                fprintf(stderr, "ERROR: Failed to wait for process %d\n", wpid);
+            fd = open(sigFile, O_RDONLY);
+            if (fd < 0) {
+                fprintf(stderr, "verity-open: failed to open %s: %d\n", sigFile, errno);
                 return 1;
             }
-
-            if (wpid != pid)
-                continue;
-
-            if (!WIFEXITED(status) || WEXITSTATUS(status)) {
-                fprintf(stderr, "ERROR: %s exited abnormally! (pid %d)\n", args[0], pid);
+            n = read(fd, sig, sizeof(sig));
+            close(fd);
+            if (n <= 0) {
+                fprintf(stderr, "verity-open: failed to read %s\n", sigFile);
+                return 1;
+            }
+            /* dm-verity checks the PKCS#7 signature of the root hash against the kernel trusted keys */
+            if (_implAddKey("user", keyDesc, sig, n, KEY_SPEC_USER_KEYRING) < 0) {
+                fprintf(stderr, "verity-open: failed to add signature to the keyring: %d\n", errno);
                 return 1;
             }
-            break;
         }
+        snprintf(optParams + strlen(optParams), sizeof(optParams) - strlen(optParams), " root_hash_sig_key_desc %s", keyDesc);
+        optCount += 2;
     }
 
-    return 0;
-}
+    if (testing) {
+        snprintf(params, sizeof(params), "%u %s %s", vol.hashType, dataDevName, hashDevName);
+    } else {
+        snprintf(params, sizeof(params), "%u %u:%u %u:%u", vol.hashType,
+                 major(dataSb.st_rdev), minor(dataSb.st_rdev), major(hashSb.st_rdev), minor(hashSb.st_rdev));
+    }
+    snprintf(params + strlen(params), sizeof(params) - strlen(params), " %u %u %llu %llu %s %s %s",
+             vol.dataBlockSize, vol.hashBlockSize, vol.dataBlocks, vol.hashStart, vol.algorithm, rootHash, vol.salt);
+    if (optCount > 0) {
+        snprintf(params + strlen(params), sizeof(params) - strlen(params), " %d%s", optCount, optParams);
+    }
 
-int losetupCommand(char * cmd, char * end) {
-    char * device;
-    char * file;
-    int fd;
-    struct loop_info loopInfo;
-    int dev;
+    if (testing) {
+        printf("verity-open '%s': verity 0 %llu %s\n", name, vol.dataBlocks * vol.dataBlockSize / 512, params);
+        return 0;
+    }
 
-    if (!(cmd = getArg(cmd, end, &device))) {
-        fprintf(stderr, "losetup: missing device\n");
+    snprintf(dmUuid, sizeof(dmUuid), "CRYPT-VERITY-%s-%s", vol.uuid, name);
+    if (_implDmCreate(cmd_name, name, dmUuid, "verity", vol.dataBlocks * vol.dataBlockSize / 512, params, true)) {
+        /* callee prints error message */
         return 1;
     }
 
-    if (!(cmd = getArg(cmd, end, &file))) {
-        fprintf(stderr, "losetup: missing file\n");
-        return 1;
+    if (prefetch) {
+        _implVerityPrefetch(name, &vol);
     }
 
-    if (cmd < end) {
-        fprintf(stderr, "losetup: unexpected arguments\n");
-        return 1;
+    return 0;
+}
+
+#define MD_ASSEMBLE_DEFAULT_TIMEOUT 10
+#define MD_MAX_MEMBERS 64
+/* members showing up together are not split by a quorum start, in ms */
+#define MD_QUORUM_SETTLE 250
+
+struct mdMember {
+    char devName[PATH_MAX];
+    dev_t dev;
+    bool active;
+    int number;
+    int role;
+};
+
+struct mdArrayInfo {
+    int raidDisks;
+    int minorVersion;
+    int level;
+    unsigned int layout;
+    bool bitmap;
+};
+
+/* find the v1.x superblock of device, returns the superblock minor version or -1 */
+static int _implMdReadSuperblock(const char * devName, unsigned char * sb, int sb_len) {
+    unsigned long long size;
+    long long offsets[3];
+    int minors[3] = { 1, 2, 0 };
+    int fd, i;
+
+    fd = open(devName, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ioctl(fd, BLKGETSIZE64, &size)) {
+        close(fd);
+        return -1;
     }
 
-    if (testing) {
-        printf("losetup '%s' '%s'\n", device, file);
-    } else {
-        dev = open(device, O_RDWR, 0);
-        if (dev < 0) {
-            fprintf(stderr, "losetup: failed to open %s: %d\n", device, errno);
-            return 1;
-        }
+    /* v1.1 at the start, v1.2 4KiB from the start, v1.0 8KiB from the end rounded down to 4KiB */
+    offsets[0] = 0;
+    offsets[1] = 4096;
+    offsets[2] = ((size >> 9) - 16) & ~7ULL;
+    offsets[2] <<= 9;
 
-        fd = open(file, O_RDWR, 0);
-        if (fd < 0) {
-            fprintf(stderr, "losetup: failed to open %s: %d\n", file, errno);
-            close(dev);
-            return 1;
-        }
+    for (i = 0; i < 3; i++) {
+        struct mdp_superblock_1 * sb1 = (struct mdp_superblock_1 *)sb;
 
-        if (ioctl(dev, LOOP_SET_FD, (long) fd)) {
-            fprintf(stderr, "losetup: LOOP_SET_FD failed: %d\n", errno);
-            close(dev);
+        if (pread(fd, sb, sb_len, offsets[i]) != sb_len)
+            continue;
+        if (le32toh(sb1->magic) == MD_SB_MAGIC && le32toh(sb1->major_version) == 1) {
             close(fd);
-            return 1;
+            return minors[i];
         }
+    }
 
-        close(fd);
+    close(fd);
+    return -1;
+}
 
-        memset(&loopInfo, 0, sizeof(loopInfo));
-        strcpy(loopInfo.lo_name, file);
+/* add the members of array uuid that showed up since the last call, returns the number of new members */
+static int _implMdScanMembers(const char * uuid, struct mdMember * members, int * pCount, struct mdArrayInfo * info) {
+    char devNames[MD_MAX_MEMBERS][64];
+    int candidates = 0;
+    int found = 0;
+    int i, j;
+
+    pthread_mutex_lock(&mycacheLock);
+    _implProbeScan();
+    for (j = 0; j < probeDeviceCount && candidates < MD_MAX_MEMBERS; j++) {
+        if (!strcmp(probeDevices[j].type, "linux_raid_member") && !strcasecmp(probeDevices[j].uuid, uuid))
+            strcpy(devNames[candidates++], probeDevices[j].devName);
+    }
+    pthread_mutex_unlock(&mycacheLock);
+
+    for (j = 0; j < candidates; j++) {
+        unsigned char sb[4096];
+        struct mdp_superblock_1 * sb1 = (struct mdp_superblock_1 *)sb;
+        const char * devName = devNames[j];
+        struct stat st;
+        int minorVersion;
+        unsigned int role;
+
+        for (i = 0; i < *pCount; i++) {
+            if (!strcmp(members[i].devName, devName))
+                break;
+        }
+        if (i < *pCount || *pCount == MD_MAX_MEMBERS)
+            continue;
 
-        if (ioctl(dev, LOOP_SET_STATUS, &loopInfo)) 
-            printf("losetup: LOOP_SET_STATUS failed: %d\n", errno);
+        if (stat(devName, &st) || !S_ISBLK(st.st_mode))
+            continue;
+        minorVersion = _implMdReadSuperblock(devName, sb, sizeof(sb));
+        if (minorVersion < 0)
+            continue;
 
-        close(dev);
+        /* spares and faulty members don't count towards a complete array */
+        role = 0xffff;
+        if (256 + 2 * (le32toh(sb1->dev_number) + 1) <= sizeof(sb))
+            role = le16toh(sb1->dev_roles[le32toh(sb1->dev_number)]);
+
+        snprintf(members[*pCount].devName, sizeof(members[*pCount].devName), "%s", devName);
+        members[*pCount].dev = st.st_rdev;
+        members[*pCount].active = (role < 0xfffe);
+        members[*pCount].number = le32toh(sb1->dev_number);
+        members[*pCount].role = role;
+        (*pCount)++;
+        info->raidDisks = le32toh(sb1->raid_disks);
+        info->minorVersion = minorVersion;
+        info->level = (int)le32toh(sb1->level);
+        info->layout = le32toh(sb1->layout);
+        info->bitmap = (le32toh(sb1->feature_map) & MD_FEATURE_BITMAP_OFFSET) != 0;
+        found++;
     }
 
-    return 0;
+    return found;
 }
 
-#define MAX_INIT_ARGS 32
-/* This is based on code from util-linux/sys-utils/run_init.c */
-int switchrootCommand(char * cmd, char * end) {
-    char * newroot;
-    const char * initprogs[] = { "/sbin/init", "/etc/init", "/bin/init", "/bin/sh", NULL };
-    const char * umounts[] = { "/dev", "/proc", "/sys", NULL };
-    struct stat newroot_stat;
-    char * init = NULL, * cmdline = NULL;
-    char ** initargs;
-    int fd, cfd, i;
-    struct statfs stfs;
+static int _implMdActiveCount(struct mdMember * members, int count) {
+    int active = 0, i;
 
-    if (!(cmd = getArg(cmd, end, &newroot))) {
-        fprintf(stderr, "switchroot: new root mount point expected\n");
-        return 1;
+    for (i = 0; i < count; i++) {
+        if (members[i].active)
+            active++;
     }
+    return active;
+}
 
-    if (cmd < end) {
-        if (!(cmd = getArg(cmd, end, &init))) {
-            fprintf(stderr, "switchroot: init program expected\n");
-            return 1;
+/* whether the active members present hold all the data, so the array can run degraded */
+static bool _implMdQuorum(struct mdArrayInfo * info, struct mdMember * members, int count) {
+    bool present[MD_MAX_MEMBERS];
+    int nearCopies, farCopies;
+    int active = 0, i, j;
+
+    if (info->raidDisks <= 0 || info->raidDisks > MD_MAX_MEMBERS) {
+        return false;
+    }
+
+    memset(present, 0, sizeof(present));
+    for (i = 0; i < count; i++) {
+        if (members[i].active && members[i].role < info->raidDisks && !present[members[i].role]) {
+            present[members[i].role] = true;
+            active++;
         }
+    }
 
-        if (cmd < end) {
-            cmdline = strndup(cmd, end - cmd);
+    switch (info->level) {
+    case 1:
+        return active >= 1;
+    case 4:
+    case 5:
+        return active >= info->raidDisks - 1;
+    case 6:
+        return active >= info->raidDisks - 2;
+    case 10:
+        /* near layouts keep the copies of a chunk on neighbouring roles, other layouts wait for everyone */
+        nearCopies = info->layout & 0xff;
+        farCopies = (info->layout >> 8) & 0xff;
+        if (farCopies != 1 || nearCopies < 1 || info->raidDisks % nearCopies) {
+            return active >= info->raidDisks;
         }
+        for (i = 0; i < info->raidDisks; i += nearCopies) {
+            for (j = 0; j < nearCopies && !present[i + j]; j++)
+                ;
+            if (j == nearCopies)
+                return false;
+        }
+        return true;
+    default:
+        return active >= info->raidDisks;
     }
+}
 
-    if (init == NULL) {
-        init = getKernelArg("init=");
-        if (init == NULL)
-            cmdline = getKernelCmdLine();
+/*
+ * hot-add the members that show up after a quorum start until the deadline,
+ * in a background process so the boot goes on. They are added back in their
+ * old role, the kernel resyncs them from the write-intent bitmap if there is
+ * one and completely otherwise.
+ */
+static void _implMdAddStragglers(const char * mdDev, const char * uuid, struct mdMember * members, int count,
+                                 struct mdArrayInfo * info, long long deadline) {
+    pid_t pid;
+    int ufd, fd, i;
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "md-assemble: fork failed: %d\n", errno);
+        return;
+    }
+    if (pid > 0) {
+        addBackground(pid);
+        return;
     }
 
-    if ((fd = open("/dev/console", O_RDWR)) < 0) {
-        fprintf(stderr, "switchroot: error opening /dev/console!!!!: %d\n", errno);
-        return 1;
+    fd = open(mdDev, O_RDWR);
+    if (fd < 0) {
+        _exit(1);
+    }
+    ufd = _implUeventOpen();
+    while (_implMdActiveCount(members, count) < info->raidDisks && monotonicMsec() < deadline) {
+        int first = count;
+
+        _implUeventWait(ufd, 100);
+        (void)_implMdScanMembers(uuid, members, &count, info);
+        for (i = first; i < count; i++) {
+            mdu_disk_info_t diskInfo;
+
+            if (!members[i].active)
+                continue;
+            memset(&diskInfo, 0, sizeof(diskInfo));
+            diskInfo.number = members[i].number;
+            diskInfo.major = major(members[i].dev);
+            diskInfo.minor = minor(members[i].dev);
+            diskInfo.raid_disk = members[i].role;
+            diskInfo.state = 1 << MD_DISK_SYNC;
+            if (ioctl(fd, ADD_NEW_DISK, &diskInfo)) {
+                fprintf(stderr, "md-assemble: failed to re-add %s to %s: %d\n", members[i].devName, mdDev, errno);
+            }
+        }
     }
+    _exit(0);
+}
 
-    if (dup2(fd, 0) != 0) {
-        fprintf(stderr, "switchroot: error dup2'ing fd of %d to 0\n", fd);
+int mdAssembleCommand(char * cmd, char * end) {
+    char * usage = "usage: md-assemble <mddev> <dev-tag> [degraded-timeout]";
+    char * mdDev;
+    char * uuidArg;
+    char * timeoutStr = NULL;
+    const char * token;
+    const char * value;
+    struct mdMember * members;
+    int count = 0;
+    struct mdArrayInfo info = { 0, 0, 0, 0, false };
+    int timeout = MD_ASSEMBLE_DEFAULT_TIMEOUT;
+    long long deadline, lastNew;
+    unsigned int mdMinor;
+    mdu_array_info_t arrayInfo;
+    int active, i;
+    int ufd, fd;
+
+    if (!(cmd = getArg(cmd, end, &mdDev))) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
     }
-    if (dup2(fd, 1) != 1) {
-        fprintf(stderr, "switchroot: error dup2'ing fd of %d to 1\n", fd);
+    if (!(cmd = getArg(cmd, end, &uuidArg))) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
     }
-    if (dup2(fd, 2) != 2) {
-        fprintf(stderr, "switchroot: error dup2'ing fd of %d to 2\n", fd);
+    if (cmd < end) {
+        if (!(cmd = getArg(cmd, end, &timeoutStr))) {
+            fprintf(stderr, "%s\n", usage);
+            return 1;
+        }
+        timeout = atoi(timeoutStr);
     }
-    if (fd > 2) {
-        close(fd);
+    if (cmd < end) {
+        fprintf(stderr, "md-assemble: unexpected arguments\n");
+        return 1;
     }
 
-    cfd = open("/", O_RDONLY);
-    if (cfd < 0) {
-        fprintf(stderr, "switchroot: cannot open /\n");
+    if (sscanf(mdDev, "/dev/md%u", &mdMinor) != 1) {
+        fprintf(stderr, "md-assemble: %s is not of the form /dev/mdN\n", mdDev);
         return 1;
     }
-
-    if (fstatfs(cfd, &stfs) != 0) {
-        fprintf(stderr, "switchroot: stat failed /\n");
+    token = parseDevTag(uuidArg, &value);
+    if (token == NULL || strcmp(token, "UUID")) {
+        fprintf(stderr, "md-assemble: array must be specified as UUID=xxx\n");
         return 1;
     }
 
-    if (stfs.f_type != (__SWORD_TYPE)STATFS_RAMFS_MAGIC && stfs.f_type != (__SWORD_TYPE)STATFS_TMPFS_MAGIC) {
-        fprintf(stderr, "switchroot: old root filesystem is not an initramfs");
-        return 1;
+    if (testing) {
+        printf("md-assemble '%s' from members with %s (degraded after %d seconds)\n", mdDev, uuidArg, timeout);
+        return 0;
     }
 
-    if (stat(newroot, &newroot_stat) != 0) {
-        fprintf(stderr, "switchroot: stat failed %s\n", newroot);
+    members = arenaAlloc(&lineArena, sizeof(struct mdMember) * MD_MAX_MEMBERS);
+    memset(members, 0, sizeof(struct mdMember) * MD_MAX_MEMBERS);
+
+    /*
+     * pick members up as they appear, start as soon as every active member
+     * is there, or, if a bitmap keeps the resync of stragglers short, as
+     * soon as a quorum is there and no more members came in for a moment,
+     * the stragglers are added while the array runs
+     */
+    ufd = _implUeventOpen();
+    deadline = monotonicMsec() + (long long)timeout * 1000;
+    lastNew = monotonicMsec();
+    while (1) {
+        if (_implMdScanMembers(value, members, &count, &info) > 0)
+            lastNew = monotonicMsec();
+        active = _implMdActiveCount(members, count);
+        if (info.raidDisks > 0 && active >= info.raidDisks)
+            break;
+        if (info.bitmap && _implMdQuorum(&info, members, count) && monotonicMsec() - lastNew >= MD_QUORUM_SETTLE)
+            break;
+        if (monotonicMsec() >= deadline)
+            break;
+        _implUeventWait(ufd, 100);
+    }
+    if (ufd >= 0)
+        close(ufd);
+
+    if (count == 0) {
+        fprintf(stderr, "md-assemble: no member of %s found\n", uuidArg);
         return 1;
     }
+    if (active < info.raidDisks) {
+        fprintf(stderr, "md-assemble: only %d of %d members of %s present, starting degraded\n", active, info.raidDisks, mdDev);
+    }
 
-    for (i = 0; umounts[i] != NULL; i++) {
-        char newmount[PATH_MAX];
-        struct stat sb;
+    if (mknod(mdDev, S_IFBLK | 0600, makedev(MD_MAJOR, mdMinor)) && errno != EEXIST) {
+        fprintf(stderr, "md-assemble: failed to create %s: %d\n", mdDev, errno);
+        return 1;
+    }
+    fd = open(mdDev, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "md-assemble: failed to open %s: %d\n", mdDev, errno);
+        return 1;
+    }
 
-        snprintf(newmount, sizeof(newmount), "%s%s", newroot, umounts[i]);
+    /* with a v1 superblock version and no geometry the kernel reads the rest from the member superblocks */
+    memset(&arrayInfo, 0, sizeof(arrayInfo));
+    arrayInfo.major_version = 1;
+    arrayInfo.minor_version = info.minorVersion;
+    if (ioctl(fd, SET_ARRAY_INFO, &arrayInfo)) {
+        fprintf(stderr, "md-assemble: SET_ARRAY_INFO on %s failed: %d\n", mdDev, errno);
+        goto fail;
+    }
 
-        if (stat(newmount, &sb) != 0) {
-            fprintf(stderr, "switchroot: stat failed %s\n", newmount);
-            return 1;
-        }
+    for (i = 0; i < count; i++) {
+        mdu_disk_info_t diskInfo;
 
-        if (sb.st_dev != newroot_stat.st_dev) {
-            /* mount point seems to be mounted already */
-            umount2(umounts[i], MNT_DETACH);
-            continue;
+        memset(&diskInfo, 0, sizeof(diskInfo));
+        diskInfo.major = major(members[i].dev);
+        diskInfo.minor = minor(members[i].dev);
+        if (ioctl(fd, ADD_NEW_DISK, &diskInfo)) {
+            fprintf(stderr, "md-assemble: failed to add %s to %s: %d\n", members[i].devName, mdDev, errno);
         }
+    }
 
-        if (mount(umounts[i], newmount, NULL, MS_MOVE, NULL) < 0) {
-            fprintf(stderr, "switchroot: failed to mount moving %s to %s\n", umounts[i], newmount);
-            return 1;
-        }
+    if (ioctl(fd, RUN_ARRAY, 0UL)) {
+        fprintf(stderr, "md-assemble: failed to start %s: %d\n", mdDev, errno);
+        goto fail;
     }
+    close(fd);
 
-    if (chdir(newroot)) {
-        fprintf(stderr, "switchroot: chdir(%s) failed: %d\n", newroot, errno);
-        return 1;
+    if (active < info.raidDisks && monotonicMsec() < deadline) {
+        _implMdAddStragglers(mdDev, value, members, count, &info, deadline);
     }
 
-    if (mount(".", "/", NULL, MS_MOVE, NULL) < 0) {
-        fprintf(stderr, "switchroot: mount failed: %d\n", errno);
+    return 0;
+
+fail:
+    (void)ioctl(fd, STOP_ARRAY, 0UL);
+    close(fd);
+    return 1;
+}
+
+#define RESUME_DEFAULT_TIMEOUT 10
+
+bool resumeArmed = false;
+
+static int _implWriteFile(char * cmd_name, const char * path, const char * value) {
+    int fd;
+
+    fd = open(path, O_WRONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to open %s: %d\n", cmd_name, path, errno);
         return 1;
     }
 
-    if (chroot(".") || chdir("/")) {
-        fprintf(stderr, "switchroot: chroot() failed: %d\n", errno);
+    if (write(fd, value, strlen(value)) != strlen(value)) {
+        fprintf(stderr, "%s: failed to write %s: %d\n", cmd_name, path, errno);
+        close(fd);
         return 1;
     }
 
-    recursiveRemove(cfd);
-    close(cfd);
+    close(fd);
+    return 0;
+}
+
+/* hand the image location to the kernel, this function does not return if there is an image to resume from */
+static int _implResume(char * device, char * offset, int timeout) {
+    char devNum[32];
+    unsigned int major, minor;
+    const char * token;
+    const char * value;
 
-    if (init == NULL) {
-        for (i = 0; initprogs[i] != NULL; i++) {
-            if (!access(initprogs[i], X_OK)) {
-                init = strdup(initprogs[i]);
-                break;
+    if (sscanf(device, "%u:%u", &major, &minor) == 2) {
+        snprintf(devNum, sizeof(devNum), "%u:%u", major, minor);
+    } else {
+        char * devName = device;
+        struct stat sb;
+
+        if (!testing && waitForDevTimeout(device, timeout)) {
+            fprintf(stderr, "resume: device %s did not show up in %d seconds, booting normally\n", device, timeout);
+            return 0;
+        }
+
+        token = parseDevTag(device, &value);
+        if (token != NULL && !testing) {
+            char * tagDevName = evaluateTag(token, value);
+            if (tagDevName == NULL) {
+                fprintf(stderr, "resume: failed to get device specified by %s\n", device);
+                return 1;
             }
+            devName = arenaStrdup(&lineArena, tagDevName);
+            free(tagDevName);
         }
-    }
 
-    i = 0;
-    initargs = (char **)malloc(sizeof(char *)*(MAX_INIT_ARGS+1));
-    if (cmdline && init) {
-        initargs[i++] = strdup(init);
-    } else {
-        cmdline = init;
-        initargs[0] = NULL;
+        if (testing) {
+            snprintf(devNum, sizeof(devNum), "(%s)", device);
+        } else if (stat(devName, &sb) || !S_ISBLK(sb.st_mode)) {
+            fprintf(stderr, "resume: %s is not a block device\n", devName);
+            return 1;
+        } else {
+            snprintf(devNum, sizeof(devNum), "%u:%u", major(sb.st_rdev), minor(sb.st_rdev));
+        }
     }
 
-    if (cmdline != NULL) {
-        char * chptr, * start;
+    if (testing) {
+        printf("resume %s%s%s\n", devNum, offset ? " offset " : "", offset ? offset : "");
+        return 0;
+    }
 
-        start = chptr = cmdline;
-        for (; (i < MAX_INIT_ARGS) && (*start != '\0'); i++) {
-            while (*chptr && !isspace(*chptr)) chptr++;
-            if (*chptr != '\0') *(chptr++) = '\0';
-            initargs[i] = strdup(start);
-            start = chptr;
+    /* the offset must be set first, writing the device triggers the resume */
+    if (offset != NULL) {
+        if (_implWriteFile("resume", "/sys/power/resume_offset", offset)) {
+            /* callee prints error message */
+            return 1;
         }
     }
 
-    initargs[i] = NULL;
-
-    if (access(initargs[0], X_OK)) {
-        printf("WARNING: can't access %s\n", initargs[0]);
+    if (_implWriteFile("resume", "/sys/power/resume", devNum)) {
+        /* callee prints error message */
+        return 1;
     }
 
-    execv(initargs[0], initargs);
-    fprintf(stderr, "exec of init (%s) failed!!!: %d\n", initargs[0], errno);
-    return 1;
+    /* still here, no hibernation image */
+    return 0;
 }
 
-int isEchoQuiet(int fd) {
-    if (!quiet) return 0;
-    if (fd != 1) return 0;
-    return 1;
-}
+/* resume with the device given by resume= and resume_offset= on the kernel command line */
+int resumeFromKernelArgs(void) {
+    char * device;
+    int timeout = RESUME_DEFAULT_TIMEOUT;
 
-int echoCommand(char * cmd, char * end) {
-    char * args[256];
-    char ** nextArg = args;
-    int outFd = 1;
-    int num = 0;
-    int i;
-    int newline = 1;
-    int length = 0;
-    char *string;
+    resumeArmed = false;
 
-    if (testing && !quiet) {
-        printf("(echo) ");
-        fflush(stdout);
+    device = getKernelArgValue("resume=");
+    if (device == NULL || *device == '\0') {
+        return 0;
+    }
+    if (hasKernelArg("resumewait")) {
+        timeout = -1;
     }
 
-    while ((cmd = getArg(cmd, end, nextArg))) {
-        if (!strncmp("-n", *nextArg, MAX(2, strlen(*nextArg)))) {
-            newline = 0;
-        } else {
-            length += strlen(*nextArg);
-            nextArg++, num++;
+    return _implResume(device, getKernelArgValue("resume_offset="), timeout);
+}
+
+int resumeCommand(char * cmd, char * end) {
+    char * device = NULL;
+    char * offset = NULL;
+    char * timeoutStr = NULL;
+    int timeout = RESUME_DEFAULT_TIMEOUT;
+
+    if (cmd < end) {
+        cmd = getArg(cmd, end, &device);
+        if (cmd && cmd < end) {
+            cmd = getArg(cmd, end, &offset);
+        }
+        if (cmd && cmd < end) {
+            cmd = getArg(cmd, end, &timeoutStr);
+        }
+        if (!cmd) {
+            fprintf(stderr, "usage: resume [device [offset [timeout]]]\n");
+            return 1;
+        }
+        if (cmd < end) {
+            fprintf(stderr, "resume: unexpected arguments\n");
+            return 1;
         }
     }
-    length += num + 1;
 
-    if ((nextArg - args >= 2) && !strcmp(*(nextArg - 2), ">")) {
-        outFd = open(*(nextArg - 1), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (outFd < 0) {
-            fprintf(stderr, "echo: cannot open %s for write: %d\n", 
-                *(nextArg - 1), errno);
-            return 1;
+    if (device == NULL) {
+        if (testing) {
+            printf("resume (from kernel command line)\n");
+            resumeArmed = false;
+            return 0;
         }
+        return resumeFromKernelArgs();
+    }
 
-        newline = 0;
-        num -= 2;
+    resumeArmed = false;
+    if (timeoutStr != NULL) {
+        timeout = atoi(timeoutStr);
     }
-    string = (char *)malloc(length * sizeof(char));
-    *string = '\0';
-    for (i = 0; i < num;i ++) {
-        if (i) strcat(string, " ");
-        strncat(string, args[i], strlen(args[i]));
+    if (offset != NULL && !strcmp(offset, "-")) {
+        offset = NULL;
     }
 
-    if (newline) strcat(string, "\n");
-    if (!isEchoQuiet(outFd)) write(outFd, string, strlen(string));
-
-    if (outFd != 1) close(outFd);
-    free(string);
-
-    return 0;
+    return _implResume(device, offset, timeout);
 }
 
-int umountCommand(char * cmd, char * end) {
-    char * path;
+int findlodevCommand(char * cmd, char * end) {
+    char devName[20];
+    int devNum;
+    int fd;
+    struct loop_info loopInfo;
+    char separator[2] = "";
 
-    if (!(cmd = getArg(cmd, end, &path))) {
-        fprintf(stderr, "umount: path expected\n");
+    if (*end != '\n') {
+        fprintf(stderr, "usage: findlodev\n");
         return 1;
     }
 
-    if (cmd < end) {
-        fprintf(stderr, "umount: unexpected arguments\n");
-        return 1;
+    if (!access("/dev/.devfsd", X_OK)) {
+        strcpy(separator, "/");
     }
 
-    if (umount(path)) {
-        fprintf(stderr, "umount %s failed: %d\n", path, errno);
-        return 1;
+    for (devNum = 0; devNum < 256; devNum++) {
+        sprintf(devName, "/dev/loop%s%d", separator, devNum);
+        if ((fd = open(devName, O_RDONLY)) < 0) return 0;
+
+        if (ioctl(fd, LOOP_GET_STATUS, &loopInfo)) {
+            close(fd);
+            printf("%s\n", devName);
+            return 0;
+        }
+
+        close(fd);
     }
 
     return 0;
 }
 
-int mkdirCommand(char * cmd, char * end) {
-    char * dir;
-    int ignoreExists = 0;
+/*
+ * Failure policy of a script line: how often and for how long it is retried
+ * and what happens when it still fails. Retries wait for the next uevent, at
+ * most the current backoff, which doubles after every attempt.
+ */
+#define POLICY_ONFAIL_CONTINUE  0
+#define POLICY_ONFAIL_ABORT     1
+#define POLICY_ONFAIL_SHELL     2
+#define POLICY_MAX_BACKOFF      5000
+
+struct linePolicy {
+    int retries;            /* retries after the first attempt, -1 means until the deadline */
+    int backoff;            /* first wait between attempts in ms */
+    int deadline;           /* seconds for all attempts together, -1 for none */
+    int onFail;
+};
 
-    cmd = getArg(cmd, end, &dir);
+static struct linePolicy defaultPolicy = { 0, 100, -1, POLICY_ONFAIL_CONTINUE };
 
-    if (cmd && !strcmp(dir, "-p")) {
-        ignoreExists = 1;
-        cmd = getArg(cmd, end, &dir);
-    }
+/* parse comma separated retry=,backoff=,deadline=,onfail= options */
+static int _implParsePolicy(const char * cmd_name, char * opts, char * end, struct linePolicy * policy) {
+    bool hasRetries = false;
 
-    if (!cmd) {
-        fprintf(stderr, "mkdir: directory expected\n");
-        return 1;
-    }
+    while (opts < end) {
+        char * opt = opts;
+        char * optEnd = opt;
 
-    if (mkdir(dir, 0755)) {
-        if (!ignoreExists && errno == EEXIST) {
-            fprintf(stderr, "mkdir: failed to create %s: %d\n", dir, errno);
+        while (optEnd < end && *optEnd != ',') optEnd++;
+        opts = optEnd + 1;
+        if (optEnd == opt)
+            continue;
+
+        if (!strncmp(opt, "retry=", 6) && optEnd > opt + 6) {
+            policy->retries = atoi(opt + 6);
+            hasRetries = true;
+        } else if (!strncmp(opt, "backoff=", 8) && optEnd > opt + 8) {
+            policy->backoff = MAX(atoi(opt + 8), 1);
+        } else if (!strncmp(opt, "deadline=", 9) && optEnd > opt + 9) {
+            policy->deadline = atoi(opt + 9);
+        } else if (optEnd - opt == 15 && !strncmp(opt, "onfail=continue", 15)) {
+            policy->onFail = POLICY_ONFAIL_CONTINUE;
+        } else if (optEnd - opt == 12 && !strncmp(opt, "onfail=abort", 12)) {
+            policy->onFail = POLICY_ONFAIL_ABORT;
+        } else if (optEnd - opt == 12 && !strncmp(opt, "onfail=shell", 12)) {
+            policy->onFail = POLICY_ONFAIL_SHELL;
+        } else {
+            fprintf(stderr, "%s: unknown policy option %.*s\n", cmd_name, (int)(optEnd - opt), opt);
             return 1;
         }
     }
 
+    /* a deadline alone means retrying until it passes */
+    if (!hasRetries && policy->deadline >= 0 && policy->retries == 0)
+        policy->retries = -1;
     return 0;
 }
 
-int accessCommand(char * cmd, char * end) {
-    char * permStr;
-    int perms = 0;
-    char * file = NULL;
-
-    cmd = getArg(cmd, end, &permStr);
-    if (cmd) cmd = getArg(cmd, end, &file);
+static void _implRunShell(void) {
+    char * argv[] = { "/bin/sh", NULL };
+    int status;
+    pid_t pid;
 
-    if (!cmd || *permStr != '-') {
-        fprintf(stderr, "usage: access -[perm] file\n");
-        return 1;
+    if (testing) {
+        printf("run shell, %s\n", argv[0]);
+        return;
     }
-
-    permStr++;
-    while (*permStr) {
-        switch (*permStr) {
-            case 'r': perms |= R_OK; break;
-            case 'w': perms |= W_OK; break;
-            case 'x': perms |= X_OK; break;
-            case 'f': perms |= F_OK; break;
-            default:
-                fprintf(stderr, "perms must be -[r][w][x][f]\n");
-                return 1;
-        }
-
-        permStr++;
+    logFlush();
+    pid = fork();
+    if (pid == 0) {
+        execve(argv[0], argv, env);
+        fprintf(stderr, "init: failed in exec of %s\n", argv[0]);
+        _exit(1);
+    }
+    if (pid > 0) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
     }
+}
 
-    if ((file == NULL) || (access(file, perms))) {
+int policyCommand(char * cmd, char * end) {
+    struct linePolicy policy = { 0, 100, -1, POLICY_ONFAIL_CONTINUE };
+    char * opts;
+
+    if (cmd >= end) {
+        fprintf(stderr, "usage: policy [retry=n] [backoff=ms] [deadline=seconds] [onfail=continue|abort|shell]\n");
         return 1;
     }
+    while ((cmd = getArg(cmd, end, &opts))) {
+        if (_implParsePolicy("policy", opts, opts + strlen(opts), &policy)) {
+            /* callee prints error message */
+            return 1;
+        }
+    }
 
+    defaultPolicy = policy;
     return 0;
 }
 
-int sleepCommand(char * cmd, char * end) {
-    char *delaystr;
-    int delay;
+#define NBD_DEFAULT_PORT 10809
+#define NBD_MAX_CONNECTIONS 16
+#define NBD_DEFAULT_TIMEOUT 30
+
+/* fixed newstyle negotiation, see the NBD protocol document */
+#define NBD_INIT_MAGIC 0x4e42444d41474943ULL        /* NBDMAGIC */
+#define NBD_OPT_MAGIC 0x49484156454f5054ULL         /* IHAVEOPT */
+#define NBD_REP_MAGIC 0x0003e889045565a9ULL
+#define NBD_HS_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_HS_FLAG_NO_ZEROES (1 << 1)
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_GO 7
+#define NBD_REP_ACK 1
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_BLOCK_SIZE 3
+
+struct nbdExport {
+    unsigned long long size;
+    unsigned short flags;
+    unsigned int blockSize;         /* preferred by the server, 0 if it did not say */
+};
 
-    if (!(cmd = getArg(cmd, end, &delaystr))) {
-        fprintf(stderr, "sleep: delay expected\n");
-        return 1;
+static int _implNbdRead(int fd, void * buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = ECONNRESET;
+        if (n <= 0)
+            return 1;
+        buf = (char *)buf + n;
+        len -= n;
     }
+    return 0;
+}
 
-    delay = atoi(delaystr);
-    (void)sleep(delay);
+static int _implNbdWrite(int fd, const void * buf, size_t len) {
+    ssize_t n;
 
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        buf = (const char *)buf + n;
+        len -= n;
+    }
     return 0;
 }
 
-int readlinkCommand(char * cmd, char * end) {
-    char * path;
-    char * buf, * respath, * fullpath;
-    struct stat sb;
-    int rc = 0;
+static int _implNbdSendOption(int fd, unsigned int opt, const unsigned char * data, unsigned int len) {
+    unsigned char hdr[16];
 
-    if (!(cmd = getArg(cmd, end, &path))) {
-        fprintf(stderr, "readlink: file expected\n");
+    *(uint64_t *)hdr = htobe64(NBD_OPT_MAGIC);
+    *(uint32_t *)(hdr + 8) = htobe32(opt);
+    *(uint32_t *)(hdr + 12) = htobe32(len);
+    return _implNbdWrite(fd, hdr, sizeof(hdr)) || _implNbdWrite(fd, data, len);
+}
+
+static int _implNbdHandshake(char * cmd_name, int fd, const char * exportName, struct nbdExport * exp) {
+    unsigned char buf[1024];
+    unsigned int nameLen = strlen(exportName);
+    unsigned short hsFlags;
+    bool gotExport = false;
+
+    if (nameLen > sizeof(buf) - 8) {
+        fprintf(stderr, "%s: export name too long\n", cmd_name);
         return 1;
     }
 
-    if (lstat(path, &sb) == -1) {
-        fprintf(stderr, "unable to stat %s: %d\n", path, errno);
+    if (_implNbdRead(fd, buf, 18))
+        goto closed;
+    hsFlags = be16toh(*(uint16_t *)(buf + 16));
+    if (be64toh(*(uint64_t *)buf) != NBD_INIT_MAGIC || be64toh(*(uint64_t *)(buf + 8)) != NBD_OPT_MAGIC ||
+        !(hsFlags & NBD_HS_FLAG_FIXED_NEWSTYLE)) {
+        fprintf(stderr, "%s: server does not speak the fixed newstyle protocol\n", cmd_name);
         return 1;
     }
+    *(uint32_t *)buf = htobe32(NBD_HS_FLAG_FIXED_NEWSTYLE | (hsFlags & NBD_HS_FLAG_NO_ZEROES));
+    if (_implNbdWrite(fd, buf, 4))
+        goto closed;
+
+    /* NBD_OPT_GO, asking for the block size constraints too */
+    *(uint32_t *)buf = htobe32(nameLen);
+    memcpy(buf + 4, exportName, nameLen);
+    *(uint16_t *)(buf + 4 + nameLen) = htobe16(1);
+    *(uint16_t *)(buf + 6 + nameLen) = htobe16(NBD_INFO_BLOCK_SIZE);
+    if (_implNbdSendOption(fd, NBD_OPT_GO, buf, nameLen + 8))
+        goto closed;
+
+    memset(exp, 0, sizeof(*exp));
+    while (1) {
+        unsigned int type, len;
+
+        if (_implNbdRead(fd, buf, 20))
+            goto closed;
+        if (be64toh(*(uint64_t *)buf) != NBD_REP_MAGIC) {
+            fprintf(stderr, "%s: bad option reply from server\n", cmd_name);
+            return 1;
+        }
+        type = be32toh(*(uint32_t *)(buf + 12));
+        len = be32toh(*(uint32_t *)(buf + 16));
+        if (len > sizeof(buf) - 1) {
+            fprintf(stderr, "%s: option reply too long\n", cmd_name);
+            return 1;
+        }
+        if (_implNbdRead(fd, buf, len))
+            goto closed;
 
-    if (!S_ISLNK(sb.st_mode)) {
-        printf("%s\n", path);
-        return 0;
-    }
-    
-    buf = malloc(512);
-    if (readlink(path, buf, 512) == -1) {
-        fprintf(stderr, "error readlink %s: %d\n", path, errno);
-        free(buf);
-        return 1;
+        if (type == NBD_REP_ACK) {
+            if (!gotExport) {
+                fprintf(stderr, "%s: server did not describe export %s\n", cmd_name, exportName);
+                return 1;
+            }
+            return 0;
+        } else if (type == NBD_REP_INFO && len >= 12 && be16toh(*(uint16_t *)buf) == NBD_INFO_EXPORT) {
+            exp->size = be64toh(*(uint64_t *)(buf + 2));
+            exp->flags = be16toh(*(uint16_t *)(buf + 10));
+            gotExport = true;
+        } else if (type == NBD_REP_INFO && len >= 14 && be16toh(*(uint16_t *)buf) == NBD_INFO_BLOCK_SIZE) {
+            exp->blockSize = be32toh(*(uint32_t *)(buf + 6));
+        } else if (type == NBD_REP_ERR_UNSUP) {
+            break;
+        } else if (type & 0x80000000) {
+            buf[len] = '\0';
+            fprintf(stderr, "%s: server refused export %s: %s\n", cmd_name, exportName, buf);
+            return 1;
+        }
     }
 
-    /* symlink is absolute */
-    if (buf[0] == '/') {
-        printf("%s\n", buf);
-        free(buf);
-        return 0;
-    } 
-   
-    /* nope, need to handle the relative symlink case too */
-    respath = strrchr(path, '/');
-    if (respath) {
-        *respath = '\0';
+    /* old servers only know NBD_OPT_EXPORT_NAME, which ends the negotiation */
+    if (_implNbdSendOption(fd, NBD_OPT_EXPORT_NAME, (const unsigned char *)exportName, nameLen) ||
+        _implNbdRead(fd, buf, (hsFlags & NBD_HS_FLAG_NO_ZEROES) ? 10 : 134))
+        goto closed;
+    exp->size = be64toh(*(uint64_t *)buf);
+    exp->flags = be16toh(*(uint16_t *)(buf + 8));
+    return 0;
+
+closed:
+    /* SO_RCVTIMEO and SO_SNDTIMEO turn a stalled server into EAGAIN */
+    fprintf(stderr, "%s: %s during the handshake\n", cmd_name,
+            (errno == EAGAIN || errno == EWOULDBLOCK) ? "server timed out" : "connection lost");
+    return 1;
+}
+
+/* bounds every read and write on the socket, 0 turns that off again before the kernel gets it */
+static void _implNbdSetTimeout(int fd, int timeout) {
+    struct timeval tv = { timeout, 0 };
+
+    (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * host is an address literal, an IPv6 one may be given in brackets. The
+ * connect and the handshake after it give up after timeout seconds, so an
+ * unreachable server fails the line in time for its policy to retry.
+ */
+static int _implNbdConnectSocket(char * cmd_name, const char * host, int port, int timeout) {
+    struct sockaddr_in6 sin6;
+    struct sockaddr_in sin;
+    struct sockaddr * sa;
+    socklen_t saLen;
+    char addr[INET6_ADDRSTRLEN + 2];
+    struct pollfd pfd;
+    socklen_t errLen = sizeof(int);
+    int one = 1;
+    int fd, err, rc;
+
+    snprintf(addr, sizeof(addr), "%s", host[0] == '[' ? host + 1 : host);
+    if (host[0] == '[' && strchr(addr, ']') != NULL)
+        *strchr(addr, ']') = '\0';
+
+    memset(&sin, 0, sizeof(sin));
+    memset(&sin6, 0, sizeof(sin6));
+    if (inet_pton(AF_INET, addr, &sin.sin_addr) == 1) {
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sa = (struct sockaddr *)&sin;
+        saLen = sizeof(sin);
+    } else if (inet_pton(AF_INET6, addr, &sin6.sin6_addr) == 1) {
+        sin6.sin6_family = AF_INET6;
+        sin6.sin6_port = htons(port);
+        sa = (struct sockaddr *)&sin6;
+        saLen = sizeof(sin6);
+    } else {
+        fprintf(stderr, "%s: %s is not an IP address\n", cmd_name, host);
+        return -1;
     }
 
-    fullpath = malloc(512);
-    /* and normalize it */
-    snprintf(fullpath, 512, "%s/%s", path, buf);
-    respath = malloc(PATH_MAX);
-    if (!(respath = realpath(fullpath, respath))) {
-        fprintf(stderr, "error realpath %s: %d\n", fullpath, errno);
-        rc = 1;
-        goto readlinkout;
+    fd = socket(sa->sa_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, IPPROTO_TCP);
+    if (fd < 0) {
+        fprintf(stderr, "%s: failed to create socket: %d\n", cmd_name, errno);
+        return -1;
+    }
+    err = connect(fd, sa, saLen) ? errno : 0;
+    if (err == EINPROGRESS) {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        do {
+            rc = poll(&pfd, 1, timeout * 1000);
+        } while (rc < 0 && errno == EINTR);
+        if (rc == 0)
+            err = ETIMEDOUT;
+        else if (rc < 0)
+            err = errno;
+        else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen))
+            err = errno;
+    }
+    if (err) {
+        fprintf(stderr, "%s: failed to connect to %s port %d: %d\n", cmd_name, host, port, err);
+        close(fd);
+        return -1;
     }
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    _implNbdSetTimeout(fd, timeout);
+    return fd;
+}
 
-    printf("%s\n", respath);
-readlinkout:
-    free(buf);
-    free(respath);
-    free(fullpath);
-    return rc;
+static struct nlattr * _implNlAttrPut(unsigned char * msg, int * len, int type, const void * data, int dataLen) {
+    struct nlattr * nla = (struct nlattr *)(msg + *len);
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + dataLen;
+    if (dataLen > 0)
+        memcpy(msg + *len + NLA_HDRLEN, data, dataLen);
+    *len += NLA_ALIGN(nla->nla_len);
+    return nla;
 }
 
-int lvmLvActivateCommand(char * cmd, char * end) {
-    char * dev_tag;
-    char * vg_name;
-    char * lv_name;
+/* send a generic netlink request and wait for its answer, the reply is left in msg */
+static int _implGenlTalk(int nlfd, unsigned char * msg, int len, int msgSize, int flags) {
+    struct nlmsghdr * nlh = (struct nlmsghdr *)msg;
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    int n;
+
+    nlh->nlmsg_len = len;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    if (sendto(nlfd, msg, len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) != len)
+        return -errno;
+
+    /* either the data reply or the ack, an error takes the place of both */
+    n = recv(nlfd, msg, msgSize, 0);
+    if (n < (int)NLMSG_HDRLEN)
+        return -EIO;
+    if (nlh->nlmsg_type == NLMSG_ERROR)
+        return ((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+    return 0;
+}
 
-    if (!(cmd = getArg(cmd, end, &dev_tag))) {
-        fprintf(stderr, "lvm-lv-activate: missing dev-tag\n");
+static int _implNbdNetlinkConnect(char * cmd_name, int index, struct nbdExport * exp, unsigned long long blockSize,
+                                  unsigned long long timeout, int * fds, int count) {
+    unsigned char msg[4096];
+    struct nlmsghdr * nlh = (struct nlmsghdr *)msg;
+    struct genlmsghdr * genl = (struct genlmsghdr *)(msg + NLMSG_HDRLEN);
+    struct nlattr * nla, * sockets, * item;
+    unsigned long long serverFlags = exp->flags;
+    unsigned long long size = exp->size;
+    unsigned int idx = index;
+    unsigned short family = 0;
+    int nlfd, len, rc, i;
+
+    nlfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (nlfd < 0) {
+        fprintf(stderr, "%s: failed to open generic netlink: %d\n", cmd_name, errno);
         return 1;
     }
-    if (parseDevTag(dev_tag, NULL) == NULL) {
-        fprintf(stderr, "lvm-lv-activate: invalid dev-tag\n");
+
+    /* look up the id of the nbd family */
+    memset(msg, 0, sizeof(msg));
+    nlh->nlmsg_type = GENL_ID_CTRL;
+    genl->cmd = CTRL_CMD_GETFAMILY;
+    genl->version = 1;
+    len = NLMSG_HDRLEN + GENL_HDRLEN;
+    _implNlAttrPut(msg, &len, CTRL_ATTR_FAMILY_NAME, NBD_GENL_FAMILY_NAME, sizeof(NBD_GENL_FAMILY_NAME));
+    rc = _implGenlTalk(nlfd, msg, len, sizeof(msg), 0);
+    if (rc == 0) {
+        len = NLMSG_HDRLEN + GENL_HDRLEN;
+        while (len + NLA_HDRLEN <= (int)nlh->nlmsg_len) {
+            nla = (struct nlattr *)(msg + len);
+            if (nla->nla_len < NLA_HDRLEN)
+                break;
+            if (nla->nla_type == CTRL_ATTR_FAMILY_ID)
+                family = *(unsigned short *)((unsigned char *)nla + NLA_HDRLEN);
+            len += NLA_ALIGN(nla->nla_len);
+        }
+    }
+    if (family == 0) {
+        fprintf(stderr, "%s: no nbd netlink family, is the nbd module loaded?\n", cmd_name);
+        close(nlfd);
         return 1;
     }
 
-    if (!(cmd = getArg(cmd, end, &vg_name))) {
-        fprintf(stderr, "lvm-lv-activate: missing vgname\n");
-        return 1;
+    memset(msg, 0, sizeof(msg));
+    nlh->nlmsg_type = family;
+    genl->cmd = NBD_CMD_CONNECT;
+    genl->version = NBD_GENL_VERSION;
+    len = NLMSG_HDRLEN + GENL_HDRLEN;
+    _implNlAttrPut(msg, &len, NBD_ATTR_INDEX, &idx, sizeof(idx));
+    _implNlAttrPut(msg, &len, NBD_ATTR_SIZE_BYTES, &size, sizeof(size));
+    _implNlAttrPut(msg, &len, NBD_ATTR_BLOCK_SIZE_BYTES, &blockSize, sizeof(blockSize));
+    _implNlAttrPut(msg, &len, NBD_ATTR_TIMEOUT, &timeout, sizeof(timeout));
+    _implNlAttrPut(msg, &len, NBD_ATTR_SERVER_FLAGS, &serverFlags, sizeof(serverFlags));
+    sockets = _implNlAttrPut(msg, &len, NBD_ATTR_SOCKETS | NLA_F_NESTED, NULL, 0);
+    for (i = 0; i < count; i++) {
+        unsigned int fd = fds[i];
+
+        item = _implNlAttrPut(msg, &len, NBD_SOCK_ITEM | NLA_F_NESTED, NULL, 0);
+        _implNlAttrPut(msg, &len, NBD_SOCK_FD, &fd, sizeof(fd));
+        item->nla_len = msg + len - (unsigned char *)item;
     }
+    sockets->nla_len = msg + len - (unsigned char *)sockets;
 
-    if (!(cmd = getArg(cmd, end, &lv_name))) {
-        fprintf(stderr, "lvm-lv-activate: missing lvname\n");
+    rc = _implGenlTalk(nlfd, msg, len, sizeof(msg), NLM_F_ACK);
+    close(nlfd);
+    if (rc) {
+        fprintf(stderr, "%s: NBD_CMD_CONNECT for /dev/nbd%d failed: %d\n", cmd_name, index, -rc);
         return 1;
     }
+    return 0;
+}
 
-    if (cmd < end) {
-        fprintf(stderr, "lvm-lv-activate: unexpected arguments\n");
+int nbdConnectCommand(char * cmd, char * end) {
+    char * usage = "usage: nbd-connect <opts> <nbddev> <host[:port]> <export>";
+    char * cmd_name = "nbd-connect";
+    char * options, * nbdDev, * hostArg, * exportName;
+    char host[INET6_ADDRSTRLEN + 2];
+    char path[PATH_MAX];
+    char buf[64];
+    struct nbdExport exp, other;
+    unsigned long long blockSize = 0, timeout = NBD_DEFAULT_TIMEOUT;
+    int connections = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), 4);
+    int fds[NBD_MAX_CONNECTIONS];
+    int count = 0;
+    int port = NBD_DEFAULT_PORT;
+    int index, ufd, i, handshakeTimeout;
+    long long deadline;
+    char * p;
+
+    if (!(cmd = getArg(cmd, end, &options)) || !(cmd = getArg(cmd, end, &nbdDev)) ||
+        !(cmd = getArg(cmd, end, &hostArg)) || !(cmd = getArg(cmd, end, &exportName))) {
+        fprintf(stderr, "%s\n", usage);
         return 1;
     }
-
-    if (runBinary2("/sbin/lvm", "vgchange", "-ay") != 0) {
-        /* callee prints error message */
+    if (cmd < end) {
+        fprintf(stderr, "nbd-connect: unexpected arguments\n");
         return 1;
     }
 
-    waitForDev(dev_tag);
-
-    return 0;
-}
-
-int bcacheActivateCacheDeviceCommand(char * cmd, char *end) {
-    char * bcacheRegisterFile;
-    char * device;
-    const char * token;
-    const char * value;
+    if (strcmp(options, "-")) {
+        char * opt;
 
-    if (!quiet) {
-        bcacheRegisterFile = "/sys/fs/bcache/register";
-    } else {
-        bcacheRegisterFile = "/sys/fs/bcache/register_quiet";
+        for (opt = strtok(options, ","); opt != NULL; opt = strtok(NULL, ",")) {
+            if (!strncmp(opt, "connections=", strlen("connections="))) {
+                connections = atoi(opt + strlen("connections="));
+            } else if (!strncmp(opt, "block_size=", strlen("block_size="))) {
+                blockSize = strtoull(opt + strlen("block_size="), NULL, 10);
+            } else if (!strncmp(opt, "timeout=", strlen("timeout="))) {
+                timeout = strtoull(opt + strlen("timeout="), NULL, 10);
+            } else {
+                fprintf(stderr, "nbd-connect: unknown option %s\n", opt);
+                return 1;
+            }
+        }
     }
-
-    if (!(cmd = getArg(cmd, end, &device))) {
-        fprintf(stderr, "bcache-cache-device-activate: missing device\n");
+    if (connections < 1 || connections > NBD_MAX_CONNECTIONS) {
+        fprintf(stderr, "nbd-connect: connections must be between 1 and %d\n", NBD_MAX_CONNECTIONS);
+        return 1;
+    }
+    if (blockSize != 0 && (blockSize < 512 || blockSize > 4096 || (blockSize & (blockSize - 1)))) {
+        fprintf(stderr, "nbd-connect: block_size must be a power of 2 between 512 and 4096\n");
         return 1;
     }
 
-    if (cmd < end) {
-        fprintf(stderr, "bcache-cache-device-activate: unexpected arguments\n");
+    if (strncmp(nbdDev, "/dev/nbd", strlen("/dev/nbd")) || !isdigit(nbdDev[strlen("/dev/nbd")])) {
+        fprintf(stderr, "nbd-connect: %s is not an nbd device\n", nbdDev);
         return 1;
     }
+    index = atoi(nbdDev + strlen("/dev/nbd"));
+
+    /* the port follows the last colon, unless that is part of a bare IPv6 address */
+    snprintf(host, sizeof(host), "%s", hostArg);
+    p = strrchr(host, ':');
+    if (p != NULL && (host[0] == '[' ? p > strchr(host, ']') : strchr(host, ':') == p)) {
+        *p = '\0';
+        port = atoi(p + 1);
+    }
 
-    token = parseDevTag(device, &value);
-    if (token != NULL) {
-        char * devName = blkid_evaluate_tag(token, value, &mycache);
-        if (devName == NULL) {
-            fprintf(stderr, "bcache-cache-device-activate: failed to get device %s\n", device);
-            return 1;
-        }
-        device = devName;
+    if (testing) {
+        printf("nbd-connect %s port %d export %s as %s, up to %d connections\n", host, port, exportName, nbdDev, connections);
+        return 0;
     }
 
-    if (!testing) {
-        int fd = open(bcacheRegisterFile, O_WRONLY, 0);
-        if (fd < 0) {
-            fprintf(stderr, "bcache-cache-device-activate: failed to open %s: %d\n", bcacheRegisterFile, errno);
-            return 1;
+    handshakeTimeout = (timeout > 0 && timeout < NBD_DEFAULT_TIMEOUT) ? (int)timeout : NBD_DEFAULT_TIMEOUT;
+
+    fds[0] = _implNbdConnectSocket(cmd_name, host, port, handshakeTimeout);
+    if (fds[0] < 0)
+        return 1;
+    count = 1;
+    if (_implNbdHandshake(cmd_name, fds[0], exportName, &exp))
+        goto fail;
+
+    /* more connections only if the server keeps them coherent */
+    if (!(exp.flags & NBD_FLAG_CAN_MULTI_CONN))
+        connections = 1;
+    while (count < connections) {
+        fds[count] = _implNbdConnectSocket(cmd_name, host, port, handshakeTimeout);
+        if (fds[count] < 0)
+            goto fail;
+        count++;
+        if (_implNbdHandshake(cmd_name, fds[count - 1], exportName, &other))
+            goto fail;
+        if (other.size != exp.size) {
+            fprintf(stderr, "nbd-connect: export %s changed size between connections\n", exportName);
+            goto fail;
         }
+    }
 
-        if (write(fd, device, strlen(device)) != strlen(device)) {
-            fprintf(stderr, "bcache-cache-device-activate: failed to write %s: %d\n", bcacheRegisterFile, errno);
-            close(fd);
+    /* the server's preference, else the largest block size that does not cut off the end of the export */
+    if (blockSize == 0 && exp.blockSize >= 512 && exp.blockSize <= 4096)
+        blockSize = exp.blockSize;
+    if (blockSize == 0)
+        blockSize = (exp.size % 4096) ? 512 : 4096;
+
+    /* the kernel has its own timeout, one on the socket would break idle connections */
+    for (i = 0; i < count; i++)
+        _implNbdSetTimeout(fds[i], 0);
+
+    if (_implNbdNetlinkConnect(cmd_name, index, &exp, blockSize, timeout, fds, count))
+        goto fail;
+
+    /* the kernel holds the sockets now */
+    for (i = 0; i < count; i++)
+        close(fds[i]);
+
+    logMsg(LOG_INFO, "nbd", "%s: %llu bytes from %s, %d connection(s), block size %llu",
+           nbdDev, exp.size, hostArg, count, blockSize);
+
+    /* the device is only usable by tag once it has its size */
+    ufd = _implUeventOpen();
+    deadline = monotonicMsec() + 5000;
+    snprintf(path, sizeof(path), "/sys/block/nbd%d/size", index);
+    while (_implProbeReadSysfs(path, buf, sizeof(buf)) || strtoull(buf, NULL, 10) == 0) {
+        if (monotonicMsec() >= deadline) {
+            fprintf(stderr, "nbd-connect: %s did not come up\n", nbdDev);
+            if (ufd >= 0)
+                close(ufd);
             return 1;
         }
-
-        close(fd);
+        _implUeventWait(ufd, 100);
     }
-
+    if (ufd >= 0)
+        close(ufd);
     return 0;
+
+fail:
+    for (i = 0; i < count; i++)
+        close(fds[i]);
+    return 1;
 }
 
-int bcacheActivateBackingDeviceCommand(char * cmd, char *end) {
-    char * bcacheRegisterFile;
-    char * dev_tag;
-    char * device;
-    const char * token;
-    const char * value;
+#define COMMAND_COMPARE(cmd, start, next) \
+    (sizeof((cmd)) - 1 == (next) - (start) && strncmp((cmd), (start), (next) - (start)) == 0)
 
-    if (!quiet) {
-        bcacheRegisterFile = "/sys/fs/bcache/register";
-    } else {
-        bcacheRegisterFile = "/sys/fs/bcache/register_quiet";
-    }
+/* run one attempt of a script line, chptr points after the command name */
+static int runCommand(char * start, char * chptr, char * end) {
+    int rc;
 
-    if (!(cmd = getArg(cmd, end, &dev_tag))) {
-        fprintf(stderr, "bcache-backing-device-activate: missing dev-tag\n");
-        return 1;
+    if (COMMAND_COMPARE("insmod", start, chptr)) {
+        rc = insmodCommand(chptr, end);
     }
-
-    if (!(cmd = getArg(cmd, end, &device))) {
-        fprintf(stderr, "bcache-backing-device-activate: missing device\n");
-        return 1;
+    else if (COMMAND_COMPARE("coldplug", start, chptr)) {
+        rc = coldplugCommand(chptr, end);
     }
-
-    if (cmd < end) {
-        fprintf(stderr, "bcache-backing-device-activate: unexpected arguments\n");
-        return 1;
+    else if (COMMAND_COMPARE("mount", start, chptr)) {
+        rc = mountCommand(chptr, end);
     }
-
-    if (parseDevTag(dev_tag, NULL) == NULL) {
-        fprintf(stderr, "bcache-backing-device-activate: invalid dev-tag\n");
-        return 1;
+    else if (COMMAND_COMPARE("mount-btrfs", start, chptr)) {
+        rc = mountBtrfsCommand(chptr, end);
     }
-
-    token = parseDevTag(device, &value);
-    if (token != NULL) {
-        char * devName = blkid_evaluate_tag(token, value, &mycache);
-        if (devName == NULL) {
-            fprintf(stderr, "bcache-backing-device-activate: failed to get device %s\n", device);
-            return 1;
-        }
-        device = devName;
+    else if (COMMAND_COMPARE("mount-bcachefs", start, chptr)) {
+        rc = mountBcachefsCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("policy", start, chptr)) {
+        rc = policyCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("devmap-load", start, chptr)) {
+        rc = devmapLoadCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("devmap-save", start, chptr)) {
+        rc = devmapSaveCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("blk-tune", start, chptr)) {
+        rc = blkTuneCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("fsck-all", start, chptr)) {
+        rc = fsckAllCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("mount-table", start, chptr)) {
+        rc = mountTableCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("losetup", start, chptr)) {
+        rc = losetupCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("echo", start, chptr)) {
+        rc = echoCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("switchroot", start, chptr)) {
+        rc = switchrootCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("defer", start, chptr)) {
+        rc = deferCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("umount", start, chptr)) {
+        rc = umountCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("mkdir", start, chptr)) {
+        rc = mkdirCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("access", start, chptr)) {
+        rc = accessCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("luks-open", start, chptr)) {
+        rc = luksOpenCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("verity-open", start, chptr)) {
+        rc = verityOpenCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("md-assemble", start, chptr)) {
+        rc = mdAssembleCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("nbd-connect", start, chptr)) {
+        rc = nbdConnectCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("bcachefs-unlock", start, chptr)) {
+        rc = bcachefsUnlockCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("resume", start, chptr)) {
+        rc = resumeCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("findlodev", start, chptr)) {
+        rc = findlodevCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("sleep", start, chptr)) {
+        rc = sleepCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("readlink", start, chptr)) {
+        rc = readlinkCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("lvm-lv-activate", start, chptr)) {
+        rc = lvmLvActivateCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("bcache-cache-device-activate", start, chptr)) {
+        rc = bcacheActivateCacheDeviceCommand(chptr, end);
+    }
+    else if (COMMAND_COMPARE("bcache-backing-device-activate", start, chptr)) {
+        rc = bcacheActivateBackingDeviceCommand(chptr, end);
+    }
+    else {
+        *chptr = '\0';
+        rc = otherCommand(start, chptr + 1, end, 1);
     }
 
-    if (!testing) {
-        int fd = open(bcacheRegisterFile, O_WRONLY, 0);
-        if (fd < 0) {
-            fprintf(stderr, "bcache-backing-device-activate: failed to open %s: %d\n", bcacheRegisterFile, errno);
-            return 1;
-        }
+    return rc;
+}
 
-        if (write(fd, device, strlen(device)) != strlen(device)) {
-            fprintf(stderr, "bcache-backing-device-activate: failed to write %s: %d\n", bcacheRegisterFile, errno);
-            close(fd);
-            return 1;
-        }
+/* run a script line under policy, each attempt gets a fresh copy since arguments are parsed in place */
+static int runLine(char * start, char * end, struct linePolicy * policy) {
+    long long deadline = (policy->deadline >= 0) ? monotonicMsec() + (long long)policy->deadline * 1000 : -1;
+    int backoff = policy->backoff;
+    struct arenaMark mark = arenaGetMark(&lineArena);
+    int ueventFd = -1;
+    int attempt, rc;
+
+    for (attempt = 0; ; attempt++) {
+        char * line;
+        char * lineEnd;
+        char * chptr;
+        long long now;
+        int wait;
+
+        /* whatever the failed attempt allocated goes, retrying until a deadline must not grow the arena */
+        arenaRestore(&lineArena, mark);
+        line = arenaStrndup(&lineArena, start, end - start + 1);
+        lineEnd = line + (end - start);
+        chptr = line;
+
+        /* builtins write to stdout/stderr directly, what was logged for this line has to be out first */
+        logFlush();
+        while (chptr < lineEnd && !isspace(*chptr)) chptr++;
+        rc = runCommand(line, chptr, lineEnd);
+        if (rc == 0 || (policy->retries >= 0 && attempt >= policy->retries))
+            break;
+        now = monotonicMsec();
+        if (deadline >= 0 && now >= deadline)
+            break;
 
-        close(fd);
+        /* the socket stays open across attempts, events that arrive while a retry runs are not lost */
+        if (ueventFd < 0)
+            ueventFd = _implUeventOpen();
+        wait = (deadline >= 0) ? (int)MIN((long long)backoff, deadline - now) : backoff;
+        logMsg(LOG_INFO, "startup", "(attempt %d failed, retrying within %d ms)", attempt + 1, wait);
+        _implUeventWait(ueventFd, wait);
+        backoff = MIN(backoff * 2, POLICY_MAX_BACKOFF);
     }
 
-    waitForDev(dev_tag);
-
-    return 0;
+    if (ueventFd >= 0)
+        close(ueventFd);
+    return rc;
 }
 
-int findlodevCommand(char * cmd, char * end) {
-    char devName[20];
-    int devNum;
-    int fd;
-    struct loop_info loopInfo;
-    char separator[2] = "";
+/* body of the deferred worker, runs the deferred lines in the old root and then removes it */
+static void _implRunDeferred(int oldRootFd, int logFd) {
+    int failed = 0;
+    int i;
 
-    if (*end != '\n') {
-        fprintf(stderr, "usage: findlodev\n");
-        return 1;
+    (void)setsid();
+    if (logFd >= 0) {
+        dup2(logFd, 1);
+        dup2(logFd, 2);
     }
 
-    if (!access("/dev/.devfsd", X_OK)) {
-        strcpy(separator, "/");
+    /* switchroot moved these into the new root, which is the cwd still; the deferred lines need them back */
+    for (i = 0; deferredMounts[i] != NULL; i++) {
+        if (mount(deferredMounts[i] + 1, deferredMounts[i], NULL, MS_BIND | MS_REC, NULL))
+            printf("failed to bind %s into the old root: %d\n", deferredMounts[i], errno);
+    }
+    if (chdir("/")) {
+        _exit(1);
     }
 
-    for (devNum = 0; devNum < 256; devNum++) {
-        sprintf(devName, "/dev/loop%s%d", separator, devNum);
-        if ((fd = open(devName, O_RDONLY)) < 0) return 0;
-
-        if (ioctl(fd, LOOP_GET_STATUS, &loopInfo)) {
-            close(fd);
-            printf("%s\n", devName);
-            return 0;
+    for (i = 0; i < deferredCount; i++) {
+        struct linePolicy policy = defaultPolicy;
+        char * start = deferredLines[i];
+        char * end = start + strlen(start) - 1;
+        char * chptr;
+        long long lineStart = monotonicMsec();
+        int rc;
+
+        if (*start == '@') {
+            chptr = start + 1;
+            while (chptr < end && !isspace(*chptr)) chptr++;
+            if (_implParsePolicy("defer", start + 1, chptr, &policy)) {
+                printf("failed: %.*s\n", (int)(end - deferredLines[i]), deferredLines[i]);
+                failed++;
+                continue;
+            }
+            start = chptr;
+            while (start < end && isspace(*start)) start++;
         }
 
-        close(fd);
+        rc = runLine(start, end, &policy);
+        arenaReset(&lineArena);
+        printf("%s: %.*s (%lld ms)\n", rc ? "failed" : "ok", (int)(end - deferredLines[i]), deferredLines[i], monotonicMsec() - lineStart);
+        fflush(stdout);
+        if (rc) {
+            logMsg(LOG_ERR, "defer", "'%.*s' failed", (int)(end - deferredLines[i]), deferredLines[i]);
+            failed++;
+        }
     }
 
-    return 0;
+    printf("done: %d of %d deferred lines failed\n", failed, deferredCount);
+    fflush(stdout);
+    for (i = 0; deferredMounts[i] != NULL; i++)
+        umount2(deferredMounts[i], MNT_DETACH);
+    recursiveRemove(oldRootFd);
+    _exit(failed ? 1 : 0);
 }
 
-#define COMMAND_COMPARE(cmd, start, next) \
-    (sizeof((cmd)) - 1 == (next) - (start) && strncmp((cmd), (start), (next) - (start)) == 0)
-
 int runStartup() {
     int fd;
     char contents[32768];
     int i;
     char * start, * end;
     char * chptr;
-    int rc;
+    long long lineStart;
+    struct linePolicy policy;
+    bool badPolicy;
+    int rc = 0;
 
     fd = open(STARTUPRC, O_RDONLY, 0);
     if (fd < 0) {
@@ -1633,9 +6992,7 @@ int runStartup() {
         }
 
         if (!*start) {
-            if (!quiet) {
-                printf("<init> (last line in %s is empty)\n", STARTUPRC);
-            }
+            logMsg(LOG_INFO, "startup", "(last line in %s is empty)", STARTUPRC);
             continue;
         }
 
@@ -1643,78 +7000,72 @@ int runStartup() {
         end = start + 1;
         while (*end && (*end != '\n')) end++;
         if (!*end) {
-            if (!quiet) {
-                printf("<init> (last line in %s missing \\n -- skipping)\n", STARTUPRC);
-            }
+            logMsg(LOG_INFO, "startup", "(last line in %s missing \\n -- skipping)", STARTUPRC);
             start = end;
             continue;
         }
 
-        /* end points to the \n at the end of the command */
+        /* print command */
+        logMsg(LOG_INFO, "startup", "%.*s", (int)(end - start), start);
+
+        /* end points to the \n at the end of the command, a leading @opt,... overrides the policy */
+        policy = defaultPolicy;
+        badPolicy = false;
+        if (*start == '@') {
+            chptr = start + 1;
+            while (chptr < end && !isspace(*chptr)) chptr++;
+            if (_implParsePolicy("startup", start + 1, chptr, &policy)) {
+                /* the line fails as a whole, under the default policy */
+                policy = defaultPolicy;
+                badPolicy = true;
+            } else {
+                start = chptr;
+                while (start < end && isspace(*start)) start++;
+            }
+        }
         chptr = start;
         while (chptr < end && !isspace(*chptr)) chptr++;
-
-        /* print command */
-        if (!quiet) {
-            printf("<init> %.*s\n", (int)(end - start), start);
+        lineStart = monotonicMsec();
+
+        /*
+         * the hibernation image must be resumed before anything writes to a
+         * filesystem, mounting (journal replay) and fsck included; assembling
+         * md, bcache, LVM or dm-crypt is not, the resume device may sit on them
+         */
+        if (!badPolicy && resumeArmed &&
+            (COMMAND_COMPARE("mount", start, chptr) ||
+             COMMAND_COMPARE("mount-btrfs", start, chptr) ||
+             COMMAND_COMPARE("mount-bcachefs", start, chptr) ||
+             COMMAND_COMPARE("mount-table", start, chptr) ||
+             COMMAND_COMPARE("fsck-all", start, chptr) ||
+             COMMAND_COMPARE("switchroot", start, chptr))) {
+            (void)resumeFromKernelArgs();
         }
 
-        /* execute command */
-        if (COMMAND_COMPARE("insmod", start, chptr)) {
-            rc = insmodCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("mount", start, chptr)) {
-            rc = mountCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("mount-btrfs", start, chptr)) {
-            rc = mountBtrfsCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("mount-bcachefs", start, chptr)) {
-            rc = mountBcachefsCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("losetup", start, chptr)) {
-            rc = losetupCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("echo", start, chptr)) {
-            rc = echoCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("switchroot", start, chptr)) {
-            rc = switchrootCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("umount", start, chptr)) {
-            rc = umountCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("mkdir", start, chptr)) {
-            rc = mkdirCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("access", start, chptr)) {
-            rc = accessCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("findlodev", start, chptr)) {
-            rc = findlodevCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("sleep", start, chptr)) {
-            rc = sleepCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("readlink", start, chptr)) {
-            rc = readlinkCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("bcache-cache-device-activate", start, chptr)) {
-            rc = bcacheActivateCacheDeviceCommand(chptr, end);
-        }
-        else if (COMMAND_COMPARE("bcache-backing-device-activate", start, chptr)) {
-            rc = bcacheActivateBackingDeviceCommand(chptr, end);
-        }
-        else {
-            *chptr = '\0';
-            rc = otherCommand(start, chptr + 1, end, 1);
+        rc = badPolicy ? 1 : runLine(start, end, &policy);
+        linesRun++;
+
+        logMsg(LOG_DEBUG, "startup", "'%.*s' returned %d after %lld ms", (int)(end - start), start, rc, monotonicMsec() - lineStart);
+        if (sandbox) {
+            logFlush();
+            printf("<sandbox> %6lld ms %s %.*s\n", monotonicMsec() - lineStart, rc ? "failed" : "ok    ", (int)(end - start), start);
+            fflush(stdout);
         }
 
-        /* give user a chance to inspect errors, it won't affect the normal procedure since no error should occur */
         if (rc) {
-            (void)sleep(10);
+            linesFailed++;
+            logMsg(LOG_ERR, "startup", "'%.*s' failed", (int)(end - start), start);
+            if (policy.onFail == POLICY_ONFAIL_ABORT) {
+                logMsg(LOG_ERR, "startup", "(aborting %s)", STARTUPRC);
+                break;
+            } else if (policy.onFail == POLICY_ONFAIL_SHELL) {
+                logMsg(LOG_ERR, "startup", "(starting a shell, exit it to continue)");
+                _implRunShell();
+            }
         }
 
+        reapBackground();
+        arenaReset(&lineArena);
         start = end + 1;
     }
 
@@ -1722,10 +7073,99 @@ int runStartup() {
     return rc;
 }
 
+/*
+ * Moves into new mount and pid namespaces and forks the process that plays
+ * pid 1 there. Returns -1 in that process, the exit code of the script in
+ * the parent.
+ */
+static int _implSandboxEnter(int ** mountIds, int * mountIdCount) {
+    FILE * f;
+    char line[4096];
+    int status;
+    int max = 256;
+    pid_t pid;
+
+    if (syscall(__NR_unshare, CLONE_NEWNS | CLONE_NEWPID)) {
+        fprintf(stderr, "init: failed to create the sandbox namespaces: %d\n", errno);
+        return 1;
+    }
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL)) {
+        fprintf(stderr, "init: failed to make the sandbox mounts private: %d\n", errno);
+        return 1;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "init: failed to start the sandbox: %d\n", errno);
+        return 1;
+    }
+    if (pid > 0) {
+        if (waitpid(pid, &status, 0) < 0) {
+            return 1;
+        }
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    }
+
+    /* the proc of the parent namespace would show the wrong pids */
+    if (mount("proc", "/proc", "proc", MS_NOSUID | MS_NOEXEC | MS_NODEV, NULL)) {
+        fprintf(stderr, "init: error %d mounting %s as %s\n", errno, "/proc", "proc");
+        _exit(1);
+    }
+
+    /* remember what was mounted before, only what the script adds is reported */
+    *mountIds = arenaAlloc(&globalArena, sizeof(int) * max);
+    *mountIdCount = 0;
+    f = fopen("/proc/self/mountinfo", "r");
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        if (*mountIdCount == max) {
+            int * more = arenaAlloc(&globalArena, sizeof(int) * max * 2);
+
+            memcpy(more, *mountIds, sizeof(int) * max);
+            *mountIds = more;
+            max *= 2;
+        }
+        (*mountIds)[(*mountIdCount)++] = atoi(line);
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    return -1;
+}
+
+static void _implSandboxReport(int * mountIds, int mountIdCount) {
+    FILE * f;
+    char line[4096];
+    int id, i;
+
+    logFlush();
+    f = fopen("/proc/self/mountinfo", "r");
+    if (f == NULL) {
+        fprintf(stderr, "init: failed to open /proc/self/mountinfo: %d\n", errno);
+        return;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        id = atoi(line);
+        for (i = 0; i < mountIdCount; i++) {
+            if (mountIds[i] == id) {
+                break;
+            }
+        }
+        if (i == mountIdCount) {
+            printf("<sandbox> %s", line);
+        }
+    }
+    fclose(f);
+    fflush(stdout);
+}
+
 int main(int argc, char **argv) {
     char * name;
     int rc;
     int force = 0;
+    int * mountIds = NULL;
+    int mountIdCount = 0;
 
     name = strrchr(argv[0], '/');
     if (!name) 
@@ -1733,6 +7173,7 @@ int main(int argc, char **argv) {
     else
         name++;
 
+    initStartBoottime = boottimeMsec();
     testing = (getppid() != 0) && (getppid() != 1);
 
     if (testing) {
@@ -1745,6 +7186,9 @@ int main(int argc, char **argv) {
             } else if (!strcmp(*argv, "--quiet")) {
                 quiet = 1;
                 argv++, argc--;
+            } else if (!strcmp(*argv, "--sandbox")) {
+                sandbox = 1;
+                argv++, argc--;
             } else {
                 fprintf(stderr, "unknown argument %s\n", *argv);
                 return 1;
@@ -1752,7 +7196,16 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (!testing) {
+    /* the sandbox runs for real, but keeps the /sys, /proc and /dev it finds */
+    if (sandbox) {
+        testing = 0;
+        rc = _implSandboxEnter(&mountIds, &mountIdCount);
+        if (rc >= 0) {
+            return rc;
+        }
+    }
+
+    if (!testing && !sandbox) {
         if (mount("sysfs", "/sys", "sysfs", MS_NOSUID|MS_NOEXEC|MS_NODEV, NULL)) {
             fprintf(stderr, "init: error %d mounting %s as %s\n", errno, "/sys", "sysfs");
             return 1;
@@ -1767,30 +7220,44 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (!testing) {
+    if (!testing && !sandbox) {
         if (hasKernelArg("quiet")) {
             quiet = 1;
         }
+        if (getKernelArg("resume=") != NULL && !hasKernelArg("noresume")) {
+            resumeArmed = true;
+        }
     }
 
-    if (!quiet) {
-        printf("<init> fpemud-os init program version %s starting)\n", VERSION);
+    logInit();
+
+    logMsg(LOG_INFO, "init", "fpemud-os init program version %s starting)", VERSION);
+
+    if (force) {
+        logMsg(LOG_INFO, "init", "(forcing normal run)");
     }
 
-    if (force && !quiet) {
-        printf("<init> (forcing normal run)\n");
+    if (testing) {
+        logMsg(LOG_INFO, "init", "(running in test mode).");
     }
 
-    if (testing && !quiet) {
-        printf("<init> (running in test mode).\n");
+    if (sandbox) {
+        logMsg(LOG_INFO, "init", "(running in a sandbox).");
     }
 
+#ifndef WITHOUT_BLKID
     if (blkid_get_cache(&mycache, NULL) < 0) {
         fprintf(stderr, "init: error get blkid cache\n");
         return 1;
     }
+#endif
 
     rc = runStartup();
 
+    if (sandbox) {
+        _implSandboxReport(mountIds, mountIdCount);
+    }
+
+    logFlush();
     return rc;
 }
@@ -0,0 +1,18 @@
+/*
+ * poweroff.c
+ *
+ * The init of the test root filesystems of qemu-boot-test.sh. It tells the
+ * serial console that the new root was reached and powers the machine off.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/reboot.h>
+
+int main(int argc, char **argv) {
+    printf("minitrd-test: new root reached\n");
+    fflush(stdout);
+    sync();
+    reboot(RB_POWER_OFF);
+    return 1;
+}
@@ -0,0 +1,332 @@
+#!/bin/bash
+
+# qemu-boot-test.sh
+#
+# Boot-latency regression suite for minitrd. A kernel (linux/vanilla, as
+# built by bbki) is booted in QEMU with TCG, so no KVM is needed, with a
+# minitrd initramfs against disk images holding the root filesystem in
+# different layouts. For every scenario the time from kernel start to
+# switchroot and the peak memory of init are taken from the statistics init
+# logs at switchroot, and compared with the stored baseline.
+#
+# usage: qemu-boot-test.sh --init file --kernel file [--modules dir]
+#                          [--lvm file] [--runs n] [--update-baseline]
+#                          [scenario...]
+#
+#   --init             the static init to test (make init-static)
+#   --kernel           the kernel image
+#   --modules          lib/modules/<release> of the kernel, the drivers it
+#                      does not have built in are loaded from there
+#   --lvm              a static lvm binary, /sbin/lvm.static by default
+#   --runs             boots per scenario, the median time and the largest
+#                      memory use are kept (3 by default)
+#   --update-baseline  store the results as the new baseline
+#
+# The scenarios are ext4, btrfs-multi (raid1 over two disks), bcachefs, lvm
+# and bcache (a backing and a cache disk), all of them by default. The kernel
+# needs devtmpfs, the 8250 serial console, virtio-pci, virtio-blk and the
+# filesystems, device-mapper and bcache drivers of the scenarios, built in or
+# as modules. The images are made on loop devices with mkfs.ext4,
+# mkfs.btrfs, bcachefs, lvm and make-bcache, so this runs as root; a scenario
+# whose tools are missing is skipped.
+#
+# A result is a regression if the switchroot time is more than
+# TIME_TOLERANCE percent (20 by default, TCG is noisy) or the memory use
+# more than RSS_TOLERANCE percent (10 by default) above the baseline. The
+# exit code is 1 if a boot failed or regressed.
+
+TESTDIR=$(cd "$(dirname "$0")" && pwd)
+BASELINE="${TESTDIR}/qemu-boot-baseline"
+QEMU="${QEMU:-qemu-system-x86_64}"
+QEMU_TIMEOUT="${QEMU_TIMEOUT:-600}"
+TIME_TOLERANCE="${TIME_TOLERANCE:-20}"
+RSS_TOLERANCE="${RSS_TOLERANCE:-10}"
+ALL_SCENARIOS="ext4 btrfs-multi bcachefs lvm bcache"
+
+# every image carries the root filesystem under this label
+ROOT_LABEL=minitrd-root
+VG_NAME=minitrdtest
+
+die() {
+	echo "qemu-boot-test: $*" >&2
+	exit 1
+}
+
+INIT=
+KERNEL=
+MODULES=
+LVM=/sbin/lvm.static
+RUNS=3
+UPDATE=0
+SCENARIOS=
+
+while [ $# -gt 0 ] ; do
+	case "$1" in
+		--init) INIT="$2" ; shift 2 ;;
+		--kernel) KERNEL="$2" ; shift 2 ;;
+		--modules) MODULES="$2" ; shift 2 ;;
+		--lvm) LVM="$2" ; shift 2 ;;
+		--runs) RUNS="$2" ; shift 2 ;;
+		--update-baseline) UPDATE=1 ; shift ;;
+		-*) die "unknown option $1" ;;
+		*) SCENARIOS="${SCENARIOS} $1" ; shift ;;
+	esac
+done
+SCENARIOS="${SCENARIOS:-${ALL_SCENARIOS}}"
+
+[ -n "${INIT}" ] && [ -x "${INIT}" ] || die "--init must name the static init to test"
+[ -n "${KERNEL}" ] && [ -f "${KERNEL}" ] || die "--kernel must name a kernel image"
+[ -z "${MODULES}" ] || [ -f "${MODULES}/modules.dep" ] || die "${MODULES} has no modules.dep"
+[ "$(id -u)" -eq 0 ] || die "must run as root, the images are made on loop devices"
+command -v "${QEMU}" > /dev/null || die "${QEMU} not found"
+command -v cpio > /dev/null || die "cpio not found"
+
+# the scenarios run in their own directories
+INIT=$(realpath "${INIT}")
+KERNEL=$(realpath "${KERNEL}")
+[ -z "${MODULES}" ] || MODULES=$(realpath "${MODULES}")
+[ ! -e "${LVM}" ] || LVM=$(realpath "${LVM}")
+
+WORKDIR=$(mktemp -d)
+
+cleanup() {
+	local img
+
+	cd /
+	umount "${WORKDIR}/mnt" 2> /dev/null
+	[ -n "$(lvm vgs --noheadings -o vg_name ${VG_NAME} 2> /dev/null)" ] && lvm vgchange -q -an ${VG_NAME} > /dev/null
+	for img in "${WORKDIR}"/*/*.img ; do
+		losetup -j "${img}" 2> /dev/null | cut -d: -f1 | xargs -r -n1 losetup -d
+	done
+	rm -rf "${WORKDIR}"
+}
+trap cleanup EXIT
+
+# the root filesystem every scenario boots into, its init powers off
+mkdir -p "${WORKDIR}"/rootfs/{sbin,dev,proc,sys,run} "${WORKDIR}/mnt"
+${CC:-cc} -static -Os -o "${WORKDIR}/rootfs/sbin/init" "${TESTDIR}/poweroff.c" || die "failed to build poweroff.c"
+
+populate() {
+	mount "$1" "${WORKDIR}/mnt" || return 1
+	cp -a "${WORKDIR}/rootfs/." "${WORKDIR}/mnt" || { umount "${WORKDIR}/mnt" ; return 1 ; }
+	umount "${WORKDIR}/mnt"
+}
+
+# Each scenario has a _tools function listing what it needs on the host, a
+# _prepare function making its images in the current directory and printing
+# them in drive order, a _modules function listing the modules it loads and a
+# _rc function printing its startup.rc lines after those.
+
+ext4_tools() { echo mkfs.ext4 ; }
+ext4_modules() { echo ext4 ; }
+ext4_prepare() {
+	truncate -s 64M root.img
+	mkfs.ext4 -q -L ${ROOT_LABEL} -d "${WORKDIR}/rootfs" root.img || return 1
+	echo root.img
+}
+ext4_rc() {
+	echo "@deadline=30 mount -o ro -t ext4 LABEL=${ROOT_LABEL} /sysroot"
+}
+
+btrfs_multi_tools() { echo mkfs.btrfs ; }
+btrfs_multi_modules() { echo btrfs ; }
+btrfs_multi_prepare() {
+	local l1 l2
+
+	truncate -s 256M disk1.img disk2.img
+	l1=$(losetup -f --show disk1.img) && l2=$(losetup -f --show disk2.img) || return 1
+	mkfs.btrfs -q -f -L ${ROOT_LABEL} -d raid1 -m raid1 ${l1} ${l2} > /dev/null || return 1
+	populate ${l1} || return 1
+	losetup -d ${l1} ${l2}
+	echo disk1.img disk2.img
+}
+btrfs_multi_rc() {
+	echo "mount-btrfs /sysroot ro LABEL=${ROOT_LABEL}"
+}
+
+bcachefs_tools() { echo bcachefs ; }
+bcachefs_modules() { echo bcachefs ; }
+bcachefs_prepare() {
+	local l
+
+	truncate -s 256M root.img
+	bcachefs format -L ${ROOT_LABEL} root.img > /dev/null || return 1
+	l=$(losetup -f --show root.img) || return 1
+	populate ${l} || return 1
+	losetup -d ${l}
+	echo root.img
+}
+bcachefs_rc() {
+	echo "@deadline=30 mount-bcachefs /sysroot ro LABEL=${ROOT_LABEL}"
+}
+
+lvm_tools() { echo lvm mkfs.ext4 ; }
+lvm_modules() { echo dm_mod ext4 ; }
+lvm_prepare() {
+	local l
+
+	[ -x "${LVM}" ] || { echo "qemu-boot-test: lvm: static lvm ${LVM} not found, use --lvm" >&2 ; return 1 ; }
+	truncate -s 128M pv.img
+	l=$(losetup -f --show pv.img) || return 1
+	lvm pvcreate -q ${l} > /dev/null &&
+		lvm vgcreate -q ${VG_NAME} ${l} > /dev/null &&
+		lvm lvcreate -q -y -n root -L 64M ${VG_NAME} > /dev/null &&
+		mkfs.ext4 -q -L ${ROOT_LABEL} -d "${WORKDIR}/rootfs" /dev/${VG_NAME}/root || return 1
+	lvm vgchange -q -an ${VG_NAME} > /dev/null
+	losetup -d ${l}
+	echo pv.img
+}
+lvm_rc() {
+	echo "@deadline=30 lvm-lv-activate LABEL=${ROOT_LABEL} ${VG_NAME} root"
+	echo "mount -o ro -t ext4 LABEL=${ROOT_LABEL} /sysroot"
+}
+
+bcache_tools() { echo make-bcache mkfs.ext4 ; }
+bcache_modules() { echo bcache ext4 ; }
+bcache_prepare() {
+	truncate -s 64M fs.img
+	mkfs.ext4 -q -L ${ROOT_LABEL} -d "${WORKDIR}/rootfs" fs.img || return 1
+	truncate -s 96M backing.img
+	truncate -s 64M cache.img
+	make-bcache -B backing.img -C cache.img > /dev/null || return 1
+	# the data of a backing device starts 8 KiB in unless make-bcache is told otherwise
+	dd if=fs.img of=backing.img bs=8k seek=1 conv=notrunc status=none || return 1
+	rm fs.img
+	echo backing.img cache.img
+}
+bcache_rc() {
+	echo "@deadline=30 bcache-cache-device-activate /dev/vdb"
+	echo "bcache-backing-device-activate LABEL=${ROOT_LABEL} /dev/vda"
+	echo "mount -o ro -t ext4 LABEL=${ROOT_LABEL} /sysroot"
+}
+
+# make the initramfs of a scenario in the current directory
+make_initrd() {
+	local fn="$1"
+	local root="$(pwd)/initrd-root"
+	local kver m
+
+	mkdir -p ${root}/{dev,proc,sys,run/lock,sysroot,sbin}
+	mknod -m 600 ${root}/dev/console c 5 1
+	cp "${INIT}" ${root}/init
+	[ "${fn}" = lvm ] && cp "${LVM}" ${root}/sbin/lvm
+
+	{
+		echo "coldplug"
+		if [ -n "${MODULES}" ] ; then
+			kver=$(basename "${MODULES}")
+			mkdir -p ${root}/lib/modules
+			cp -a "${MODULES}" ${root}/lib/modules/${kver}
+			for m in $(${fn}_modules) ; do
+				modprobe -d ${root} -S ${kver} --show-depends ${m} 2> /dev/null | \
+					sed -n "s|^insmod ${root}\(/[^ ]*\).*|insmod \1|p"
+			done | awk '!seen[$0]++'
+		fi
+		${fn}_rc
+		echo "switchroot /sysroot"
+	} > ${root}/startup.rc
+
+	(cd ${root} && find . | cpio -o -H newc --quiet) > initrd.cpio
+	rm -rf ${root}
+}
+
+# boot once, prints "<switchroot ms> <init ms> <init max rss KiB>"
+boot() {
+	local log="$1"
+	local drives=""
+	local img stats
+
+	shift
+	for img in "$@" ; do
+		drives="${drives} -drive file=${img},format=raw,if=virtio,snapshot=on"
+	done
+
+	timeout ${QEMU_TIMEOUT} ${QEMU} -machine q35,accel=tcg -cpu max -m 512 -smp 2 \
+		-display none -monitor none -no-reboot -serial file:${log} \
+		-kernel "${KERNEL}" -initrd initrd.cpio -append "console=ttyS0 panic=-1" \
+		${drives} > /dev/null 2>&1
+
+	grep -q "minitrd-test: new root reached" ${log} || return 1
+	stats=$(tr -d '\r' < ${log} | \
+		sed -n 's/.*switchroot \([0-9]*\) ms after kernel start, \([0-9]*\) ms in init, max rss \([0-9]*\) KiB.*, \([0-9]*\) failed$/\1 \2 \3 \4/p' | tail -n 1)
+	[ -n "${stats}" ] || return 1
+	# a line that failed means the scenario did not boot the way it should
+	[ "${stats##* }" = 0 ] || return 1
+	echo "${stats% *}"
+}
+
+rc=0
+results=""
+for sc in ${SCENARIOS} ; do
+	fn=${sc//-/_}
+	dir="${WORKDIR}/${sc}"
+	missing=""
+
+	type ${fn}_prepare > /dev/null 2>&1 || die "unknown scenario ${sc}"
+	for t in $(${fn}_tools) ; do
+		command -v ${t} > /dev/null || missing="${missing} ${t}"
+	done
+	if [ -n "${missing}" ] ; then
+		printf "%-12s skipped, missing%s\n" "${sc}" "${missing}"
+		continue
+	fi
+
+	mkdir -p "${dir}"
+	cd "${dir}" || die "cd ${dir} failed"
+	if ! images=$(${fn}_prepare) ; then
+		printf "%-12s FAILED to make the images\n" "${sc}"
+		rc=1
+		continue
+	fi
+	make_initrd ${fn}
+
+	times=""
+	rss=0
+	failed=0
+	for i in $(seq ${RUNS}) ; do
+		if ! stats=$(boot "${dir}/boot-${i}.log" ${images}) ; then
+			failed=1
+			break
+		fi
+		set -- ${stats}
+		times="${times} $1"
+		init_ms=$2
+		[ $3 -gt ${rss} ] && rss=$3
+	done
+	if [ ${failed} -ne 0 ] ; then
+		printf "%-12s FAILED to boot, serial console log:\n" "${sc}"
+		sed 's/^/    /' "${dir}/boot-${i}.log"
+		rc=1
+		continue
+	fi
+	ms=$(echo ${times} | tr ' ' '\n' | sort -n | sed -n "$(( (RUNS + 1) / 2 ))p")
+	results="${results}${sc} ${ms} ${init_ms} ${rss}"$'\n'
+
+	base=$(awk -v s=${sc} '$1 == s { print $2, $4 }' "${BASELINE}" 2> /dev/null)
+	if [ -z "${base}" ] ; then
+		printf "%-12s switchroot %6d ms  init rss %6d KiB  (no baseline)\n" "${sc}" ${ms} ${rss}
+		continue
+	fi
+	set -- ${base}
+	verdict=ok
+	if [ ${ms} -gt $(( $1 * (100 + TIME_TOLERANCE) / 100 )) ] || [ ${rss} -gt $(( $2 * (100 + RSS_TOLERANCE) / 100 )) ] ; then
+		verdict=REGRESSION
+		rc=1
+	fi
+	printf "%-12s switchroot %6d ms (baseline %6d)  init rss %6d KiB (baseline %6d)  %s\n" "${sc}" ${ms} $1 ${rss} $2 ${verdict}
+done
+
+if [ ${UPDATE} -eq 1 ] && [ -n "${results}" ] ; then
+	{
+		sed -n '/^#/p' "${BASELINE}" 2> /dev/null
+		{
+			grep -v '^#' "${BASELINE}" 2> /dev/null | while read sc rest ; do
+				[ -z "${sc}" ] || echo "${results}" | grep -q "^${sc} " || echo "${sc} ${rest}"
+			done
+			echo -n "${results}"
+		} | sort
+	} > "${BASELINE}.new" && mv "${BASELINE}.new" "${BASELINE}"
+	echo "baseline updated: ${BASELINE}"
+fi
+
+exit ${rc}
@@ -0,0 +1,233 @@
+#!/bin/bash
+
+# sandbox-test.sh
+#
+# Mount-tree tests for minitrd without a VM. For every scenario, disk images
+# are attached to loop devices and init --sandbox runs a startup.rc against
+# them from a tmpfs root, the way the kernel would start it from the
+# initramfs. The mounts init reports at the end are compared with the tree
+# the scenario expects: mount point, filesystem type and source.
+#
+# usage: sandbox-test.sh --init file [scenario...]
+#
+#   --init             the static init to test (make init-static)
+#
+# The scenarios are ext4 (the root by label), mount-table (the root by uuid
+# and its fstab with a second disk and a bind mount) and
+# btrfs-multi (raid1 over two disks), all of them by default. The images are
+# made with mkfs.ext4 and mkfs.btrfs and attached with losetup, so this runs
+# as root; a scenario whose tools are missing is skipped. Everything runs in
+# a private mount namespace, the host's mount tree is left alone.
+#
+# The exit code is 1 if a scenario failed a line or left a different mount
+# tree behind.
+
+ALL_SCENARIOS="ext4 mount-table btrfs-multi"
+
+# every image carries the root filesystem under this label
+ROOT_LABEL=minitrd-root
+DATA_LABEL=minitrd-data
+
+die() {
+	echo "sandbox-test: $*" >&2
+	exit 1
+}
+
+INIT=
+SCENARIOS=
+
+while [ $# -gt 0 ] ; do
+	case "$1" in
+		--init) INIT="$2" ; shift 2 ;;
+		-*) die "unknown option $1" ;;
+		*) SCENARIOS="${SCENARIOS} $1" ; shift ;;
+	esac
+done
+SCENARIOS="${SCENARIOS:-${ALL_SCENARIOS}}"
+
+[ -n "${INIT}" ] && [ -x "${INIT}" ] || die "--init must name the static init to test"
+[ "$(id -u)" -eq 0 ] || die "must run as root, the images are attached to loop devices"
+command -v losetup > /dev/null || die "losetup not found"
+command -v unshare > /dev/null || die "unshare not found"
+
+# the tmpfs roots and their mounts must not leak into the host
+if [ -z "${SANDBOX_TEST_NS}" ] ; then
+	SANDBOX_TEST_NS=1 exec unshare -m --propagation private "$0" --init "${INIT}" ${SCENARIOS}
+	die "failed to enter a private mount namespace"
+fi
+
+INIT=$(realpath "${INIT}")
+
+WORKDIR=$(mktemp -d)
+
+cleanup() {
+	local img
+
+	cd /
+	# the tmpfs roots hold binds of /dev and /sys, never delete through them
+	for img in "${WORKDIR}"/*/root ; do
+		umount -R "${img}" 2> /dev/null
+	done
+	for img in "${WORKDIR}"/*/*.img ; do
+		losetup -j "${img}" 2> /dev/null | cut -d: -f1 | xargs -r -n1 losetup -d
+	done
+	rm -rf --one-file-system "${WORKDIR}"
+}
+trap cleanup EXIT
+
+# the root filesystem every scenario switches to
+mkdir -p "${WORKDIR}"/rootfs/{sbin,dev,proc,sys,run,etc,srv,tmp,www}
+
+# Each scenario has a _tools function listing what it needs on the host, a
+# _prepare function making its images in the current directory and printing
+# them, a _rc function printing its startup.rc and an _expect function
+# printing the mounts it must leave behind, one "mountpoint type source" per
+# line. In _rc and _expect, @name stands for the loop device of name.img.
+
+ext4_tools() { echo mkfs.ext4 ; }
+ext4_prepare() {
+	truncate -s 64M root.img
+	mkfs.ext4 -q -L ${ROOT_LABEL} -d "${WORKDIR}/rootfs" root.img || return 1
+	echo root.img
+}
+ext4_rc() {
+	echo "mount -o ro -t ext4 LABEL=${ROOT_LABEL} /sysroot"
+	echo "switchroot /sysroot"
+}
+ext4_expect() {
+	echo "/ ext4 @root"
+}
+
+mount_table_tools() { echo mkfs.ext4 blkid ; }
+mount_table_prepare() {
+	local root="$(pwd)/rootfs"
+
+	cp -a "${WORKDIR}/rootfs" "${root}"
+	mkdir -p "${root}/srv/www"
+	# only block devices are mounted, the tmpfs and noauto entries are skipped
+	cat > "${root}/etc/fstab" <<-EOF
+		LABEL=${ROOT_LABEL}  /         ext4   ro               0 1
+		LABEL=${DATA_LABEL}  /srv      ext4   defaults         0 2
+		tmpfs                /tmp      tmpfs  mode=1777        0 0
+		/srv/www             /www      none   bind             0 0
+		LABEL=nonexistent    /mnt      ext4   noauto           0 0
+	EOF
+	truncate -s 64M root.img data.img
+	mkfs.ext4 -q -L ${ROOT_LABEL} -d "${root}" root.img || return 1
+	mkdir -p data/www
+	mkfs.ext4 -q -L ${DATA_LABEL} -d data data.img || return 1
+	rm -rf "${root}" data
+	echo root.img data.img
+}
+mount_table_rc() {
+	echo "mount -o ro -t ext4 UUID=$(blkid -o value -s UUID root.img) /sysroot"
+	echo "mount-table /sysroot/etc/fstab /sysroot 5"
+	echo "switchroot /sysroot"
+}
+mount_table_expect() {
+	echo "/ ext4 @root"
+	echo "/srv ext4 @data"
+	echo "/www ext4 @data"
+}
+
+btrfs_multi_tools() { echo mkfs.btrfs ; }
+btrfs_multi_prepare() {
+	truncate -s 256M disk1.img disk2.img
+	mkfs.btrfs -q -f -L ${ROOT_LABEL} -d raid1 -m raid1 --rootdir "${WORKDIR}/rootfs" disk1.img disk2.img > /dev/null || return 1
+	echo disk1.img disk2.img
+}
+btrfs_multi_rc() {
+	echo "mount-btrfs /sysroot ro LABEL=${ROOT_LABEL}"
+	echo "switchroot /sysroot"
+}
+btrfs_multi_expect() {
+	# the kernel names the member with the lowest devid
+	echo "/ btrfs @disk1"
+}
+
+# replace @name by the loop device of name.img
+subst_loops() {
+	local s="$1"
+	local img
+
+	for img in *.img ; do
+		s="${s//@${img%.img}/$(losetup -j "${img}" | cut -d: -f1)}"
+	done
+	echo "${s}"
+}
+
+attach() {
+	local img
+
+	for img in "$@" ; do
+		losetup -f "${img}" || return 1
+	done
+}
+
+# make the tmpfs root of a scenario in the current directory, as the kernel
+# would unpack the initramfs
+make_root() {
+	local fn="$1"
+	local root="$(pwd)/root"
+
+	mkdir -p ${root}
+	mount -t tmpfs tmpfs ${root} || return 1
+	mkdir -p ${root}/{dev,proc,sys,run,sysroot}
+	cp "${INIT}" ${root}/init
+	mount --rbind /dev ${root}/dev && mount --rbind /sys ${root}/sys || return 1
+	subst_loops "$(${fn}_rc)" > ${root}/startup.rc
+}
+
+rc=0
+for sc in ${SCENARIOS} ; do
+	fn=${sc//-/_}
+	dir="${WORKDIR}/${sc}"
+	missing=""
+
+	type ${fn}_prepare > /dev/null 2>&1 || die "unknown scenario ${sc}"
+	for t in $(${fn}_tools) ; do
+		command -v ${t} > /dev/null || missing="${missing} ${t}"
+	done
+	if [ -n "${missing}" ] ; then
+		printf "%-12s skipped, missing%s\n" "${sc}" "${missing}"
+		continue
+	fi
+
+	mkdir -p "${dir}"
+	cd "${dir}" || die "cd ${dir} failed"
+	images=$(${fn}_prepare)
+	if [ $? -ne 0 ] || ! attach ${images} ; then
+		printf "%-12s FAILED to make the images\n" "${sc}"
+		rc=1
+		continue
+	fi
+	if ! make_root ${fn} ; then
+		printf "%-12s FAILED to make the tmpfs root\n" "${sc}"
+		rc=1
+		continue
+	fi
+
+	chroot root /init --sandbox > sandbox.log 2>&1
+	status=$?
+
+	# the mountinfo lines init reports: mountpoint, then type and source after the "-"
+	awk '$1 == "<sandbox>" && $4 ~ /^[0-9]+:[0-9]+$/ {
+		for (i = 7; i <= NF && $i != "-"; i++) ;
+		print $6, $(i + 1), $(i + 2)
+	}' sandbox.log | sort > tree
+	subst_loops "$(${fn}_expect)" | sort > expected
+
+	if [ ${status} -ne 0 ] || grep -q "^<sandbox> *[0-9]* ms failed" sandbox.log ; then
+		printf "%-12s FAILED, exit code %d, init output:\n" "${sc}" ${status}
+		sed 's/^/    /' sandbox.log
+		rc=1
+	elif ! cmp -s tree expected ; then
+		printf "%-12s FAILED, wrong mount tree (- expected, + found):\n" "${sc}"
+		diff -u expected tree | sed -n 's/^\([-+][^-+]\)/    \1/p'
+		rc=1
+	else
+		printf "%-12s ok\n" "${sc}"
+	fi
+done
+
+exit ${rc}